@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "access_log.h"
+#include "metrics.h"
+
+thread_local access_log::thread_buffer* access_log::m_local = NULL;
+
+access_log* access_log::get_instance() {
+    static access_log instance;
+    return &instance;
+}
+
+bool access_log::open( const char* dir ) {
+    if ( mkdir( dir, 0755 ) < 0 && errno != EEXIST ) {
+        return false;
+    }
+    m_dir = strdup( dir );
+    // 第一个段文件直接创建，之后的由后台线程预先准备
+    if ( !open_segment( &m_current ) ) {
+        return false;
+    }
+    if ( pthread_create( &m_thread, NULL, preparer, this ) != 0 ) {
+        close_segment( &m_current );
+        return false;
+    }
+    m_lock.lock();
+    request();
+    m_lock.unlock();
+    m_enabled = true;
+    return true;
+}
+
+void access_log::close() {
+    if ( !m_enabled ) {
+        return;
+    }
+    m_enabled = false;
+    m_lock.lock();
+    thread_buffer* buffers = m_buffers;
+    m_lock.unlock();
+    for ( thread_buffer* buffer = buffers; buffer; buffer = buffer->next ) {
+        flush( buffer );
+    }
+    // 后台线程关闭写满的段文件后退出
+    m_lock.lock();
+    m_stop = true;
+    m_lock.unlock();
+    m_work.post();
+    pthread_join( m_thread, NULL );
+    close_segment( &m_current );
+    if ( m_spare.base ) {
+        // 没有用到的段文件没有记录，删除
+        char path[ 4096 ];
+        snprintf( path, sizeof( path ), "%s/access-%016lu.bin", m_dir, ( ( access_segment_header* )m_spare.base )->created_us );
+        close_segment( &m_spare );
+        unlink( path );
+    }
+}
+
+access_log::thread_buffer* access_log::add_buffer() {
+    thread_buffer* buffer = new thread_buffer;
+    buffer->count = 0;
+    buffer->first_ms = 0;
+    m_lock.lock();
+    buffer->next = m_buffers;
+    m_buffers = buffer;
+    m_lock.unlock();
+    m_local = buffer;
+    return buffer;
+}
+
+access_record* access_log::append() {
+    thread_buffer* buffer = m_local ? m_local : add_buffer();
+    if ( buffer->count == BUFFER_RECORDS ) {
+        flush( buffer );
+    }
+    if ( buffer->count == 0 ) {
+        buffer->first_ms = metrics::now_ns() / 1000000;
+    }
+    return &buffer->records[ buffer->count++ ];
+}
+
+void access_log::tick() {
+    thread_buffer* buffer = m_local;
+    if ( buffer && buffer->count > 0 && metrics::now_ns() / 1000000 - buffer->first_ms >= ( unsigned long )FLUSH_INTERVAL_MS ) {
+        flush( buffer );
+    }
+}
+
+// 把一个线程的缓冲区整个复制到段文件中，当前的段文件放不下时换成后台线程准备好的那一个
+void access_log::flush( thread_buffer* buffer ) {
+    m_lock.lock();
+    int done = 0;
+    while ( done < buffer->count ) {
+        size_t room = m_current.base ? ( SEGMENT_SIZE - sizeof( access_segment_header ) - m_current.used ) / sizeof( access_record ) : 0;
+        if ( room == 0 ) {
+            if ( !m_spare.base ) {
+                m_dropped.fetch_add( buffer->count - done, std::memory_order_relaxed );
+                request();
+                break;
+            }
+            // 后台线程先处理上一个写满的段文件再准备下一个，有准备好的段文件时m_retired一定是空的
+            m_retired = m_current;
+            m_current = m_spare;
+            m_spare.base = NULL;
+            request();
+            continue;
+        }
+        int count = buffer->count - done < ( int )room ? buffer->count - done : ( int )room;
+        memcpy( m_current.base + sizeof( access_segment_header ) + m_current.used, &buffer->records[ done ], count * sizeof( access_record ) );
+        m_current.used += count * sizeof( access_record );
+        ( ( access_segment_header* )m_current.base )->used = m_current.used;
+        m_records.fetch_add( count, std::memory_order_relaxed );
+        done += count;
+    }
+    buffer->count = 0;
+    m_lock.unlock();
+}
+
+void access_log::request() {
+    if ( !m_requested ) {
+        m_requested = true;
+        m_work.post();
+    }
+}
+
+// 后台线程：截断和关闭写满的段文件，准备下一个段文件，都在锁外进行
+void* access_log::preparer( void* arg ) {
+    access_log* log = ( access_log* )arg;
+    while ( true ) {
+        log->m_work.wait();
+        log->m_lock.lock();
+        log->m_requested = false;
+        bool stop = log->m_stop;
+        segment retired = log->m_retired;
+        log->m_retired.base = NULL;
+        bool prepare = !log->m_spare.base && !stop;
+        log->m_lock.unlock();
+
+        if ( retired.base ) {
+            log->close_segment( &retired );
+        }
+        if ( prepare ) {
+            segment spare;
+            if ( log->open_segment( &spare ) ) {
+                log->m_lock.lock();
+                log->m_spare = spare;
+                log->m_lock.unlock();
+            }
+            // 失败时等下一次需要换段文件时再试
+        }
+        if ( stop ) {
+            return NULL;
+        }
+    }
+}
+
+// 创建一个新的段文件并映射
+bool access_log::open_segment( segment* seg ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_REALTIME, &ts );
+    unsigned long created_us = ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+    char path[ 4096 ];
+    int fd = -1;
+    // 文件名是创建时间，按文件名排序就是写入的顺序
+    for ( int i = 0; i < 16; ++i ) {
+        snprintf( path, sizeof( path ), "%s/access-%016lu.bin", m_dir, created_us );
+        fd = ::open( path, O_RDWR | O_CREAT | O_EXCL, 0644 );
+        if ( fd >= 0 || errno != EEXIST ) {
+            break;
+        }
+        created_us++;
+    }
+    if ( fd < 0 ) {
+        return false;
+    }
+    // 稀疏文件在磁盘满时写映射会收到SIGBUS，所以先把整个段的空间分配好
+    int error = posix_fallocate( fd, 0, SEGMENT_SIZE );
+    if ( error != 0 ) {
+        ::close( fd );
+        unlink( path );
+        errno = error;      // posix_fallocate不设置errno，调用者打印的是errno
+        return false;
+    }
+    void* base = mmap( NULL, SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    if ( base == MAP_FAILED ) {
+        ::close( fd );
+        return false;
+    }
+    access_segment_header* header = ( access_segment_header* )base;
+    memcpy( header->magic, "WSACCESS", 8 );
+    header->version = access_segment_header::VERSION;
+    header->record_size = sizeof( access_record );
+    header->created_us = created_us;
+    header->used = 0;
+    seg->fd = fd;
+    seg->base = ( char* )base;
+    seg->used = 0;
+    return true;
+}
+
+// 解除映射，把文件截断到实际写入的长度
+void access_log::close_segment( segment* seg ) {
+    if ( !seg->base ) {
+        return;
+    }
+    munmap( seg->base, SEGMENT_SIZE );
+    if ( ftruncate( seg->fd, sizeof( access_segment_header ) + seg->used ) < 0 ) {
+        // 截断失败时文件末尾是0，解码工具按头部的used读取，不受影响
+    }
+    ::close( seg->fd );
+    seg->fd = -1;
+    seg->base = NULL;
+    seg->used = 0;
+}
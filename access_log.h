@@ -0,0 +1,133 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stddef.h>
+#include <atomic>
+#include "locker.h"
+
+/*
+    访问日志的一条记录，每个发送完的响应一条，固定128字节，整数都是小端（x86）。
+    记录不格式化成文本，解码工具tools/access_decode.cpp离线转换成文本或CSV
+*/
+struct access_record {
+    static const int URL_SIZE = 88;
+    static const unsigned char URL_TRUNCATED = 1;   // URL比URL_SIZE长，只记录了前面的部分
+    static const unsigned char KEEP_ALIVE = 2;      // 响应之后连接保持
+
+    unsigned long ts_us;        // 这个响应所在的一批发送完的时刻，UNIX时间，微秒
+    unsigned int addr;          // 客户端的IPv4地址，网络字节序
+    unsigned short port;        // 客户端的端口
+    unsigned short status;
+    unsigned long bytes;        // 响应的字节数（响应头和正文）
+    unsigned int queue_us;      // 在线程池的请求队列中等待的时间
+    unsigned int service_us;    // 从工作线程开始处理这一批到这个响应准备好：解析、查找文件和生成响应
+    unsigned int write_us;      // 从这一批响应准备好到全部发送完
+    unsigned char method;       // http_conn::METHOD
+    unsigned char flags;
+    unsigned short url_len;
+    char url[ URL_SIZE ];       // 不以'\0'结尾
+};
+static_assert( sizeof( access_record ) == 128, "access_record is a fixed on-disk layout" );
+
+/*
+    段文件的头部，占文件开头的64字节，记录紧跟在后面。
+    used是已经写入的记录的字节数，每次写入一批记录后更新；进程异常退出时段文件末尾可能有没有计入used的部分，解码时忽略
+*/
+struct access_segment_header {
+    static const unsigned int VERSION = 1;
+
+    char magic[8];              // "WSACCESS"
+    unsigned int version;
+    unsigned int record_size;
+    unsigned long created_us;
+    unsigned long used;
+    char reserved[ 32 ];
+};
+static_assert( sizeof( access_segment_header ) == 64, "access_segment_header is a fixed on-disk layout" );
+
+// 记录中的请求方法的名字，顺序和http_conn::METHOD相同
+inline const char* access_method_name( int method ) {
+    static const char* const NAMES[] = { "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT" };
+    return method >= 0 && method < ( int )( sizeof( NAMES ) / sizeof( NAMES[0] ) ) ? NAMES[ method ] : "-";
+}
+
+/*
+    二进制访问日志。每个线程把记录追加到自己的缓冲区（BUFFER_RECORDS条，线程第一次记录时分配），不加锁；
+    缓冲区满了，或者反应堆的时间轮tick时发现最早的记录已经超过FLUSH_INTERVAL_MS，才加锁把整个缓冲区复制到当前的段文件中。
+    段文件是目录下的access-<创建时间>.bin，创建时用posix_fallocate分配SEGMENT_SIZE的磁盘空间并映射到内存，写满后截断到实际长度，再换一个新的段文件；
+    复制进映射就完成了写入，由内核按顺序写回磁盘，请求处理中没有write系统调用。
+    创建、截断和关闭段文件都由后台线程完成：它总是预先准备好下一个段文件，当前的写满时反应堆在锁内只交换指针，
+    写满的交给后台线程截断和关闭，然后它再准备下一个。空间在创建时就分配好，写映射时不会因为磁盘满而收到SIGBUS；
+    需要换段文件时下一个还没有准备好（分配失败，或者后台线程还没来得及），这一批记录计入丢弃数。
+    只有发送完的响应才有记录，发送过程中连接出错或超时关闭的那一批响应不记录
+*/
+class access_log
+{
+public:
+    static const int BUFFER_RECORDS = 256;                  // 每个线程的缓冲区，32KB
+    static const size_t SEGMENT_SIZE = 64UL << 20;          // 每个段文件64MB，约52万条记录
+    static const int FLUSH_INTERVAL_MS = 1000;              // 记录在线程缓冲区中最多停留的时间
+
+public:
+    static access_log* get_instance();
+
+    // 在目录dir中创建第一个段文件，开始记录
+    bool open( const char* dir );
+    // 写出所有线程的缓冲区并截断当前的段文件。只能在所有记录日志的线程都停止后调用
+    void close();
+    bool enabled() const { return m_enabled; }
+
+    // 当前线程的缓冲区中的下一条记录，由调用者填写；缓冲区已满时先写出
+    access_record* append();
+    // 反应堆每个时间轮tick调用一次，当前线程的缓冲区中最早的记录超过FLUSH_INTERVAL_MS时写出
+    void tick();
+
+    unsigned long records() const { return m_records.load( std::memory_order_relaxed ); }  // 已经写入段文件的记录数
+    unsigned long dropped() const { return m_dropped.load( std::memory_order_relaxed ); }  // 没有可用的段文件而丢弃的记录数
+
+private:
+    // 一个映射好的段文件，base为NULL表示没有
+    struct segment {
+        int fd;
+        char* base;
+        size_t used;            // 记录的字节数
+    };
+
+    // 一个线程的缓冲区
+    struct thread_buffer {
+        access_record records[ BUFFER_RECORDS ];
+        int count;
+        unsigned long first_ms;     // 缓冲区中最早的记录加入的时刻（单调时钟，毫秒）
+        thread_buffer* next;
+    };
+
+private:
+    access_log() : m_enabled( false ), m_dir( NULL ), m_buffers( NULL ), m_stop( false ), m_requested( false ),
+                   m_records( 0 ), m_dropped( 0 ) {
+        m_current.base = m_spare.base = m_retired.base = NULL;
+    }
+    thread_buffer* add_buffer();
+    void flush( thread_buffer* buffer );
+    void request();     // 唤醒后台线程关闭写满的段文件、准备下一个，调用者持有m_lock
+    static void* preparer( void* arg );
+    bool open_segment( segment* seg );
+    void close_segment( segment* seg );
+
+private:
+    static thread_local thread_buffer* m_local;
+    bool m_enabled;
+    char* m_dir;
+    locker m_lock;              // 保护三个段文件、缓冲区链表和下面两个标志
+    segment m_current;          // 正在写入的段文件
+    segment m_spare;            // 后台线程准备好的下一个段文件
+    segment m_retired;          // 写满了、等后台线程截断和关闭的段文件
+    thread_buffer* m_buffers;
+    pthread_t m_thread;         // 后台线程
+    sem m_work;                 // 有工作时唤醒后台线程
+    bool m_stop;
+    bool m_requested;           // 已经唤醒后台线程，它还没有开始处理
+    std::atomic<unsigned long> m_records;   // 在锁内修改，输出指标时不加锁读
+    std::atomic<unsigned long> m_dropped;
+};
+
+#endif
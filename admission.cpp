@@ -0,0 +1,47 @@
+#include <sys/socket.h>
+#include <unistd.h>
+#include "admission.h"
+#include "http_response.h"
+
+admission* admission::get_instance() {
+    static admission instance;
+    return &instance;
+}
+
+void admission::configure( int high_depth, int low_depth, unsigned long max_wait_ns, int ( *depth )() ) {
+    m_high_depth = high_depth;
+    m_low_depth = low_depth;
+    m_max_wait_ns = max_wait_ns;
+    m_depth = depth;
+}
+
+void admission::update() {
+    if ( !m_depth ) {
+        return;
+    }
+    int depth = m_depth();
+    m_last_depth.store( depth, std::memory_order_relaxed );
+    unsigned long slow = m_slow_ns.load( std::memory_order_relaxed );
+    bool recent_slow = slow && metrics::now_ns() - slow < WINDOW_NS;
+    // 高低水位之间保持原来的状态，避免在一个值附近来回切换
+    bool overloaded = m_overloaded.load( std::memory_order_relaxed )
+                    ? depth > m_low_depth || recent_slow
+                    : depth >= m_high_depth || recent_slow;
+    m_overloaded.store( overloaded, std::memory_order_relaxed );
+}
+
+void admission::send_unavailable( int sockfd ) {
+    const static_response* response = unavailable_response();
+    send( sockfd, response->data, response->len, MSG_DONTWAIT | MSG_NOSIGNAL );
+    metrics::local()->count_status( 503 );
+}
+
+void admission::refuse( int sockfd ) {
+    send_unavailable( sockfd );
+    metrics::local()->count( CNT_SHED_ACCEPT );
+    // 关闭时接收缓冲区中还有未读的请求的话，内核会发RST而不是FIN，客户端可能收不到503，所以先读掉已经到达的数据
+    shutdown( sockfd, SHUT_WR );
+    char sink[ 4096 ];
+    recv( sockfd, sink, sizeof( sink ), MSG_DONTWAIT );
+    close( sockfd );
+}
@@ -0,0 +1,65 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <atomic>
+#include "metrics.h"
+
+/*
+    过载保护（准入控制）。两个信号决定服务器是否过载：
+        线程池请求队列的长度，由反应堆每个时间轮tick采样一次，达到高水位进入过载，降到低水位以下才恢复；
+        请求在队列中等待的时间，工作线程发现超过上限时记下时刻，之后的一个观察窗口内都算过载。
+    请求队列已满、入队失败时立即进入过载。
+    过载期间反应堆接受的新连接不再注册，直接回复预先生成的503（带Retry-After）后关闭，不解析请求、不占用缓冲区和队列；
+    已经建立的连接照常处理，只有入队失败的那个连接收到503并被关闭。
+    状态只有一个标志位，反应堆和工作线程都只做relaxed的读写，正常负载下工作线程只多一次比较。
+*/
+class admission
+{
+public:
+    static const unsigned long WINDOW_NS = 500000000UL;    // 排队时间超限之后保持过载的时间，0.5秒
+
+public:
+    static admission* get_instance();
+
+    // high_depth/low_depth是队列长度的高低水位，max_wait_ns是排队时间的上限，depth返回请求队列当前的长度
+    void configure( int high_depth, int low_depth, unsigned long max_wait_ns, int ( *depth )() );
+
+    // 反应堆接受一个连接后调用，过载时返回false，调用者用refuse拒绝这个连接
+    bool admit() const { return !m_overloaded.load( std::memory_order_relaxed ); }
+
+    // 工作线程开始处理一个连接时调用，ns是它在队列中等待的时间
+    void queue_waited( unsigned long ns ) {
+        if ( ns > m_max_wait_ns ) {
+            m_slow_ns.store( metrics::now_ns(), std::memory_order_relaxed );
+        }
+    }
+
+    // 请求队列已满，调用者用send_unavailable回复503后关闭连接
+    void queue_full() { m_overloaded.store( true, std::memory_order_relaxed ); }
+
+    // 反应堆每个时间轮tick调用一次，重新判断是否过载
+    void update();
+
+    bool overloaded() const { return m_overloaded.load( std::memory_order_relaxed ); }
+    int last_depth() const { return m_last_depth.load( std::memory_order_relaxed ); }
+
+    // 直接在socket上发送503响应，不经过连接的发送队列，发不完也不重试
+    static void send_unavailable( int sockfd );
+    // 回复503并关闭一个刚接受、还没有注册的连接
+    static void refuse( int sockfd );
+
+private:
+    admission() : m_high_depth( 0 ), m_low_depth( 0 ), m_max_wait_ns( ~0UL ), m_depth( NULL ),
+                  m_overloaded( false ), m_slow_ns( 0 ), m_last_depth( 0 ) {}
+
+private:
+    int m_high_depth;
+    int m_low_depth;
+    unsigned long m_max_wait_ns;
+    int ( *m_depth )();
+    std::atomic<bool> m_overloaded;
+    std::atomic<unsigned long> m_slow_ns;   // 最近一次排队时间超限的时刻
+    std::atomic<int> m_last_depth;          // 最近一次采样的队列长度
+};
+
+#endif
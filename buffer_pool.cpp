@@ -0,0 +1,88 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "buffer_pool.h"
+
+buffer_pool* buffer_pool::get_instance() {
+    static buffer_pool instance;
+    return &instance;
+}
+
+buffer_pool::buffer_pool() {
+    for( int i = 0; i < CLASS_COUNT; ++i ) {
+        m_classes[i].free_list = NULL;
+        memset( &m_classes[i].stats, 0, sizeof( m_classes[i].stats ) );
+        m_classes[i].stats.block_size = MIN_BLOCK_SIZE << i;
+    }
+}
+
+// 返回能容纳size字节的最小等级，超过最大的块时返回-1
+int buffer_pool::class_index( size_t size ) {
+    int index = 0;
+    size_t block_size = MIN_BLOCK_SIZE;
+    while( block_size < size ) {
+        block_size <<= 1;
+        if( ++index >= CLASS_COUNT ) {
+            return -1;
+        }
+    }
+    return index;
+}
+
+char* buffer_pool::acquire( size_t size, size_t* capacity ) {
+    int index = class_index( size );
+    if( index < 0 ) {
+        return NULL;
+    }
+    size_class& c = m_classes[ index ];
+    size_t block_size = c.stats.block_size;
+
+    c.lock.lock();
+    if( !c.free_list ) {
+        // 空闲链表为空，申请一个新的slab切成块，整个挂到空闲链表上。slab一直保留到进程退出
+        char* slab = ( char* )malloc( SLAB_SIZE );
+        if( !slab ) {
+            c.lock.unlock();
+            return NULL;
+        }
+        for( size_t off = 0; off + block_size <= SLAB_SIZE; off += block_size ) {
+            free_block* b = ( free_block* )( slab + off );
+            b->next = c.free_list;
+            c.free_list = b;
+            c.stats.free++;
+        }
+        c.stats.slabs++;
+    }
+    free_block* b = c.free_list;
+    c.free_list = b->next;
+    c.stats.free--;
+    c.stats.in_use++;
+    c.lock.unlock();
+
+    *capacity = block_size;
+    return ( char* )b;
+}
+
+void buffer_pool::release( char* block, size_t size ) {
+    if( !block ) {
+        return;
+    }
+    int index = class_index( size );
+    assert( index >= 0 );
+    size_class& c = m_classes[ index ];
+
+    free_block* b = ( free_block* )block;
+    c.lock.lock();
+    b->next = c.free_list;
+    c.free_list = b;
+    c.stats.free++;
+    c.stats.in_use--;
+    c.lock.unlock();
+}
+
+void buffer_pool::get_stats( int index, buffer_class_stats* stats ) {
+    size_class& c = m_classes[ index ];
+    c.lock.lock();
+    *stats = c.stats;
+    c.lock.unlock();
+}
@@ -0,0 +1,59 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+#include "locker.h"
+
+// 一个大小等级的统计信息
+struct buffer_class_stats
+{
+    size_t block_size;          // 这个等级的块大小
+    unsigned long slabs;        // 已经向系统申请的slab数量
+    unsigned long in_use;       // 正在被连接使用的块数
+    unsigned long free;         // 空闲链表中的块数
+};
+
+/*
+    进程内共享的按大小分级的缓冲区池，连接的读写缓冲区都从这里取。
+    每个等级的块大小是上一级的两倍，从MIN_BLOCK_SIZE到MAX_BLOCK_SIZE；每次向系统申请一个SLAB_SIZE的slab，切成同样大小的块。
+    释放的块挂到所属等级的空闲链表上，不还给系统，下一个连接直接复用；每个等级一把锁，不同等级之间互不影响。
+*/
+class buffer_pool
+{
+public:
+    static const int CLASS_COUNT = 7;
+    static const size_t MIN_BLOCK_SIZE = 1024;                              // 最小的块，1KB
+    static const size_t MAX_BLOCK_SIZE = MIN_BLOCK_SIZE << ( CLASS_COUNT - 1 );  // 最大的块，64KB
+    static const size_t SLAB_SIZE = 64 * 1024;                              // 每次向系统申请的字节数
+
+public:
+    static buffer_pool* get_instance();
+
+    // 取一个至少size字节的块，实际大小通过capacity返回；size超过MAX_BLOCK_SIZE或内存不足时返回NULL
+    char* acquire( size_t size, size_t* capacity );
+    // 归还acquire得到的块，size可以是acquire时申请的大小，也可以是返回的实际大小
+    void release( char* block, size_t size );
+
+    void get_stats( int index, buffer_class_stats* stats );
+
+private:
+    buffer_pool();
+
+    static int class_index( size_t size );
+
+private:
+    // 空闲块的开头用来存放链表指针
+    struct free_block {
+        free_block* next;
+    };
+    // 一个大小等级，各自加锁，对齐到缓存行避免相邻等级的锁互相干扰
+    struct alignas( 64 ) size_class {
+        locker lock;
+        free_block* free_list;
+        buffer_class_stats stats;
+    };
+
+    size_class m_classes[ CLASS_COUNT ];
+};
+
+#endif
@@ -0,0 +1,111 @@
+#include <new>
+#include <sys/mman.h>
+#include "conn_table.h"
+
+conn_table::conn_table( int capacity, bool huge_pages ) : m_huge_pages( huge_pages ), m_chunk_count( 0 ), m_live( 0 ) {
+    if ( capacity <= 0 ) {
+        throw std::exception();
+    }
+    if ( capacity > MAX_CAPACITY ) {
+        capacity = MAX_CAPACITY;
+    }
+    m_capacity = capacity;
+    if ( huge_pages ) {
+        // 一块占一个大页
+        m_chunk_bits = 0;
+        while ( ( 2UL << m_chunk_bits ) * sizeof( http_conn ) <= HUGE_PAGE_SIZE ) {
+            m_chunk_bits++;
+        }
+        m_chunk_bytes = HUGE_PAGE_SIZE;
+    } else {
+        long page = sysconf( _SC_PAGESIZE );
+        m_chunk_bits = CHUNK_BITS;
+        m_chunk_bytes = ( ( ( 1UL << CHUNK_BITS ) * sizeof( http_conn ) + page - 1 ) / page ) * page;
+    }
+    int chunks = ( capacity + ( 1 << m_chunk_bits ) - 1 ) >> m_chunk_bits;
+    m_chunks = new http_conn*[ chunks ]();
+}
+
+conn_table::~conn_table() {
+    int count = 1 << m_chunk_bits;
+    for ( int i = 0; i < m_chunk_count; ++i ) {
+        for ( int j = 0; j < count; ++j ) {
+            m_chunks[i][j].~http_conn();
+        }
+        munmap( m_chunks[i], m_chunk_bytes );
+    }
+    delete [] m_chunks;
+}
+
+http_conn* conn_table::map_chunk() {
+    void* addr = MAP_FAILED;
+    if ( m_huge_pages ) {
+        addr = mmap( NULL, m_chunk_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+        if ( addr == MAP_FAILED ) {
+            // 没有预留的大页：多映射一个大页，裁掉两头使块按2MB对齐，再请求透明大页
+            char* raw = ( char* )mmap( NULL, m_chunk_bytes + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+            if ( raw != MAP_FAILED ) {
+                char* aligned = ( char* )( ( ( unsigned long )raw + HUGE_PAGE_SIZE - 1 ) & ~( HUGE_PAGE_SIZE - 1 ) );
+                char* end = raw + m_chunk_bytes + HUGE_PAGE_SIZE;
+                if ( aligned > raw ) {
+                    munmap( raw, aligned - raw );
+                }
+                if ( end > aligned + m_chunk_bytes ) {
+                    munmap( aligned + m_chunk_bytes, end - ( aligned + m_chunk_bytes ) );
+                }
+                madvise( aligned, m_chunk_bytes, MADV_HUGEPAGE );
+                addr = aligned;
+            }
+        }
+    } else {
+        addr = mmap( NULL, m_chunk_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    }
+    if ( addr == MAP_FAILED ) {
+        return NULL;
+    }
+    // 映射按页对齐，满足http_conn的缓存行对齐
+    http_conn* chunk = ( http_conn* )addr;
+    int count = 1 << m_chunk_bits;
+    for ( int i = 0; i < count; ++i ) {
+        new ( chunk + i ) http_conn();
+    }
+    return chunk;
+}
+
+http_conn* conn_table::acquire() {
+    m_lock.lock();
+    if ( m_free.empty() ) {
+        // 空闲栈空了，分配下一块；最后一块只用到容量为止
+        int base = m_chunk_count << m_chunk_bits;
+        http_conn* chunk = base < m_capacity ? map_chunk() : NULL;
+        if ( !chunk ) {
+            m_lock.unlock();
+            return NULL;
+        }
+        int size = 1 << m_chunk_bits;
+        int count = m_capacity - base < size ? m_capacity - base : size;
+        // 倒序入栈，先用编号小的槽位
+        for ( int i = count - 1; i >= 0; --i ) {
+            chunk[i].m_slot = base + i;
+            m_free.push_back( base + i );
+        }
+        m_chunks[ m_chunk_count++ ] = chunk;
+    }
+    unsigned int slot = m_free.back();
+    m_free.pop_back();
+    m_live++;
+    m_lock.unlock();
+    return at( slot );
+}
+
+void conn_table::release( http_conn* conn ) {
+    m_lock.lock();
+    m_free.push_back( conn->m_slot );
+    m_live--;
+    m_lock.unlock();
+}
+
+http_conn* conn_table::lookup( unsigned long handle ) const {
+    http_conn* conn = at( ( unsigned int )handle );
+    return conn && conn->handle() == handle ? conn : NULL;
+}
@@ -0,0 +1,61 @@
+#ifndef CONN_TABLE_H
+#define CONN_TABLE_H
+
+#include <vector>
+#include "locker.h"
+#include "http_conn.h"
+
+/*
+    连接表：http_conn按槽位编号存放，不再按fd索引，epoll和io_uring中登记的是句柄（高32位是连接的代数，低32位是槽位）。
+    槽位分块分配，每块CHUNK_SIZE个连接，用到一块时才分配；块指针数组按容量一次分配好，块分配之后不会移动也不会释放，
+    工作线程和排队中的任务持有的http_conn*一直有效，内存随同时存在的连接数的峰值增长，而不是按fd的上限预留。
+    关闭的槽位放进空闲栈，优先复用最近释放的槽位；槽位被复用时连接的代数已经改变，旧连接迟到的事件按句柄找不到连接。
+    分配和释放只在接受和关闭连接时发生，多个反应堆共享一把锁；按句柄查找不加锁（查找的都是本反应堆自己分配的槽位）。
+    huge_pages为true时每块是一个按2MB对齐的映射，先尝试预留的大页（MAP_HUGETLB），没有预留时用madvise请求透明大页；
+    每块放2MB中能放下的2的幂个连接，按句柄查找连接和时间轮遍历定时器时访问的连接都在少数几个大页中，TLB缺失更少。
+*/
+class conn_table
+{
+public:
+    static const int CHUNK_BITS = 10;           // 不使用大页时每块1024个连接
+    static const int MAX_CAPACITY = 1 << 24;    // io_uring的user_data中槽位只有24位
+    static const size_t HUGE_PAGE_SIZE = 2UL << 20;
+
+public:
+    explicit conn_table( int capacity, bool huge_pages = false );
+    ~conn_table();
+
+    // 分配一个槽位，表满时返回NULL
+    http_conn* acquire();
+    // 释放连接的槽位，只在连接关闭后调用
+    void release( http_conn* conn );
+
+    // 按槽位取连接，槽位所在的块还没有分配时返回NULL
+    http_conn* at( unsigned int slot ) const {
+        http_conn* chunk = slot < ( unsigned int )m_capacity ? m_chunks[ slot >> m_chunk_bits ] : NULL;
+        return chunk ? chunk + ( slot & ( ( 1u << m_chunk_bits ) - 1 ) ) : NULL;
+    }
+    // 按句柄取连接，槽位上已经是另一代连接（或者没有连接）时返回NULL
+    http_conn* lookup( unsigned long handle ) const;
+
+    int capacity() const { return m_capacity; }
+    int live() const { return m_live; }
+    int chunks() const { return m_chunk_count; }
+    bool huge_pages() const { return m_huge_pages; }
+
+private:
+    http_conn* map_chunk();     // 映射并构造一块连接，失败时返回NULL
+
+private:
+    int m_capacity;
+    bool m_huge_pages;
+    int m_chunk_bits;               // 每块1 << m_chunk_bits个连接
+    size_t m_chunk_bytes;           // 每块映射的字节数
+    http_conn** m_chunks;           // 块指针数组，大小为容量除以每块的连接数
+    int m_chunk_count;              // 已经分配的块数，槽位从小到大按块使用
+    std::vector< unsigned int > m_free;     // 空闲的槽位（只含已分配的块中的）
+    int m_live;
+    locker m_lock;
+};
+
+#endif
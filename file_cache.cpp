@@ -0,0 +1,537 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#include "file_cache.h"
+#include "http_response.h"
+
+file_cache* file_cache::get_instance() {
+    static file_cache instance;
+    return &instance;
+}
+
+file_cache::file_cache() : m_lru_head( NULL ), m_lru_tail( NULL ), m_max_bytes( DEFAULT_MAX_BYTES ) {
+    memset( m_buckets, 0, sizeof( m_buckets ) );
+    memset( &m_stats, 0, sizeof( m_stats ) );
+}
+
+file_cache::~file_cache() {
+    file_entry* tmp = m_lru_head;
+    while( tmp ) {
+        file_entry* next = tmp->lru_next;
+        if( tmp->refcount == 0 ) {
+            destroy( tmp );
+        }
+        tmp = next;
+    }
+}
+
+// FNV-1a 哈希
+unsigned int file_cache::hash_path( const char* path ) {
+    unsigned int h = 2166136261u;
+    for( ; *path; ++path ) {
+        h ^= ( unsigned char )*path;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// 判断两次stat得到的是不是同一个、未被修改过的文件
+bool file_cache::same_file( const struct stat& a, const struct stat& b ) {
+    return a.st_ino == b.st_ino && a.st_dev == b.st_dev && a.st_size == b.st_size
+        && a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+void file_cache::set_max_bytes( long max_bytes ) {
+    m_lock.lock();
+    m_max_bytes = max_bytes;
+    evict();
+    m_lock.unlock();
+}
+
+void file_cache::get_stats( file_cache_stats* stats ) {
+    m_lock.lock();
+    *stats = m_stats;
+    m_lock.unlock();
+}
+
+file_cache::FILE_STATUS file_cache::acquire( const char* path, file_entry** entry ) {
+    unsigned int hash = hash_path( path );
+    bool dead = false;
+
+    m_lock.lock();
+    file_entry* e = find( path, hash, ENCODING_IDENTITY );
+    if( e ) {
+        time_t now = time( NULL );
+        if( now - e->checked < VALID_SECONDS ) {
+            // 命中，且还在有效期内，不需要任何系统调用
+            e->refcount++;
+            lru_remove( e );
+            lru_push_front( e );
+            m_stats.hits++;
+            m_lock.unlock();
+            *entry = e;
+            return FILE_OK;
+        }
+        // 超过有效期，在锁外重新stat，校验文件是否被修改过
+        e->refcount++;
+        e->checked = now;
+        m_lock.unlock();
+
+        struct stat st;
+        int ret = stat( path, &st );
+
+        m_lock.lock();
+        if( ret == 0 && !e->stale && same_file( st, e->st ) ) {
+            lru_remove( e );
+            lru_push_front( e );
+            m_stats.hits++;
+            m_lock.unlock();
+            *entry = e;
+            return FILE_OK;
+        }
+        // 文件已被修改或删除，让缓存项失效，按未命中处理
+        if( !e->stale ) {
+            retire( e );
+            m_stats.invalidations++;
+        }
+        dead = ( --e->refcount == 0 );
+    }
+    m_lock.unlock();
+    if( dead ) {
+        destroy( e );
+    }
+
+    // 未命中，在锁外完成stat和open
+    file_entry* loaded = NULL;
+    FILE_STATUS status = load( path, hash, &loaded );
+    if( status != FILE_OK ) {
+        m_lock.lock();
+        m_stats.misses++;
+        m_lock.unlock();
+        return status;
+    }
+    return publish( loaded, entry );
+}
+
+file_cache::FILE_STATUS file_cache::acquire_gzip( file_entry* plain, file_entry** entry ) {
+    bool dead = false;
+
+    m_lock.lock();
+    file_entry* e = find( plain->path, plain->hash, ENCODING_GZIP );
+    if( e ) {
+        // 变体必须由当前版本的原文件生成；预压缩文件和没有变体的标记超过有效期后重新加载，在内存中压缩的变体不会变化
+        bool recheck = e->sidecar || e->no_variant;
+        if( same_file( e->src_st, plain->st ) && ( !recheck || time( NULL ) - e->checked < VALID_SECONDS ) ) {
+            if( e->no_variant ) {
+                lru_remove( e );
+                lru_push_front( e );
+                m_stats.hits++;
+                m_lock.unlock();
+                return FILE_NOT_FOUND;
+            }
+            e->refcount++;
+            lru_remove( e );
+            lru_push_front( e );
+            m_stats.hits++;
+            m_lock.unlock();
+            *entry = e;
+            return FILE_OK;
+        }
+        retire( e );
+        m_stats.invalidations++;
+        dead = ( e->refcount == 0 );
+    }
+    m_lock.unlock();
+    if( dead ) {
+        destroy( e );
+    }
+
+    // 未命中，在锁外打开预压缩文件或压缩原文件
+    file_entry* loaded = NULL;
+    FILE_STATUS status = load_gzip( plain, &loaded );
+    if( status != FILE_OK ) {
+        if( loaded ) {
+            // 确定没有变体，缓存标记，publish会计入未命中
+            file_entry* marker = NULL;
+            publish( loaded, &marker );
+            release( marker );
+        } else {
+            m_lock.lock();
+            m_stats.misses++;
+            m_lock.unlock();
+        }
+        return status;
+    }
+    return publish( loaded, entry );
+}
+
+// 把在锁外加载的缓存项加入缓存并返回给调用者，引用计数为1
+file_cache::FILE_STATUS file_cache::publish( file_entry* loaded, file_entry** entry ) {
+    m_lock.lock();
+    m_stats.misses++;
+    if( loaded->encoding == ENCODING_GZIP && !loaded->sidecar && !loaded->no_variant ) {
+        m_stats.compressions++;
+    }
+    file_entry* e = find( loaded->path, loaded->hash, loaded->encoding );
+    if( e && same_file( e->src_st, loaded->src_st ) && same_file( e->st, loaded->st ) ) {
+        // 其他线程已经加载了同一个文件，使用已有的缓存项
+        e->refcount++;
+        lru_remove( e );
+        lru_push_front( e );
+        m_lock.unlock();
+        destroy( loaded );
+        *entry = e;
+        return FILE_OK;
+    }
+    if( e ) {
+        retire( e );
+        m_stats.invalidations++;
+        if( e->refcount == 0 ) {
+            destroy( e );
+        }
+    }
+    loaded->refcount = 1;
+    if( loaded->st.st_size <= m_max_bytes ) {
+        insert( loaded );
+        evict();
+    } else {
+        // 比整个预算还大的文件不进入缓存，由本次请求独占，释放时直接销毁
+        loaded->stale = true;
+    }
+    m_lock.unlock();
+    *entry = loaded;
+    return FILE_OK;
+}
+
+void file_cache::release( file_entry* entry ) {
+    if( !entry ) {
+        return;
+    }
+    m_lock.lock();
+    bool dead = ( --entry->refcount == 0 ) && entry->stale;
+    m_lock.unlock();
+    if( dead ) {
+        destroy( entry );
+    }
+}
+
+int file_cache::open_fd( file_entry* entry ) {
+    m_lock.lock();
+    int fd = entry->fd;
+    m_lock.unlock();
+    if( fd >= 0 ) {
+        return fd;
+    }
+    // 在锁外打开，其他线程同时打开了同一个缓存项时使用先完成的那个
+    fd = open( entry->sidecar ? entry->sidecar : entry->path, O_RDONLY );
+    if( fd < 0 ) {
+        return -1;
+    }
+    // 缓存项的状态信息（响应头中的长度和ETag、映射的长度）来自之前的stat，文件在那之后被替换或截短时打开的已经不是同一个文件
+    struct stat st;
+    if( fstat( fd, &st ) < 0 || !same_file( st, entry->st ) ) {
+        close( fd );
+        m_lock.lock();
+        if( !entry->stale ) {
+            retire( entry );
+            m_stats.invalidations++;
+        }
+        m_lock.unlock();
+        errno = ESTALE;
+        return -1;
+    }
+    m_lock.lock();
+    if( entry->fd < 0 ) {
+        entry->fd = fd;
+        fd = -1;
+    }
+    int result = entry->fd;
+    m_lock.unlock();
+    if( fd >= 0 ) {
+        close( fd );
+    }
+    return result;
+}
+
+char* file_cache::map( file_entry* entry ) {
+    if( entry->st.st_size > 0 && open_fd( entry ) < 0 ) {
+        return NULL;
+    }
+    m_lock.lock();
+    if( !entry->address && entry->st.st_size > 0 ) {
+        char* address = ( char* )mmap( 0, entry->st.st_size, PROT_READ, MAP_PRIVATE, entry->fd, 0 );
+        if( address != MAP_FAILED ) {
+            entry->address = address;
+        }
+    }
+    char* address = entry->address;
+    m_lock.unlock();
+    return address;
+}
+
+// stat文件，生成一个新的缓存项（还没有加入缓存），打开文件推迟到open_fd()中，映射推迟到map()中
+file_cache::FILE_STATUS file_cache::load( const char* path, unsigned int hash, file_entry** entry ) {
+    struct stat st;
+    if( stat( path, &st ) < 0 ) {
+        return FILE_NOT_FOUND;
+    }
+    // 判断访问权限
+    if( !( st.st_mode & S_IROTH ) ) {
+        return FILE_FORBIDDEN;
+    }
+    // 判断是否是目录
+    if( S_ISDIR( st.st_mode ) ) {
+        return FILE_IS_DIR;
+    }
+    file_entry* e = new_entry( path, hash, -1, st );
+    // 响应头只和文件有关，每个缓存项生成一次，文件变化后缓存项失效，响应头也随之重新生成
+    char header[ MAX_HEADER_LEN ];
+    bool compressible = mime_compressible( path );
+    int header_len = render_file_header( path, st.st_size, st.st_mtime, e->etag, false, compressible, header, sizeof( header ) );
+    if( header_len < 0 ) {
+        destroy( e );
+        return FILE_ERROR;
+    }
+
+    e->header = ( char* )malloc( header_len );
+    memcpy( e->header, header, header_len );
+    e->header_len = header_len;
+    e->compressible = compressible;
+    *entry = e;
+    return FILE_OK;
+}
+
+/*
+    生成原文件plain的gzip变体（还没有加入缓存）。没有变体时返回FILE_NOT_FOUND或FILE_ERROR，
+    其中原文件太大又没有预压缩文件、压缩失败这两种不会很快改变的情况，通过entry返回一个no_variant标记，其余情况entry为NULL
+*/
+file_cache::FILE_STATUS file_cache::load_gzip( file_entry* plain, file_entry** entry ) {
+    *entry = NULL;
+    // 预压缩文件path.gz，比原文件旧的不用（原文件更新后忘了重新压缩）；和原文件一样，需要发送内容时才打开
+    int len = strlen( plain->path );
+    char* sidecar = ( char* )malloc( len + 4 );
+    memcpy( sidecar, plain->path, len );
+    memcpy( sidecar + len, ".gz", 4 );
+    struct stat st;
+    int fd = -1;
+    if( !( stat( sidecar, &st ) == 0 && S_ISREG( st.st_mode ) && ( st.st_mode & S_IROTH )
+           && st.st_mtime >= plain->st.st_mtime ) ) {
+        free( sidecar );
+        sidecar = NULL;
+        if( plain->st.st_size > MAX_GZIP_BYTES ) {
+            *entry = new_no_variant( plain );
+            return FILE_NOT_FOUND;
+        }
+        int plain_fd = open_fd( plain );
+        if( plain_fd < 0 ) {
+            return FILE_ERROR;
+        }
+        fd = compress_to_memfd( plain_fd, plain->st.st_size );
+        if( fd < 0 || fstat( fd, &st ) < 0 ) {
+            if( fd >= 0 ) {
+                close( fd );
+            }
+            *entry = new_no_variant( plain );
+            return FILE_ERROR;
+        }
+    }
+
+    file_entry* e = new_entry( plain->path, plain->hash, fd, st );
+    e->encoding = ENCODING_GZIP;
+    e->src_st = plain->st;
+    e->sidecar = sidecar;
+    gzip_etag( plain->etag, e->etag, sizeof( e->etag ) );
+    // 响应头中的类型和修改时间都来自原文件
+    char header[ MAX_HEADER_LEN ];
+    int header_len = render_file_header( plain->path, st.st_size, plain->st.st_mtime, e->etag, true, true, header, sizeof( header ) );
+    if( header_len < 0 ) {
+        destroy( e );
+        return FILE_ERROR;
+    }
+    e->compressible = true;
+    e->header = ( char* )malloc( header_len );
+    memcpy( e->header, header, header_len );
+    e->header_len = header_len;
+    *entry = e;
+    return FILE_OK;
+}
+
+// 用zlib把fd中size字节的内容压缩成gzip格式，写入一个匿名的内存文件，返回它的fd，失败时返回-1
+int file_cache::compress_to_memfd( int fd, off_t size ) {
+    int out = memfd_create( "gzip", MFD_CLOEXEC );
+    if( out < 0 ) {
+        return -1;
+    }
+    z_stream zs;
+    memset( &zs, 0, sizeof( zs ) );
+    // windowBits加16表示输出gzip格式（带gzip头和CRC），而不是zlib格式
+    if( deflateInit2( &zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY ) != Z_OK ) {
+        close( out );
+        return -1;
+    }
+    const int CHUNK = 64 * 1024;
+    unsigned char* in_buf = ( unsigned char* )malloc( CHUNK );
+    unsigned char* out_buf = ( unsigned char* )malloc( CHUNK );
+    off_t offset = 0;
+    bool ok = true;
+    int flush = Z_NO_FLUSH;
+    while( ok && flush != Z_FINISH ) {
+        ssize_t n = pread( fd, in_buf, CHUNK, offset );
+        if( n < 0 ) {
+            ok = false;
+            break;
+        }
+        offset += n;
+        flush = ( n == 0 || offset >= size ) ? Z_FINISH : Z_NO_FLUSH;
+        zs.next_in = in_buf;
+        zs.avail_in = n;
+        do {
+            zs.next_out = out_buf;
+            zs.avail_out = CHUNK;
+            deflate( &zs, flush );
+            size_t have = CHUNK - zs.avail_out;
+            if( have > 0 && ::write( out, out_buf, have ) != ( ssize_t )have ) {
+                ok = false;
+                break;
+            }
+        } while( zs.avail_out == 0 );
+    }
+    deflateEnd( &zs );
+    free( in_buf );
+    free( out_buf );
+    if( !ok ) {
+        close( out );
+        return -1;
+    }
+    return out;
+}
+
+// 新的缓存项，编码为原文件，引用计数为0，还没有加入缓存
+file_entry* file_cache::new_entry( const char* path, unsigned int hash, int fd, const struct stat& st ) {
+    file_entry* e = new file_entry;
+    e->path = strdup( path );
+    e->encoding = ENCODING_IDENTITY;
+    e->hash = hash;
+    e->st = st;
+    e->src_st = st;
+    e->sidecar = NULL;
+    e->compressible = false;
+    e->no_variant = false;
+    e->fd = fd;
+    // 强ETag：同一个inode、大小和纳秒级修改时间的文件内容相同
+    snprintf( e->etag, sizeof( e->etag ), "\"%lx-%lx-%llx\"", ( unsigned long )st.st_ino, ( unsigned long )st.st_size,
+              ( unsigned long long )st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec );
+    e->address = NULL;
+    e->header = NULL;
+    e->header_len = 0;
+    e->refcount = 0;
+    e->stale = false;
+    e->checked = time( NULL );
+    e->hash_next = NULL;
+    e->lru_prev = NULL;
+    e->lru_next = NULL;
+    return e;
+}
+
+// 原文件plain没有可用的压缩变体的标记，st为空，不占字节预算
+file_entry* file_cache::new_no_variant( file_entry* plain ) {
+    struct stat empty;
+    memset( &empty, 0, sizeof( empty ) );
+    file_entry* e = new_entry( plain->path, plain->hash, -1, empty );
+    e->encoding = ENCODING_GZIP;
+    e->src_st = plain->st;
+    e->no_variant = true;
+    return e;
+}
+
+void file_cache::destroy( file_entry* entry ) {
+    if( entry->address ) {
+        munmap( entry->address, entry->st.st_size );
+    }
+    if( entry->fd >= 0 ) {
+        close( entry->fd );
+    }
+    free( entry->header );
+    free( entry->sidecar );
+    free( entry->path );
+    delete entry;
+}
+
+file_entry* file_cache::find( const char* path, unsigned int hash, int encoding ) {
+    file_entry* e = m_buckets[ hash & ( BUCKET_COUNT - 1 ) ];
+    for( ; e; e = e->hash_next ) {
+        if( e->hash == hash && e->encoding == encoding && strcmp( e->path, path ) == 0 ) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+void file_cache::insert( file_entry* entry ) {
+    file_entry** bucket = &m_buckets[ entry->hash & ( BUCKET_COUNT - 1 ) ];
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    lru_push_front( entry );
+    m_stats.entries++;
+    m_stats.bytes += entry->st.st_size;
+}
+
+// 把缓存项从哈希表和LRU链表中摘下，之后不会再被命中；仍有连接在使用时由最后一个release销毁
+void file_cache::retire( file_entry* entry ) {
+    file_entry** pp = &m_buckets[ entry->hash & ( BUCKET_COUNT - 1 ) ];
+    while( *pp && *pp != entry ) {
+        pp = &( *pp )->hash_next;
+    }
+    if( *pp ) {
+        *pp = entry->hash_next;
+    }
+    entry->hash_next = NULL;
+    lru_remove( entry );
+    entry->stale = true;
+    m_stats.entries--;
+    m_stats.bytes -= entry->st.st_size;
+}
+
+// 从LRU链表尾部开始淘汰，直到映射的总字节数不超过预算
+void file_cache::evict() {
+    while( m_lru_tail && ( long )m_stats.bytes > m_max_bytes ) {
+        file_entry* victim = m_lru_tail;
+        retire( victim );
+        m_stats.evictions++;
+        if( victim->refcount == 0 ) {
+            destroy( victim );
+        }
+    }
+}
+
+void file_cache::lru_remove( file_entry* entry ) {
+    if( entry->lru_prev ) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else if( m_lru_head == entry ) {
+        m_lru_head = entry->lru_next;
+    }
+    if( entry->lru_next ) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else if( m_lru_tail == entry ) {
+        m_lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+void file_cache::lru_push_front( file_entry* entry ) {
+    entry->lru_prev = NULL;
+    entry->lru_next = m_lru_head;
+    if( m_lru_head ) {
+        m_lru_head->lru_prev = entry;
+    }
+    m_lru_head = entry;
+    if( !m_lru_tail ) {
+        m_lru_tail = entry;
+    }
+}
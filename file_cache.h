@@ -0,0 +1,121 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "locker.h"
+
+// 缓存项：一个文件的状态信息和它的只读内存映射，被所有正在发送该文件的连接共享
+// 同一个文件的gzip压缩变体是另一个缓存项，键中的encoding不同
+struct file_entry
+{
+    char* path;                 // 缓存的键：doc_root + url
+    int encoding;               // 缓存的键：内容编码，file_cache::CONTENT_ENCODING
+    unsigned int hash;
+    struct stat st;             // 发送的内容（原文件、.gz文件或压缩结果）的状态信息，命中时不再调用stat
+    struct stat src_st;         // 生成这个缓存项时原文件的状态信息，原文件变化后压缩变体随之失效；原文件的缓存项与st相同
+    char* sidecar;              // 预压缩的.gz文件的路径，在内存中压缩的变体和原文件为NULL
+    bool compressible;          // 内容类型是否值得压缩（文本类），这类文件的响应都带Vary: Accept-Encoding
+    bool no_variant;            // 压缩变体的位置上的标记：原文件没有可用的变体（太大又没有预压缩文件，或者压缩失败），不占字节预算
+    int fd;                     // 只读打开的文件描述符，第一次需要发送内容时才打开，之前为-1
+    char etag[ 64 ];            // 强ETag（带引号），由inode、大小和修改时间生成，压缩变体在后面加上-gz
+    char* address;              // 文件被mmap到内存中的起始位置，第一次需要时才映射，空文件为NULL
+    char* header;               // 预先生成的200响应头（不含Connection字段和空行），加载时生成
+    int header_len;
+    int refcount;               // 正在使用该缓存项的连接数，为0且已失效时才真正munmap/close
+    bool stale;                 // 已被淘汰或文件已发生变化，不再能被新的请求命中
+    time_t checked;             // 上一次校验文件是否被修改的时间
+
+    file_entry* hash_next;      // 哈希桶中的下一个缓存项
+    file_entry* lru_prev;       // LRU链表，头部是最近使用的缓存项
+    file_entry* lru_next;
+};
+
+// 缓存的统计信息
+struct file_cache_stats
+{
+    unsigned long hits;             // 命中次数
+    unsigned long misses;           // 未命中次数
+    unsigned long evictions;        // 因超出字节预算而被淘汰的次数
+    unsigned long invalidations;    // 因文件被修改或删除而失效的次数
+    unsigned long compressions;     // 在内存中压缩文件的次数
+    unsigned long entries;          // 当前缓存项数量
+    unsigned long bytes;            // 当前缓存的文件字节数
+};
+
+/*
+    进程内共享的文件缓存，以文件路径为键，缓存文件的stat信息、打开的fd和mmap映射。
+    缓存项带引用计数，多个连接发送同一个文件时共享同一个fd和同一份映射；
+    缓存的文件总字节数超过预算时按LRU淘汰；命中时每隔VALID_SECONDS秒重新stat一次，文件变化后失效。
+*/
+class file_cache
+{
+public:
+    // 获取文件的结果
+    enum FILE_STATUS { FILE_OK = 0, FILE_NOT_FOUND, FILE_FORBIDDEN, FILE_IS_DIR, FILE_ERROR };
+    // 缓存项内容的编码
+    enum CONTENT_ENCODING { ENCODING_IDENTITY = 0, ENCODING_GZIP };
+
+    static const int BUCKET_COUNT = 4096;           // 哈希桶的数量，必须是2的幂
+    static const int VALID_SECONDS = 1;             // 缓存项的有效期，超过后需要重新stat校验
+    static const long DEFAULT_MAX_BYTES = 64L << 20; // 默认的字节预算
+    static const int MAX_HEADER_LEN = 320;          // 预先生成的响应头的最大长度
+    static const long MIN_GZIP_BYTES = 256;         // 比这更小的文件压缩后节省不了一个报文，不压缩
+    static const long MAX_GZIP_BYTES = 8L << 20;    // 没有预压缩的.gz文件时，在内存中压缩的文件大小上限
+
+public:
+    static file_cache* get_instance();
+
+    // 获取path对应的缓存项并增加引用计数，成功时返回FILE_OK，并通过entry返回缓存项
+    FILE_STATUS acquire( const char* path, file_entry** entry );
+    /*
+        获取原文件plain的gzip变体：优先使用不比原文件旧的预压缩文件path.gz，否则用zlib压缩一次，
+        结果放在memfd中，和普通文件一样可以sendfile或mmap。变体以path和原文件的状态为键缓存，受同一个字节预算限制。
+        没有可用的变体时返回FILE_NOT_FOUND，调用者发送原文件；确定没有变体时缓存一个no_variant标记，
+        和预压缩文件一样每VALID_SECONDS秒重新检查一次，期间的请求不再stat预压缩文件。
+        HEAD请求也按同样的规则获取（必要时压缩），响应头的Content-Encoding、Content-Length和ETag才和GET相同
+    */
+    FILE_STATUS acquire_gzip( file_entry* plain, file_entry** entry );
+    // 释放acquire得到的缓存项
+    void release( file_entry* entry );
+    // 返回缓存项的文件描述符，还没有打开过时才调用open，失败时返回-1并保留errno。
+    // 缓存项只在需要发送内容时才打开文件，条件请求命中（304）时不需要打开。
+    // 打开的文件和缓存项的状态信息不符（在有效期内被替换或修改）时让缓存项失效，返回-1，errno为ESTALE，调用者重新获取
+    int open_fd( file_entry* entry );
+    // 返回缓存项的内存映射，还没有映射过时才调用mmap；用sendfile发送的文件不需要映射
+    char* map( file_entry* entry );
+
+    void set_max_bytes( long max_bytes );
+    void get_stats( file_cache_stats* stats );
+
+private:
+    file_cache();
+    ~file_cache();
+
+    FILE_STATUS load( const char* path, unsigned int hash, file_entry** entry );
+    FILE_STATUS load_gzip( file_entry* plain, file_entry** entry );
+    FILE_STATUS publish( file_entry* loaded, file_entry** entry );
+    file_entry* find( const char* path, unsigned int hash, int encoding );
+    static int compress_to_memfd( int fd, off_t size );
+    static file_entry* new_entry( const char* path, unsigned int hash, int fd, const struct stat& st );
+    static file_entry* new_no_variant( file_entry* plain );
+    void insert( file_entry* entry );
+    void retire( file_entry* entry );
+    void lru_remove( file_entry* entry );
+    void lru_push_front( file_entry* entry );
+    void evict();
+    static void destroy( file_entry* entry );
+    static unsigned int hash_path( const char* path );
+    static bool same_file( const struct stat& a, const struct stat& b );
+
+private:
+    locker m_lock;                          // 保护哈希表、LRU链表和统计信息
+    file_entry* m_buckets[ BUCKET_COUNT ];
+    file_entry* m_lru_head;
+    file_entry* m_lru_tail;
+    long m_max_bytes;
+    file_cache_stats m_stats;
+};
+
+#endif
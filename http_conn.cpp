@@ -1,15 +1,11 @@
 #include "http_conn.h"
-
-// 定义HTTP响应的一些状态信息
-const char* ok_200_title = "OK";
-const char* error_400_title = "Bad Request";
-const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
-const char* error_403_title = "Forbidden";
-const char* error_403_form = "You do not have permission to get file from this server.\n";
-const char* error_404_title = "Not Found";
-const char* error_404_form = "The requested file was not found on this server.\n";
-const char* error_500_title = "Internal Error";
-const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+#include "http_scan.h"
+#include "uring_reactor.h"
+#include "admission.h"
+#include "conn_table.h"
+#include "logger.h"
+#include <ctype.h>
+#include <sys/eventfd.h>
 
 // 网站的根目录
 const char* doc_root = "/lywebserver/resources";
@@ -23,11 +19,12 @@ int setnonblocking( int fd ) {
 }
 
 // 向epoll中添加需要监听的文件描述符
-//addfd( epollfd, listenfd, false ); //监听套接字
-//addfd( m_epollfd, sockfd, true ); //连接套接字
-void addfd( int epollfd, int fd, bool one_shot ) {
+//addfd( epollfd, listenfd, false, token ); //监听套接字
+//addfd( m_epollfd, sockfd, true, handle() ); //连接套接字
+// data是事件返回时带回的标识：连接的句柄，或者反应堆为监听socket、timerfd选的常量
+void addfd( int epollfd, int fd, bool one_shot, unsigned long data ) {
     epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = data;
     event.events = EPOLLIN | EPOLLRDHUP; //EPOLLRDHUP:通过事件判断对端是否断开
     if(one_shot) 
     {
@@ -53,12 +50,12 @@ void removefd( int epollfd, int fd ) {
     close(fd);
 }
 /*
-   当响应结束时：modfd( m_epollfd, m_sockfd, EPOLLIN );再次触发读
+   当响应结束时：modfd( m_epollfd, m_sockfd, EPOLLIN, handle() );再次触发读
 */
 // 修改文件描述符，重置socket上的EPOLLONESHOT事件，以确保下一次可读时，EPOLLIN事件能被触发
-void modfd(int epollfd, int fd, int ev) {
+void modfd(int epollfd, int fd, int ev, unsigned long data) {
     epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = data;
     //修改已经注册的fd的监听事件
     event.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP; //设置为边沿触发，
     //将EPOLL设为边缘触发；
@@ -71,25 +68,57 @@ void modfd(int epollfd, int fd, int ev) {
 }
 
 // 所有的客户数
-int http_conn::m_user_count = 0;
-// 所有socket上的事件都被注册到同一个epoll内核事件中，所以设置成静态的
-int http_conn::m_epollfd = -1;  //是都用一个epollfd吗
+std::atomic<int> http_conn::m_user_count( 0 );
+conn_table* http_conn::m_table = NULL;
+
+// 连接的代数跳过0，m_queued_gen为0表示没有排队中的任务
+static unsigned int next_gen( unsigned int gen ) {
+    return gen + 1 ? gen + 1 : 1;
+}
+// 默认用writev发送映射好的文件
+http_conn::TX_MODE http_conn::m_tx_mode = http_conn::TX_WRITEV;
 
 // 关闭连接
 void http_conn::close_conn() {
     if(m_sockfd != -1) {
-        removefd(m_epollfd, m_sockfd);
+        m_wheel->del_timer( &m_timer );
+        if ( m_uring ) {
+            m_ring->close_fd( this );
+        } else {
+            removefd(m_epollfd, m_sockfd);
+        }
+        unmap();
+        release_buffers();
         m_sockfd = -1;
+        // 换一个代数再释放槽位，这个连接迟到的事件和任务都不会再找到它
+        m_gen = next_gen( m_gen );
+        if ( m_table ) {
+            m_table->release( this );
+        }
         m_user_count--; // 关闭一个连接，将客户总数量-1
+        metrics::local()->count( CNT_CLOSED );
     }
 }
 /*
-   users[connfd].init( connfd, client_address);
+   users[connfd].init( connfd, client_address, epollfd, wheel );
 */
 // 初始化连接,外部调用初始化套接字地址
-void http_conn::init(int sockfd, const sockaddr_in& addr){
+void http_conn::init(int sockfd, const sockaddr_in& addr, int epollfd, timer_wheel* wheel, epoll_handback* handback, uring_reactor* ring){
     m_sockfd = sockfd;  //客户端的sockfd
     m_address = addr;   //客户端的ip地址
+    m_epollfd = epollfd;    //接受该连接的反应堆的epoll
+    m_uring = ring != NULL;
+    if ( m_uring ) {
+        m_ring = ring;
+    } else {
+        m_handback = handback;
+    }
+    m_wheel = wheel;
+    // 新连接换一个代数，槽位被复用之前排队的任务都不再有效
+    m_gen = next_gen( m_gen );
+    m_queued_gen.store( 0, std::memory_order_relaxed );
+    m_file = 0;
+    m_file_address = 0;
     
     // 端口复用
     int reuse = 1;
@@ -103,9 +132,130 @@ void http_conn::init(int sockfd, const sockaddr_in& addr){
     SO_REUSEADDR：允许重用本地地址和端口　　
     */
     setsockopt( m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
-    addfd( m_epollfd, sockfd, true );
+    if ( !m_uring ) {
+        // io_uring后端由反应堆在接受连接后提交第一个接收
+        addfd( m_epollfd, sockfd, true, handle() );
+    }
     m_user_count++;
+    m_accept_ns = metrics::now_ns();
+    metrics::local()->count( CNT_ACCEPTED );
     init();
+
+    // 新连接必须在HEADER_TIMEOUT内发来完整的请求
+    m_timer.cb_func = on_timeout;
+    m_timer.user_data = this;
+    m_phase = PHASE_READING;
+    m_wheel->add_timer( &m_timer, HEADER_TIMEOUT );
+}
+
+void http_conn::rearm( int ev ) {
+    if ( m_uring ) {
+        m_ring->rearm( this, handle(), ev );
+    } else {
+        modfd( m_epollfd, m_sockfd, ev, handle() );
+    }
+}
+
+/*
+    先减少m_inflight再把连接交还给反应堆：交还之后反应堆随时可能关闭连接、把槽位给新连接，之后再减就减到了新连接的计数上。
+    减完之后超时定时器也可以关闭连接，槽位和fd可能马上给了新连接（也可能是另一个反应堆接受的），
+    所以句柄和交还的去处都在减之前取出，减完之后不再读连接的字段，由反应堆按句柄确认还是同一个连接后再重新等待事件
+*/
+void http_conn::hand_back( int ev ) {
+    unsigned long token = handle();
+    uring_reactor* ring = m_uring ? m_ring : NULL;
+    epoll_handback* handback = m_uring ? NULL : m_handback;
+    int epollfd = m_epollfd;
+    int sockfd = m_sockfd;
+    m_inflight--;
+    if ( ring ) {
+        ring->rearm( this, token, ev );
+    } else if ( handback ) {
+        handback->push( this, token, ev );
+    } else {
+        // 没有反应堆（基准测试中单独创建的连接），不会有别的线程关闭它
+        modfd( epollfd, sockfd, ev, token );
+    }
+}
+
+epoll_handback::epoll_handback() {
+    m_eventfd = ::eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+}
+
+epoll_handback::~epoll_handback() {
+    if ( m_eventfd >= 0 ) {
+        close( m_eventfd );
+    }
+}
+
+void epoll_handback::push( http_conn* conn, unsigned long handle, int ev ) {
+    // 队列由空变为非空时才需要唤醒反应堆
+    m_lock.lock();
+    bool wake = m_ready.empty();
+    ready_conn ready = { conn, handle, ev };
+    m_ready.push_back( ready );
+    m_lock.unlock();
+    if ( wake ) {
+        unsigned long long one = 1;
+        ssize_t ret = ::write( m_eventfd, &one, sizeof( one ) );
+        ( void )ret;
+    }
+}
+
+void epoll_handback::drain() {
+    unsigned long long count;
+    ssize_t ret = ::read( m_eventfd, &count, sizeof( count ) );
+    ( void )ret;
+    m_lock.lock();
+    m_draining.swap( m_ready );
+    m_lock.unlock();
+    for ( size_t i = 0; i < m_draining.size(); ++i ) {
+        const ready_conn& ready = m_draining[i];
+        // 交还之前被超时关闭的连接，槽位上已经是另一代连接或者没有连接
+        if ( http_conn::m_table->lookup( ready.handle ) == ready.conn ) {
+            ready.conn->rearm( ready.ev );
+        }
+    }
+    m_draining.clear();
+}
+
+void http_conn::input_arrived() {
+    if ( m_accept_ns && m_read_idx > 0 ) {
+        metrics::local()->record( STAGE_ACCEPT_READ, metrics::now_ns() - m_accept_ns );
+        m_accept_ns = 0;
+    }
+}
+
+void http_conn::update_timer() {
+    if ( bytes_to_send > 0 ) {
+        // 响应还没有发送完，每次有进展都重新计时
+        m_phase = PHASE_WRITING;
+        m_wheel->add_timer( &m_timer, WRITE_TIMEOUT );
+    } else if ( m_read_idx > 0 ) {
+        // 正在接收请求，期限从请求的第一个字节开始计算，防止客户端一点一点地发送来长期占用连接
+        if ( m_phase != PHASE_READING ) {
+            m_phase = PHASE_READING;
+            m_wheel->add_timer( &m_timer, HEADER_TIMEOUT );
+        }
+    } else {
+        // 响应发送完毕，keep-alive连接等待下一个请求
+        m_phase = PHASE_IDLE;
+        m_wheel->add_timer( &m_timer, KEEPALIVE_TIMEOUT );
+    }
+}
+
+// 超时定时器到期，在反应堆线程中执行
+void http_conn::on_timeout( void* arg ) {
+    http_conn* conn = ( http_conn* )arg;
+    if ( conn->m_sockfd == -1 ) {
+        return;
+    }
+    if ( conn->m_inflight.load() > 0 && !conn->cancel_task() ) {
+        // 工作线程已经取走任务、还在处理这个连接，不能在这里关闭，下一个tick再检查
+        conn->m_wheel->add_timer( &conn->m_timer, conn->m_wheel->tick_ms() );
+        return;
+    }
+    conn->close_conn();
 }
 
 void http_conn::init()
@@ -120,18 +270,126 @@ void http_conn::init()
     m_version = 0;
     m_content_length = 0;
     m_host = 0;
+    reset_headers();
     m_start_line = 0;
     m_checked_idx = 0;
     m_read_idx = 0;
     m_write_idx = 0;
-    bzero(m_read_buf, READ_BUFFER_SIZE);
-    bzero(m_write_buf, READ_BUFFER_SIZE);
-    bzero(m_real_file, FILENAME_LEN);
+    m_file_count = 0;
+    m_segment_count = 0;
+    m_segment_idx = 0;
+    m_segment_sent = 0;
+    m_response_count = 0;
+    m_close_after = false;
+    release_buffers();
+}
+
+// 读缓冲区放满了，换成缓冲区池中大一级的块。请求还没有解析完，指向旧缓冲区的指针要平移到新缓冲区中
+bool http_conn::grow_read_buf() {
+    size_t size = m_read_buf ? m_read_size * 2 : READ_BUFFER_SIZE;
+    if ( size > ( size_t )MAX_READ_BUFFER_SIZE ) {
+        return false;
+    }
+    buffer_pool* pool = buffer_pool::get_instance();
+    if ( !m_known ) {
+        size_t capacity = 0;
+        m_known = ( header_slice* )pool->acquire( ( HDR_COUNT + MAX_EXTRA_HEADERS ) * sizeof( header_slice ), &capacity );
+        if ( !m_known ) {
+            return false;
+        }
+        m_extra = m_known + HDR_COUNT;
+        reset_headers();
+    }
+    size_t capacity = 0;
+    char* buf = pool->acquire( size, &capacity );
+    if ( !buf ) {
+        return false;
+    }
+    if ( m_read_buf ) {
+        memcpy( buf, m_read_buf, m_read_idx );
+        if ( m_url ) m_url = buf + ( m_url - m_read_buf );
+        if ( m_version ) m_version = buf + ( m_version - m_read_buf );
+        if ( m_host ) m_host = buf + ( m_host - m_read_buf );
+        pool->release( m_read_buf, m_read_size );
+    }
+    m_read_buf = buf;
+    m_read_size = capacity;
+    return true;
+}
+
+// 写缓冲区放不下下一个响应头，换成大一级的块。数据段只记录在写缓冲区中的偏移，不需要修改
+bool http_conn::grow_write_buf() {
+    buffer_pool* pool = buffer_pool::get_instance();
+    size_t size = m_write_buf ? m_write_size * 2 : WRITE_BUFFER_SIZE;
+    if ( size > ( size_t )MAX_WRITE_BUFFER_SIZE ) {
+        return false;
+    }
+    size_t capacity = 0;
+    char* buf = pool->acquire( size, &capacity );
+    if ( !buf ) {
+        return false;
+    }
+    if ( m_write_buf ) {
+        memcpy( buf, m_write_buf, m_write_idx );
+        pool->release( m_write_buf, m_write_size );
+    }
+    m_write_buf = buf;
+    m_write_size = capacity;
+    return true;
+}
+
+// 清空头部字段表，开始解析新的请求
+void http_conn::reset_headers() {
+    if ( m_known ) {
+        memset( m_known, 0, HDR_COUNT * sizeof( header_slice ) );
+    }
+    m_extra_count = 0;
+}
+
+// 把缓冲区还给缓冲区池。连接空闲或关闭时调用，此时没有未解析的请求和未发送的响应
+void http_conn::release_buffers() {
+    buffer_pool* pool = buffer_pool::get_instance();
+    pool->release( m_read_buf, m_read_size );
+    pool->release( m_write_buf, m_write_size );
+    pool->release( ( char* )m_segments, SEGMENT_BLOCK_SIZE );
+    pool->release( ( char* )m_known, ( HDR_COUNT + MAX_EXTRA_HEADERS ) * sizeof( header_slice ) );
+    pool->release( ( char* )m_access, ACCESS_BLOCK_SIZE );
+    m_read_buf = NULL;
+    m_read_size = 0;
+    m_known = NULL;
+    m_extra = NULL;
+    m_extra_count = 0;
+    m_write_buf = NULL;
+    m_write_size = 0;
+    m_segments = NULL;
+    m_files = NULL;
+    m_access = NULL;
+}
+
+// 一个请求处理完后调用。客户端可能已经把后面的请求一起发了过来（流水线），不能清空读缓冲区
+void http_conn::next_request()
+{
+    int left = m_read_idx - m_checked_idx;
+    if ( left > 0 ) {
+        memmove( m_read_buf, m_read_buf + m_checked_idx, left );
+    }
+    m_read_idx = left;
+    m_checked_idx = 0;
+    m_start_line = 0;
+    m_check_state = CHECK_STATE_REQUESTLINE;
+    m_linger = false;
+    m_method = GET;
+    m_url = 0;
+    m_version = 0;
+    m_content_length = 0;
+    m_host = 0;
+    reset_headers();
 }
 
 // 循环读取客户数据，直到无数据可读或者对方关闭连接
 bool http_conn::read() {
-    if( m_read_idx >= READ_BUFFER_SIZE ) {
+    if( m_read_idx >= m_read_size && !grow_read_buf() ) {
+        // 读缓冲区已经扩展到最大，还放不下一个完整的请求
         return false;
     }
     int bytes_read = 0;
@@ -145,10 +403,14 @@ bool http_conn::read() {
      边缘触发的情况下，如果不一次性读取一个事件上的数据，会干扰下一个事件
      所以必须在读取数据的外部套一层循环，这样才能完整的读取数据
    */
-    while(true) {  //非阻塞套接字，recv是非阻塞的  如果应用层的数组满了怎么办 ？？？
-        // 从m_read_buf + m_read_idx索引出开始保存数据，大小是READ_BUFFER_SIZE - m_read_idx
+    while( true ) {  //非阻塞套接字，recv是非阻塞的
+        // 读缓冲区满了就换成更大的块；已经最大时先处理已经读到的请求，剩下的数据留在socket中
+        if( m_read_idx >= m_read_size && !grow_read_buf() ) {
+            break;
+        }
+        // 从m_read_buf + m_read_idx索引出开始保存数据，大小是m_read_size - m_read_idx
         bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, 
-        READ_BUFFER_SIZE - m_read_idx, 0 );
+        m_read_size - m_read_idx, 0 );
         /*如果是阻塞IO，处理完数据后，程序会一直卡在recv上，因为是阻塞IO，如果没数据可读，它会一直等在那，
         直到有数据可读。但是这个时候，如果有另外一个客户端取连接服务器，服务器就不能受理这个新的客户端了。
         */
@@ -171,13 +433,29 @@ bool http_conn::read() {
         }
         m_read_idx += bytes_read;
     }
+    input_arrived();
+    return true;
+}
+
+bool http_conn::append_input( const char* data, int len ) {
+    while ( m_read_idx + len > m_read_size ) {
+        if ( !grow_read_buf() ) {
+            return false;
+        }
+    }
+    memcpy( m_read_buf + m_read_idx, data, len );
+    m_read_idx += len;
+    input_arrived();
     return true;
 }
 
 // 解析一行，判断依据\r\n,每一行都是以回车换行符结束
+// 用向量化的scan_line_end一次跳过16~32个普通字符，停下的位置和逐字节查找完全相同
 http_conn::LINE_STATUS http_conn::parse_line() {
     char temp;
-    for ( ; m_checked_idx < m_read_idx; ++m_checked_idx ) {
+    const char* end = m_read_buf + m_read_idx;
+    m_checked_idx = scan_line_end( m_read_buf + m_checked_idx, end ) - m_read_buf;
+    if ( m_checked_idx < m_read_idx ) {
         temp = m_read_buf[ m_checked_idx ];
         if ( temp == '\r' ) {
             if ( ( m_checked_idx + 1 ) == m_read_idx ) {
@@ -203,8 +481,10 @@ http_conn::LINE_STATUS http_conn::parse_line() {
 // 解析HTTP请求行，获得请求方法，目标URL,以及HTTP版本号
 http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
     // GET /index.html HTTP/1.1
-    m_url = strpbrk(text, " \t"); // 判断第二个参数中的字符哪个在text中最先出现
-    if (! m_url) { 
+    // 当前行已经以'\0'结尾，scan_token_end停在空格、制表符或行尾的'\0'处，相当于strpbrk(text, " \t")
+    const char* end = m_read_buf + m_read_idx;
+    m_url = ( char* )scan_token_end( text, end ); // 判断哪个分隔符在text中最先出现
+    if ( *m_url == '\0' ) { 
         return BAD_REQUEST;
     }
     // GET\0/index.html HTTP/1.1
@@ -212,13 +492,17 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
     char* method = text;
     if ( strcasecmp(method, "GET") == 0 ) { // 忽略大小写比较
         m_method = GET;
+    } else if ( strcasecmp( method, "HEAD" ) == 0 ) {
+        m_method = HEAD;
+    } else if ( strcasecmp( method, "OPTIONS" ) == 0 ) {
+        m_method = OPTIONS;
     } else {
         return BAD_REQUEST;
     }
     // /index.html HTTP/1.1
     // 检索字符串 str1 中第一个不在字符串 str2 中出现的字符下标。
-    m_version = strpbrk( m_url, " \t" );
-    if (!m_version) {//若返回空
+    m_version = ( char* )scan_token_end( m_url, end );
+    if ( *m_version == '\0' ) {//没有找到分隔符
         return BAD_REQUEST;
     }
     *m_version++ = '\0';  //把\t->\0,向前走一步
@@ -233,6 +517,11 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
         // 在参数 str 所指向的字符串中搜索第一次出现字符 c（一个无符号字符）的位置。
         m_url = strchr( m_url, '/' );
     }
+    // OPTIONS * 询问的是整个服务器
+    if ( m_url && m_method == OPTIONS && strcmp( m_url, "*" ) == 0 ) {
+        m_check_state = CHECK_STATE_HEADER;
+        return NO_REQUEST;
+    }
     if ( !m_url || m_url[0] != '/' ) {
         return BAD_REQUEST;
     }
@@ -240,8 +529,8 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
     return NO_REQUEST;// 请求不完整，需要继续读取客户数据,需要继续读取头
 }
 
-// 解析HTTP请求的一个头部信息（字符串匹配，记录下一些一些字段的值）
-http_conn::HTTP_CODE http_conn::parse_headers(char* text) {   
+// 解析HTTP请求的一个头部信息：记录字段在读缓冲区中的位置，再处理服务器自己需要的几个字段
+http_conn::HTTP_CODE http_conn::parse_headers(char* text, int len) {   
     // 遇到空行，表示头部字段解析完毕
     if( text[0] == '\0' ) {  //那一行为\0
         // 如果HTTP请求有消息体，则还需要读取m_content_length字节的消息体，
@@ -252,34 +541,159 @@ http_conn::HTTP_CODE http_conn::parse_headers(char* text) {
         }
         // 否则说明我们已经得到了一个完整的HTTP请求
         return GET_REQUEST;
-    } else if ( strncasecmp( text, "Connection:", 11 ) == 0 ) {
-        // 处理Connection 头部字段  Connection: keep-alive
-        text += 11;
-        text += strspn( text, " \t" );
-        if ( strcasecmp( text, "keep-alive" ) == 0 ) {
-            m_linger = true;
-        }
-    } else if ( strncasecmp( text, "Content-Length:", 15 ) == 0 ) {
-        // 处理Content-Length头部字段
-        text += 15;
-        text += strspn( text, " \t" );
-        m_content_length = atol(text);
-    } else if ( strncasecmp( text, "Host:", 5 ) == 0 ) {
-        // 处理Host头部字段
-        text += 5;
-        text += strspn( text, " \t" );
-        m_host = text;
-    } else {
-        printf( "oop! unknow header %s\n", text );//其他的一切看作未知的
+    }
+    // 字段名: 字段值，冒号前不能有空白，字段值前后的空白不属于字段值
+    char* end = text + len;
+    char* colon = ( char* )memchr( text, ':', len );
+    if ( !colon ) {
+        return NO_REQUEST;  // 不是头部字段，忽略这一行
+    }
+    char* value = colon + 1;
+    while ( value < end && ( *value == ' ' || *value == '\t' ) ) {
+        value++;
+    }
+    while ( end > value && ( end[-1] == ' ' || end[-1] == '\t' ) ) {
+        end--;
+    }
+    *end = '\0';
+
+    header_slice slice;
+    slice.name_off = text - m_read_buf;
+    slice.name_len = colon - text;
+    slice.value_off = value - m_read_buf;
+    slice.value_len = end - value;
+    HEADER_ID id = lookup_header( text, colon - text );
+    if ( id == HDR_UNKNOWN ) {
+        if ( m_extra_count < MAX_EXTRA_HEADERS ) {
+            m_extra[ m_extra_count++ ] = slice;
+        }
+        return NO_REQUEST;
+    }
+    m_known[ id ] = slice;
+
+    switch ( id ) {
+        case HDR_CONNECTION:
+            // 处理Connection 头部字段  Connection: keep-alive
+            if ( strcasecmp( value, "keep-alive" ) == 0 ) {
+                m_linger = true;
+            }
+            break;
+        case HDR_CONTENT_LENGTH: {
+            // 消息体要整个放进读缓冲区才能跳过它；负数、不是数字或者比最大的读缓冲区还长时无法找到下一个请求的开头
+            char* digits_end;
+            errno = 0;
+            long length = strtol( value, &digits_end, 10 );
+            if ( errno != 0 || digits_end == value || *digits_end != '\0'
+                || length < 0 || length > MAX_READ_BUFFER_SIZE ) {
+                return BAD_REQUEST;
+            }
+            m_content_length = length;
+            break;
+        }
+        case HDR_HOST:
+            m_host = value;
+            break;
+        default:
+            break;
     }
     return NO_REQUEST;  //没有换状态
 }
 
+// 范围请求总是针对原文件，不使用压缩变体；太小的文件压缩了也省不了多少
+bool http_conn::wants_gzip() const {
+    return m_file->compressible && m_file->st.st_size >= file_cache::MIN_GZIP_BYTES
+        && !get_header( HDR_RANGE ) && accepts_gzip();
+}
+
+/*
+    条件请求：有If-None-Match时只看它，和将要回复的那种表示的ETag比较，m_file已经换成了实际回复的原文件或压缩变体；
+    否则看If-Modified-Since，原文件在那之后没有修改过就是有效的
+*/
+bool http_conn::not_modified() const {
+    const char* if_none_match = get_header( HDR_IF_NONE_MATCH );
+    if ( if_none_match ) {
+        return etag_list_matches( if_none_match, m_file->etag );
+    }
+    const char* if_modified_since = get_header( HDR_IF_MODIFIED_SINCE );
+    time_t since;
+    if ( if_modified_since && parse_http_date( if_modified_since, &since ) ) {
+        return m_file->src_st.st_mtime <= since;
+    }
+    return false;
+}
+
+// 客户端是否接受gzip编码：Accept-Encoding中gzip的q值不为0；没有列出gzip时看*的q值
+bool http_conn::accepts_gzip() const {
+    const char* p = get_header( HDR_ACCEPT_ENCODING );
+    if ( !p ) {
+        return false;
+    }
+    bool star = false;
+    while ( *p ) {
+        // 一项的格式是 编码[;q=数值]，各项用逗号分隔
+        p += strspn( p, " \t," );
+        const char* token = p;
+        p += strcspn( p, " \t,;" );
+        int len = p - token;
+        bool gzip = ( len == 4 && strncasecmp( token, "gzip", 4 ) == 0 )
+                 || ( len == 6 && strncasecmp( token, "x-gzip", 6 ) == 0 );
+        double q = 1.0;
+        p += strspn( p, " \t" );
+        if ( *p == ';' ) {
+            const char* param = p + 1 + strspn( p + 1, " \t" );
+            if ( ( param[0] == 'q' || param[0] == 'Q' ) && param[1] == '=' ) {
+                q = atof( param + 2 );
+            }
+            p += strcspn( p, "," );
+        }
+        if ( gzip ) {
+            return q > 0;
+        }
+        if ( len == 1 && token[0] == '*' ) {
+            star = q > 0;
+        }
+    }
+    return star;
+}
+
+const char* http_conn::get_header( HEADER_ID id, int* len ) const {
+    if ( !m_known || id == HDR_UNKNOWN ) {
+        return NULL;
+    }
+    const header_slice& slice = m_known[ id ];
+    if ( slice.value_off == 0 ) {
+        return NULL;
+    }
+    if ( len ) {
+        *len = slice.value_len;
+    }
+    return m_read_buf + slice.value_off;
+}
+
+const char* http_conn::get_header( const char* name, int* len ) const {
+    int name_len = strlen( name );
+    HEADER_ID id = lookup_header( name, name_len );
+    if ( id != HDR_UNKNOWN ) {
+        return get_header( id, len );
+    }
+    for ( int i = 0; i < m_extra_count; ++i ) {
+        const header_slice& slice = m_extra[i];
+        if ( slice.name_len == name_len && strncasecmp( m_read_buf + slice.name_off, name, name_len ) == 0 ) {
+            if ( len ) {
+                *len = slice.value_len;
+            }
+            return m_read_buf + slice.value_off;
+        }
+    }
+    return NULL;
+}
+
 // 我们没有真正解析HTTP请求的消息体，只是判断它是否被完整的读入了
-http_conn::HTTP_CODE http_conn::parse_content( char* text ) {
-    if ( m_read_idx >= ( m_content_length + m_checked_idx ) )
+// 消息体后面可能紧跟着下一个流水线请求，所以不能在消息体末尾写'\0'，而是跳过整个消息体
+http_conn::HTTP_CODE http_conn::parse_content() {
+    if ( ( long )m_read_idx >= ( long )m_content_length + m_checked_idx )
     {
-        text[ m_content_length ] = '\0';
+        m_checked_idx += m_content_length;
         return GET_REQUEST;
     }
     return NO_REQUEST;
@@ -299,7 +713,7 @@ http_conn::HTTP_CODE http_conn::process_read() {
         // 获取一行数据
         text = get_line(); //获取当前行的开始索引
         m_start_line = m_checked_idx;//下一行的开始索引
-        printf( "got 1 http line: %s\n", text );
+        LOG_DEBUG( "got 1 http line: %s", text );
         /*
            m_check_state = CHECK_STATE_REQUESTLINE;    // 初始状态为检查请求行
         */
@@ -313,18 +727,19 @@ http_conn::HTTP_CODE http_conn::process_read() {
                 break;
             }
             case CHECK_STATE_HEADER: { //检查请求头部字段
-                ret = parse_headers( text );
+                // parse_line把行尾的\r\n换成了两个'\0'，m_checked_idx指向下一行
+                ret = parse_headers( text, m_start_line - 2 - ( text - m_read_buf ) );
                 if ( ret == BAD_REQUEST ) {
                     return BAD_REQUEST;
                 } else if ( ret == GET_REQUEST ) {   
-                    return do_request();  //请求解析完了，去回复
+                    return GET_REQUEST;  //请求解析完了，由process调用do_request去回复
                 }
                 break;
             }
             case CHECK_STATE_CONTENT: {//当前正在解析请求体
-                ret = parse_content( text );
+                ret = parse_content();
                 if ( ret == GET_REQUEST ) {
-                    return do_request(); //没有真正解析消息体，去回复
+                    return GET_REQUEST; //没有真正解析消息体，去回复
                 }
                 line_status = LINE_OPEN;
                 break;
@@ -338,68 +753,112 @@ http_conn::HTTP_CODE http_conn::process_read() {
 }
 
 // 当得到一个完整、正确的HTTP请求时，我们就分析目标文件的属性，
-// 如果目标文件存在、对所有用户可读，且不是目录，则使用mmap将其
-// 映射到内存地址m_file_address处，并告诉调用者获取文件成功
-http_conn::HTTP_CODE http_conn::do_request()
+// 如果目标文件存在、对所有用户可读，且不是目录，则从文件缓存中取得它
+// 共享的内存映射m_file_address，并告诉调用者获取文件成功
+// 文件在缓存项的有效期内被替换时重新获取一次（retry为true时）
+http_conn::HTTP_CODE http_conn::do_request( bool retry )
 {
+    // 服务器对所有资源支持的方法都一样，OPTIONS不需要查找文件
+    if ( m_method == OPTIONS ) {
+        return OPTIONS_REQUEST;
+    }
+    if ( strcmp( m_url, metrics::PATH ) == 0 ) {
+        return render_metrics();
+    }
     // "/home/nowcoder/webserver/resources"
-    strcpy( m_real_file, doc_root ); // 字符串复制 b->a
+    // 完整路径只在查找文件缓存时使用，放在栈上，不占用连接的内存
+    char real_file[ FILENAME_LEN ];
+    strcpy( real_file, doc_root ); // 字符串复制 b->a
     int len = strlen( doc_root );
-    strncpy( m_real_file + len, m_url, FILENAME_LEN - len - 1 );
-    // 获取m_real_file文件的相关的状态信息，-1失败，0成功
-    //通过文件名filename获取文件信息，并保存在buf所指的结构体stat中   
-    if ( stat( m_real_file, &m_file_stat ) < 0 ) {
-        return NO_RESOURCE;
+    strncpy( real_file + len, m_url, FILENAME_LEN - len - 1 );
+    real_file[ FILENAME_LEN - 1 ] = '\0';
+    // 文件缓存以完整路径为键，命中时不需要stat、open和mmap；未命中时只stat，需要发送内容时才open
+    switch ( file_cache::get_instance()->acquire( real_file, &m_file ) ) {
+        case file_cache::FILE_OK:
+            break;
+        case file_cache::FILE_NOT_FOUND:
+            return NO_RESOURCE;
+        case file_cache::FILE_FORBIDDEN:
+            return FORBIDDEN_REQUEST;//表示客户对资源没有足够的访问权限
+        case file_cache::FILE_IS_DIR:
+            return BAD_REQUEST;
+        default:
+            return INTERNAL_ERROR;
     }
-
-    // 判断访问权限
-    if ( ! ( m_file_stat.st_mode & S_IROTH ) ) {
-        return FORBIDDEN_REQUEST;//表示客户对资源没有足够的访问权限
+    // 先确定回复哪种表示：文本类的文件，客户端接受gzip时换成压缩变体（预压缩的.gz文件或缓存的压缩结果），不会每次请求都压缩；
+    // 没有变体（太大又没有预压缩文件，或者压缩失败）时回复原文件。HEAD和GET选择的表示相同，响应头才一致
+    if ( wants_gzip() ) {
+        file_entry* gz = NULL;
+        if ( file_cache::get_instance()->acquire_gzip( m_file, &gz ) == file_cache::FILE_OK ) {
+            file_cache::get_instance()->release( m_file );
+            m_file = gz;
+        }
     }
-
-    // 判断是否是目录
-    if ( S_ISDIR( m_file_stat.st_mode ) ) {    
-        return BAD_REQUEST;
+    // 条件请求和将要回复的表示比较，在打开文件之前判断，客户端的缓存有效时只回复304响应头
+    if ( not_modified() ) {
+        return NOT_MODIFIED;
+    }
+    // HEAD的响应头全部来自缓存项，不需要打开文件
+    if ( m_method == HEAD ) {
+        return FILE_REQUEST;
+    }
+    if ( file_cache::get_instance()->open_fd( m_file ) < 0 ) {
+        if ( errno == ESTALE && retry ) {
+            // 缓存项已经失效，重新stat得到新文件的缓存项
+            file_cache::get_instance()->release( m_file );
+            m_file = 0;
+            return do_request( false );
+        }
+        return errno == EACCES ? FORBIDDEN_REQUEST : INTERNAL_ERROR;
+    }
+    if ( m_tx_mode == TX_WRITEV ) {
+        // 只有writev需要内存映射，sendfile直接从缓存的fd发送
+        m_file_address = file_cache::get_instance()->map( m_file );
+        if ( !m_file_address && m_file->st.st_size > 0 ) {
+            return INTERNAL_ERROR;
+        }
     }
-
-    // 以只读方式打开文件
-    int fd = open( m_real_file, O_RDONLY );
-    // 创建内存映射 文件被映射到内存的起始位置,将一个文件或者其他对象映射进内存
-    m_file_address = ( char* )mmap( 0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
-    close( fd );
     return FILE_REQUEST; //获取文件成功
 }
 
-// 对内存映射区执行munmap操作
+// 指标的正文在工作线程中生成，放在从缓冲区池中取的块里，作为一段内存发送；HEAD也要生成，才能知道Content-Length
+http_conn::HTTP_CODE http_conn::render_metrics() {
+    size_t capacity = 0;
+    m_body = buffer_pool::get_instance()->acquire( buffer_pool::MAX_BLOCK_SIZE / 2, &capacity );
+    if ( !m_body ) {
+        return INTERNAL_ERROR;
+    }
+    m_body_size = capacity;
+    m_body_len = metrics::get_instance()->render( m_body, m_body_size );
+    if ( m_body_len < 0 ) {
+        buffer_pool::get_instance()->release( m_body, m_body_size );
+        m_body = NULL;
+        return INTERNAL_ERROR;
+    }
+    return METRICS_REQUEST;
+}
+
+// 释放这一批响应对文件缓存项的引用和动态生成的正文，映射由文件缓存统一管理
 void http_conn::unmap() {
-    if( m_file_address )
+    if ( m_body ) {
+        buffer_pool::get_instance()->release( m_body, m_body_size );
+        m_body = NULL;
+    }
+    if( m_file )
     {
-        munmap( m_file_address, m_file_stat.st_size );
+        file_cache::get_instance()->release( m_file );
+        m_file = 0;
         m_file_address = 0;
     }
+    for ( int i = 0; i < m_file_count; ++i ) {
+        file_cache::get_instance()->release( m_files[i] );
+    }
+    m_file_count = 0;
 }
 
 // 写HTTP响应
 bool http_conn::write() 
 {
-    int temp = 0;
-    //int bytes_have_send = 0;    // 已经发送的字节
-    //int bytes_to_send = m_write_idx;// 将要发送的字节 （m_write_idx）写缓冲区中待发送的字节数
-    //已经准备好的数据初始化 bytes_to_send = m_write_idx + m_file_stat.st_size;
-    //增加一些判断
-    //1. 判断响应头是否发送完毕，如果发送完毕了，要做如下处理
-    if(bytes_have_send >= m_iv[0].iov_len){
-        //头已经发送完毕
-        m_iv[0].iov_len = 0;
-        m_iv[1].iov_base = m_file_address+(bytes_have_send-m_write_idx);
-        m_iv[1].iov_len = bytes_to_send;
-    }
-    //如果没有发送完毕，还要修改下次写数据的位置
-    else{
-        m_iv[0].iov_base = m_write_buf + bytes_have_send;
-        m_iv[0].iov_len = m_iv[0].iov_len -bytes_have_send;
-    }
-
     if ( bytes_to_send <= 0 ) {
         // 将要发送的字节为0，这一次响应结束。
         /*
@@ -407,76 +866,139 @@ bool http_conn::write()
            //边沿触发，ONESHOT事件，对端连接断开会触发EPOLLRDHUP
         */
 
-        modfd( m_epollfd, m_sockfd, EPOLLIN ); //手动触发读
-        init();
+        rearm( EPOLLIN ); //手动触发读
         return true;
     }
 
-    while(1) {
-        // 分散写
-        temp = writev(m_sockfd, m_iv, m_iv_count);//和write相同，除了数据取自IOVEC，而不是连续缓冲区
+    while( bytes_to_send > 0 ) {
+        ssize_t temp = 0;
+        // m_segment_idx和m_segment_sent记录了发送到的位置，部分发送或EAGAIN之后都能正确续传
+        tx_segment* seg = &m_segments[ m_segment_idx ];
+        if ( seg->type == SEG_FILE ) {
+            // 零拷贝：直接从页缓存发送，offset由内核推进
+            off_t offset = seg->offset + m_segment_sent;
+            temp = sendfile( m_sockfd, seg->file->fd, &offset, seg->len - m_segment_sent );
+        } else {
+            // 把连续的内存段收集起来一次发送，流水线上多个请求的响应也合并成一次系统调用
+            struct iovec iv[ MAX_SEGMENTS ];
+            bool more = false;
+            struct msghdr msg;
+            memset( &msg, 0, sizeof( msg ) );
+            msg.msg_iov = iv;
+            msg.msg_iovlen = gather_segments( iv, &more );
+            // 后面还有用sendfile发送的文件内容时加上MSG_MORE，让内核把响应头和文件开头合并成满的TCP报文段
+            temp = sendmsg( m_sockfd, &msg, more ? MSG_MORE : 0 );
+        }
+
         if ( temp <= -1 ) {
             // 如果TCP socket写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
             // 服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
             if( errno == EAGAIN ) {
-                modfd( m_epollfd, m_sockfd, EPOLLOUT ); //再次触发写
+                rearm( EPOLLOUT ); //再次触发写
                 return true;
             }
             //出错
             unmap();
             return false;
         }
-        bytes_to_send -= temp;
-        bytes_have_send += temp;
-        if ( bytes_to_send <= bytes_have_send ) {
-            // 发送HTTP响应成功，根据HTTP请求中的Connection字段决定是否立即关闭连接
-            unmap(); // 
-            if(m_linger) { //HTTP请求是否要求保持连接
-                init();
-                modfd( m_epollfd, m_sockfd, EPOLLIN ); //继续监测读事件
-                return true;
-            } else {
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
-                return false;
-            } 
+        if ( temp == 0 ) {
+            // sendfile返回0说明文件在发送过程中被截短了，无法再发出承诺的Content-Length
+            unmap();
+            return false;
         }
+        advance( temp );
     }
+    return finish_batch();
 }
 
-// 往写缓冲中写入待发送的数据
-//add_response( "%s %d %s\r\n", "HTTP/1.1", status, title );
-bool http_conn::add_response( const char* format, ... ) {
-    if( m_write_idx >= WRITE_BUFFER_SIZE ) {
-        return false;
+int http_conn::gather_segments( struct iovec* iv, bool* more ) const {
+    int count = 0;
+    int i = m_segment_idx;
+    size_t skip = m_segment_sent;
+    for ( ; i < m_segment_count && m_segments[i].type != SEG_FILE; ++i ) {
+        const char* base = ( m_segments[i].type == SEG_WRITE_BUF ) ? m_write_buf : m_segments[i].base;
+        iv[ count ].iov_base = ( char* )base + m_segments[i].offset + skip;
+        iv[ count ].iov_len = m_segments[i].len - skip;
+        skip = 0;
+        count++;
+    }
+    *more = ( i < m_segment_count );
+    return count;
+}
+
+void http_conn::advance( long sent ) {
+    metrics::local()->count( CNT_BYTES_SENT, sent );
+    bytes_to_send -= sent;
+    bytes_have_send += sent;
+    while ( sent > 0 ) {
+        size_t remain = m_segments[ m_segment_idx ].len - m_segment_sent;
+        if ( ( size_t )sent < remain ) {
+            m_segment_sent += sent;
+            break;
+        }
+        sent -= remain;
+        m_segment_idx++;
+        m_segment_sent = 0;
+    }
+}
+
+bool http_conn::finish_batch() {
+    // 这一批响应发送成功，释放文件引用，清空写缓冲区
+    unsigned long write_ns = metrics::now_ns() - m_batch_ns;
+    metrics::local()->record( STAGE_WRITE, write_ns );
+    if ( m_access ) {
+        log_access( write_ns );
     }
-    va_list arg_list; //定义临时变量
-    va_start( arg_list, format ); //指定位置，把这个“空指针”指定到我们需要的位置上
-    //将输出格式化输出到一个字符数组中
-    int len = vsnprintf( m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list );
-    if( len >= ( WRITE_BUFFER_SIZE - 1 - m_write_idx ) ) {
+    unmap();
+    m_write_idx = 0;
+    m_segment_count = 0;
+    m_segment_idx = 0;
+    m_segment_sent = 0;
+    m_response_count = 0;
+    bytes_have_send = 0;
+    // 根据HTTP请求中的Connection字段决定是否立即关闭连接
+    if ( m_close_after ) {
         return false;
     }
-    m_write_idx += len;
-    va_end( arg_list );   //指针置空
+    if ( m_read_idx > 0 ) {
+        // 读缓冲区中还有流水线请求，不能等EPOLLIN（数据已经读出来了），由反应堆直接再交给线程池
+        return true;
+    }
+    // 连接空闲了，缓冲区还给缓冲区池，下一个请求到来时再取
+    release_buffers();
+    rearm( EPOLLIN ); //继续监测读事件
     return true;
 }
-//add_status_line( 500, error_500_title );
-//add_status_line(200, ok_200_title );
+
+// 往写缓冲中写入待发送的数据
+//add_response( "%s %d %s\r\n", "HTTP/1.1", status, title );
+bool http_conn::add_response( const char* format, ... ) {
+    while( true ) {
+        if( m_write_idx >= m_write_size - 1 && !grow_write_buf() ) {
+            return false;
+        }
+        va_list arg_list; //定义临时变量
+        va_start( arg_list, format ); //指定位置，把这个“空指针”指定到我们需要的位置上
+        //将输出格式化输出到一个字符数组中
+        int len = vsnprintf( m_write_buf + m_write_idx, m_write_size - 1 - m_write_idx, format, arg_list );
+        va_end( arg_list );   //指针置空
+        if( len < ( m_write_size - 1 - m_write_idx ) ) {
+            m_write_idx += len;
+            return true;
+        }
+        // 放不下，扩展写缓冲区后重新格式化
+        if( !grow_write_buf() ) {
+            return false;
+        }
+    }
+}
+//add_status_line( 206, "Partial Content" );
 bool http_conn::add_status_line( int status, const char* title ) {
     return add_response( "%s %d %s\r\n", "HTTP/1.1", status, title );
 }
 
-bool http_conn::add_headers(int content_len) {
-    add_content_length(content_len);
-    add_content_type();
-    add_linger();
-    add_blank_line();
-    return true;
-
-}
-
-bool http_conn::add_content_length(int content_len) {
-    return add_response( "Content-Length: %d\r\n", content_len );
+bool http_conn::add_content_length(long content_len) {
+    return add_response( "Content-Length: %ld\r\n", content_len );
 }
 
 bool http_conn::add_linger()
@@ -489,13 +1011,211 @@ bool http_conn::add_blank_line()
     return add_response( "%s", "\r\n" );
 }
 
-bool http_conn::add_content( const char* content )
-{
-    return add_response( "%s", content );
+bool http_conn::add_content_type( const char* type ) {
+    return add_response( "Content-Type: %s\r\n", type );
 }
 
-bool http_conn::add_content_type() {
-    return add_response("Content-Type:%s\r\n", "text/html");
+// 向这一批响应追加一段数据，和前一段在写缓冲区中相连时直接合并
+bool http_conn::add_segment( SEGMENT_TYPE type, const char* base, file_entry* file, off_t offset, size_t len ) {
+    if ( len == 0 ) {
+        return true;
+    }
+    if ( !m_segments ) {
+        size_t capacity = 0;
+        m_segments = ( tx_segment* )buffer_pool::get_instance()->acquire( SEGMENT_BLOCK_SIZE, &capacity );
+        if ( !m_segments ) {
+            return false;
+        }
+        m_files = ( file_entry** )( m_segments + MAX_SEGMENTS );
+    }
+    if ( type == SEG_WRITE_BUF && m_segment_count > 0 ) {
+        tx_segment& last = m_segments[ m_segment_count - 1 ];
+        if ( last.type == SEG_WRITE_BUF && last.offset + ( off_t )last.len == offset ) {
+            last.len += len;
+            bytes_to_send += len;
+            return true;
+        }
+    }
+    tx_segment& seg = m_segments[ m_segment_count++ ];
+    seg.type = type;
+    seg.base = base;
+    seg.file = file;
+    seg.offset = offset;
+    seg.len = len;
+    bytes_to_send += len;
+    return true;
+}
+
+// 把请求的文件中从offset开始的len个字节加入响应：sendfile时是fd的一个片段，否则是共享映射中的一段内存，都不复制
+bool http_conn::add_body( off_t offset, size_t len ) {
+    if ( m_tx_mode == TX_SENDFILE ) {
+        return add_segment( SEG_FILE, NULL, m_file, offset, len );
+    }
+    return add_segment( SEG_MEMORY, m_file_address, NULL, offset, len );
+}
+
+// 请求是否带有Range。带有If-Range时，只有它等于文件的ETag或Last-Modified才按范围发送，否则发送整个文件
+bool http_conn::range_applies() const {
+    // 只有GET支持范围请求，HEAD忽略Range，回复和完整GET相同的响应头
+    if ( m_method != GET || m_file->encoding != file_cache::ENCODING_IDENTITY || !get_header( HDR_RANGE ) ) {
+        return false;
+    }
+    const char* if_range = get_header( HDR_IF_RANGE );
+    if ( if_range ) {
+        if ( if_range[0] == '"' || if_range[0] == 'W' ) {
+            return strcmp( if_range, m_file->etag ) == 0;
+        }
+        char date[ 64 ];
+        http_date( m_file->st.st_mtime, date, sizeof( date ) );
+        return strcmp( if_range, date ) == 0;
+    }
+    return true;
+}
+
+/*
+    解析Range字段（bytes=0-499, 500-, -200），结果按出现的顺序放入ranges，超出文件的部分被截掉。
+    返回可以满足的范围数，0表示一个也不能满足（416）；语法错误、不是bytes单位或范围太多时返回-1，忽略Range发送整个文件
+*/
+int http_conn::parse_ranges( off_t size, byte_range* ranges ) const {
+    const char* p = get_header( HDR_RANGE );
+    if ( strncasecmp( p, "bytes=", 6 ) != 0 ) {
+        return -1;
+    }
+    p += 6;
+    int count = 0;
+    while ( true ) {
+        p += strspn( p, " \t" );
+        off_t first, last;
+        char* end;
+        if ( *p == '-' ) {
+            // 最后n个字节
+            if ( !isdigit( ( unsigned char )p[1] ) ) {
+                return -1;
+            }
+            off_t n = strtoll( p + 1, &end, 10 );
+            first = n < size ? size - n : 0;
+            last = n > 0 ? size - 1 : -1;
+        } else if ( isdigit( ( unsigned char )*p ) ) {
+            first = strtoll( p, &end, 10 );
+            if ( *end != '-' ) {
+                return -1;
+            }
+            if ( isdigit( ( unsigned char )end[1] ) ) {
+                last = strtoll( end + 1, &end, 10 );
+                if ( last < first ) {
+                    return -1;
+                }
+            } else {
+                last = size - 1;
+                end++;
+            }
+        } else {
+            return -1;
+        }
+        p = end;
+        // 起点超出文件的范围不能满足，跳过
+        if ( first < size && last >= first ) {
+            if ( count == MAX_RANGES ) {
+                return -1;
+            }
+            ranges[ count ].first = first;
+            ranges[ count ].last = last < size ? last : size - 1;
+            count++;
+        }
+        p += strspn( p, " \t" );
+        if ( *p == '\0' ) {
+            break;
+        }
+        if ( *p != ',' ) {
+            return -1;
+        }
+        p++;
+    }
+    return count;
+}
+
+// 生成范围请求的响应：一个范围时是206和文件的一个片段；多个范围时是multipart/byteranges；count为0时是416
+bool http_conn::add_range_response( const byte_range* ranges, int count ) {
+    long size = m_file->st.st_size;
+    const char* type = mime_type( m_file->path );
+    const char* vary = m_file->compressible ? "Vary: Accept-Encoding\r\n" : "";
+    char date[ 64 ];
+    http_date( m_file->st.st_mtime, date, sizeof( date ) );
+
+    if ( count == 0 ) {
+        int start = m_write_idx;
+        return add_status_line( 416, status_title( 416 ) )
+            && add_response( "Content-Range: bytes */%ld\r\n", size )
+            && add_content_length( 0 )
+            && add_linger()
+            && add_blank_line()
+            && add_segment( SEG_WRITE_BUF, NULL, NULL, start, m_write_idx - start );
+    }
+
+    if ( count == 1 ) {
+        int start = m_write_idx;
+        long first = ranges[0].first, last = ranges[0].last;
+        return add_status_line( 206, status_title( 206 ) )
+            && add_content_type( type )
+            && add_response( "Content-Range: bytes %ld-%ld/%ld\r\n", first, last, size )
+            && add_content_length( last - first + 1 )
+            && add_response( "Last-Modified: %s\r\n%s", date, vary )
+            && add_linger()
+            && add_blank_line()
+            && add_segment( SEG_WRITE_BUF, NULL, NULL, start, m_write_idx - start )
+            && add_body( first, last - first + 1 );
+    }
+
+    /*
+        多个范围：先在写缓冲区中生成每个部分的分隔头和结尾的分隔符，算出消息体的总长度，再生成响应头。
+        数据段按发送的顺序排列，和它们在写缓冲区中的位置无关。
+    */
+    char boundary[ 32 ];
+    snprintf( boundary, sizeof( boundary ), "%016lx", ( unsigned long )m_file->st.st_ino * 2654435761UL ^ ( unsigned long )m_file->st.st_mtime );
+    int part_start[ MAX_RANGES ];
+    int part_len[ MAX_RANGES ];
+    long body_len = 0;
+    for ( int i = 0; i < count; ++i ) {
+        part_start[i] = m_write_idx;
+        if ( !add_response( "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                            boundary, type, ( long )ranges[i].first, ( long )ranges[i].last, size ) ) {
+            return false;
+        }
+        part_len[i] = m_write_idx - part_start[i];
+        body_len += part_len[i] + ranges[i].last - ranges[i].first + 1;
+    }
+    int tail_start = m_write_idx;
+    if ( !add_response( "\r\n--%s--\r\n", boundary ) ) {
+        return false;
+    }
+    int tail_len = m_write_idx - tail_start;
+    body_len += tail_len;
+
+    int start = m_write_idx;
+    if ( !add_status_line( 206, status_title( 206 ) )
+        || !add_response( "Content-Type: multipart/byteranges; boundary=%s\r\n", boundary )
+        || !add_content_length( body_len )
+        || !add_response( "Last-Modified: %s\r\n%s", date, vary )
+        || !add_linger()
+        || !add_blank_line()
+        || !add_segment( SEG_WRITE_BUF, NULL, NULL, start, m_write_idx - start ) ) {
+        return false;
+    }
+    for ( int i = 0; i < count; ++i ) {
+        if ( !add_segment( SEG_WRITE_BUF, NULL, NULL, part_start[i], part_len[i] )
+            || !add_body( ranges[i].first, ranges[i].last - ranges[i].first + 1 ) ) {
+            return false;
+        }
+    }
+    return add_segment( SEG_WRITE_BUF, NULL, NULL, tail_start, tail_len );
+}
+
+// 写缓冲区、数据段和文件引用中任何一个放不下下一个响应，这一批就结束；动态生成的正文一批只能有一个
+bool http_conn::batch_full() const {
+    return m_response_count >= MAX_PIPELINE
+        || m_body != NULL
+        || m_segment_count + SEGMENTS_PER_RESPONSE > MAX_SEGMENTS
+        || MAX_WRITE_BUFFER_SIZE - m_write_idx < MAX_HEADER_SIZE;
 }
 
 // 根据服务器处理HTTP请求的结果，决定返回给客户端的内容
@@ -504,75 +1224,244 @@ bool http_conn::add_content_type() {
    状态行: 协议版本\space状态码\space状态码描述\r\n 
    响应头部
    响应正文
+   响应追加到这一批响应的末尾：响应头使用预先生成的内容，不需要格式化，文件内容作为单独的数据段
 */
 bool http_conn::process_write(HTTP_CODE ret) {
+    int status;
     switch (ret)
     {
-        case INTERNAL_ERROR:  //表示服务器内部错误
-            add_status_line( 500, error_500_title ); //写到写缓冲区
-            add_headers( strlen( error_500_form ) );
-            if ( ! add_content( error_500_form ) ) {
+        case FILE_REQUEST: { //表示文件获取成功
+            bool ok;
+            byte_range ranges[ MAX_RANGES ];
+            int count = range_applies() ? parse_ranges( m_file->st.st_size, ranges ) : -1;
+            if ( count >= 0 ) {
+                // 范围请求：206或416，响应头在写缓冲区中生成，正文是文件中对应的片段
+                ok = add_range_response( ranges, count );
+                status = count > 0 ? 206 : 416;
+            } else {
+                //三段数据：文件缓存项中预先生成的响应头、Connection字段和请求的文件（mmap的内存或用sendfile发送的fd），HEAD没有第三段
+                const static_response& conn = m_linger ? connection_keep_alive : connection_close;
+                ok = add_segment( SEG_MEMORY, m_file->header, NULL, 0, m_file->header_len )
+                    && add_segment( SEG_MEMORY, conn.data, NULL, 0, conn.len )
+                    && ( m_method == HEAD || add_body( 0, m_file->st.st_size ) );
+                status = 200;
+            }
+            if ( !ok ) {
                 return false;
             }
-            break;
-        case BAD_REQUEST:
-            add_status_line( 400, error_400_title );
-            add_headers( strlen( error_400_form ) );
-            if ( ! add_content( error_400_form ) ) {
+            // 缓存项的引用交给这一批响应，全部发送完后释放（响应头也在缓存项中）
+            m_files[ m_file_count++ ] = m_file;
+            m_file = 0;
+            m_file_address = 0;
+            count_response( status );
+            return true;
+        }
+        case NOT_MODIFIED: {
+            // 304只有响应头，带上客户端更新缓存需要的ETag和Last-Modified（都属于m_file这种表示），文件不需要打开
+            char date[ 64 ];
+            http_date( m_file->src_st.st_mtime, date, sizeof( date ) );
+            int start = m_write_idx;
+            bool ok = add_status_line( 304, status_title( 304 ) )
+                && add_response( "ETag: %s\r\nLast-Modified: %s\r\n%s", m_file->etag, date,
+                                 m_file->compressible ? "Vary: Accept-Encoding\r\n" : "" )
+                && add_linger()
+                && add_blank_line()
+                && add_segment( SEG_WRITE_BUF, NULL, NULL, start, m_write_idx - start );
+            file_cache::get_instance()->release( m_file );
+            m_file = 0;
+            if ( !ok ) {
                 return false;
             }
-            break;
-        case NO_RESOURCE:
-            add_status_line( 404, error_404_title );
-            add_headers( strlen( error_404_form ) );
-            if ( ! add_content( error_404_form ) ) {
+            count_response( 304 );
+            return true;
+        }
+        case OPTIONS_REQUEST: {
+            const static_response& conn = m_linger ? connection_keep_alive : connection_close;
+            if ( !add_segment( SEG_MEMORY, options_response.data, NULL, 0, options_response.len )
+                || !add_segment( SEG_MEMORY, conn.data, NULL, 0, conn.len ) ) {
                 return false;
             }
-            break;
-        case FORBIDDEN_REQUEST:
-            add_status_line( 403, error_403_title );
-            add_headers(strlen( error_403_form));
-            if ( ! add_content( error_403_form ) ) {
+            count_response( 204 );
+            return true;
+        }
+        case METRICS_REQUEST: {
+            // 正文留在m_body中直到这一批发送完
+            int start = m_write_idx;
+            if ( !add_status_line( 200, status_title( 200 ) )
+                || !add_content_type( metrics::CONTENT_TYPE )
+                || !add_content_length( m_body_len )
+                || !add_response( "Cache-Control: no-store\r\n" )
+                || !add_linger()
+                || !add_blank_line()
+                || !add_segment( SEG_WRITE_BUF, NULL, NULL, start, m_write_idx - start )
+                || ( m_method != HEAD && !add_segment( SEG_MEMORY, m_body, NULL, 0, m_body_len ) ) ) {
                 return false;
             }
-            break;
-        case FILE_REQUEST: //表示文件获取成功
-            add_status_line(200, ok_200_title );
-            add_headers(m_file_stat.st_size); 
-            //两个地址，一个是写缓冲区的地址；一个是请求文件映射到内存的地址
-            m_iv[ 0 ].iov_base = m_write_buf;//写缓冲区地址
-            m_iv[ 0 ].iov_len = m_write_idx;//偏移量
-            m_iv[ 1 ].iov_base = m_file_address;// 客户请求的目标文件被mmap到内存中的起始位置 
-            m_iv[ 1 ].iov_len = m_file_stat.st_size;//大小
-            m_iv_count = 2;
-            //响应头的大小+文件的大小，也就是总的要发送的数据
-            bytes_to_send = m_write_idx + m_file_stat.st_size;
+            count_response( 200 );
             return true;
+        }
+        case INTERNAL_ERROR:  //表示服务器内部错误
+            status = 500;
+            break;
+        case BAD_REQUEST:
+            status = 400;
+            break;
+        case NO_RESOURCE:
+            status = 404;
+            break;
+        case FORBIDDEN_REQUEST:
+            status = 403;
+            break;
         default:
             return false;
     }
 
-    m_iv[ 0 ].iov_base = m_write_buf;
-    m_iv[ 0 ].iov_len = m_write_idx;
-    m_iv_count = 1;
+    // 错误响应在程序启动时就生成好了，整个作为一段内存发送
+    const static_response* response = error_response( status, m_linger, m_method == HEAD );
+    if ( !add_segment( SEG_MEMORY, response->data, NULL, 0, response->len ) ) {
+        return false;
+    }
+    count_response( status );
+    return true;
+}
+
+void http_conn::count_response( int status ) {
+    metrics::local()->count_status( status );
+    if ( m_access ) {
+        m_access[ m_response_count ].status = status;
+    }
+    m_response_count++;
+}
+
+// 填写访问记录中工作线程知道的部分，必须在next_request之前调用（URL在读缓冲区中）；发送完后才知道的部分由log_access填写
+void http_conn::fill_access( access_record* record, long bytes, unsigned long queue_ns, unsigned long service_ns ) const {
+    record->bytes = bytes;
+    record->queue_us = queue_ns / 1000;
+    record->service_us = service_ns / 1000;
+    record->method = m_method;
+    record->flags = m_linger ? access_record::KEEP_ALIVE : 0;
+    int len = m_url ? strlen( m_url ) : 0;
+    if ( len > access_record::URL_SIZE ) {
+        len = access_record::URL_SIZE;
+        record->flags |= access_record::URL_TRUNCATED;
+    }
+    record->url_len = len;
+    memcpy( record->url, m_url, len );
+    memset( record->url + len, 0, access_record::URL_SIZE - len );
+}
+
+// 由反应堆线程在一批响应发送完时调用
+void http_conn::log_access( unsigned long write_ns ) {
+    if ( m_address.sin_family == 0 ) {
+        // io_uring后端的多发accept不返回对方的地址，第一次记录时再取；取不到时记为0.0.0.0，不再重试
+        socklen_t len = sizeof( m_address );
+        getpeername( m_sockfd, ( struct sockaddr* )&m_address, &len );
+        m_address.sin_family = AF_INET;
+    }
+    struct timespec ts;
+    clock_gettime( CLOCK_REALTIME, &ts );
+    unsigned long ts_us = ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+    access_log* log = access_log::get_instance();
+    for ( int i = 0; i < m_response_count; ++i ) {
+        access_record* record = log->append();
+        memcpy( record, &m_access[i], sizeof( access_record ) );
+        record->ts_us = ts_us;
+        record->addr = m_address.sin_addr.s_addr;
+        record->port = ntohs( m_address.sin_port );
+        record->write_us = write_ns / 1000;
+    }
+}
+
+conn_task http_conn::make_task() {
+    m_inflight++;
+    m_queued_ns = metrics::now_ns();
+    // 入队时的加锁或原子操作把这个写发布给取走任务的工作线程
+    m_queued_gen.store( m_gen, std::memory_order_relaxed );
+    conn_task task = { this, m_gen };
+    return task;
+}
+
+bool http_conn::cancel_task() {
+    unsigned int gen = m_gen;
+    if ( !m_queued_gen.compare_exchange_strong( gen, 0, std::memory_order_acq_rel ) ) {
+        return false;   // 没有排队中的任务，或者工作线程已经取走了
+    }
+    m_inflight--;
     return true;
 }
 
+void http_conn::run_task( unsigned int gen ) {
+    // 和cancel_task竞争同一个值，只有一方能把它清0
+    if ( !m_queued_gen.compare_exchange_strong( gen, 0, std::memory_order_acq_rel ) ) {
+        metrics::local()->count( CNT_STALE_TASKS );
+        return;
+    }
+    process();
+}
+
 // 由线程池中的工作线程调用，这是处理HTTP请求的入口函数
 void http_conn::process() {
-    // 解析HTTP请求
-    HTTP_CODE read_ret = process_read();
-    if ( read_ret == NO_REQUEST ) {//请求不完整，需要继续读取客户数据
-        modfd( m_epollfd, m_sockfd, EPOLLIN ); //重新检测读，手动再次触发读 
-        return;
+    // 各阶段的耗时记录在当前工作线程的分片中，相邻阶段共用同一次取时间
+    metrics_shard* stats = metrics::local();
+    unsigned long now = metrics::now_ns();
+    stats->record( STAGE_QUEUE_WAIT, now - m_queued_ns );
+    admission::get_instance()->queue_waited( now - m_queued_ns );
+    unsigned long start = now;
+    if ( !m_access && access_log::get_instance()->enabled() ) {
+        // 取不到块时这一批不记录访问日志
+        size_t capacity = 0;
+        m_access = ( access_record* )buffer_pool::get_instance()->acquire( ACCESS_BLOCK_SIZE, &capacity );
     }
-    
-    // 生成响应 
-    //两个地址，一个是写缓冲区的地址，一个是文件被映射到内存中的地址
-    //将数据先到缓冲区中
-    bool write_ret = process_write( read_ret ); 
-    if ( !write_ret ) {
-        close_conn();  
-    }
-    modfd( m_epollfd, m_sockfd, EPOLLOUT); //触发写事件，需要触发写时，再把写加入进去
+    // 依次处理读缓冲区中所有完整的请求（HTTP/1.1流水线），它们的响应追加到同一批中一起发送
+    while ( true ) {
+        // 解析HTTP请求
+        unsigned long begin = now;
+        HTTP_CODE read_ret = process_read();
+        if ( read_ret == NO_REQUEST ) {//请求不完整，需要继续读取客户数据
+            break;
+        }
+        now = metrics::now_ns();
+        stats->record( STAGE_PARSE, now - begin );
+        if ( read_ret == GET_REQUEST ) {
+            // 请求完整，查找文件
+            begin = now;
+            read_ret = do_request();
+            now = metrics::now_ns();
+            stats->record( STAGE_LOOKUP, now - begin );
+        }
+        if ( read_ret == BAD_REQUEST ) {
+            // 请求的语法错误，无法找到下一个请求的开头，回复之后关闭连接
+            m_linger = false;
+        }
+
+        // 生成响应 
+        //两个地址，一个是写缓冲区的地址，一个是文件被映射到内存中的地址
+        //将数据先到缓冲区中
+        long bytes_before = bytes_to_send;
+        bool write_ret = process_write( read_ret ); 
+        if ( !write_ret ) {
+            // 连接只能由反应堆线程关闭（时间轮不加锁）。这里关闭socket的读写两端，
+            // 反应堆随后会收到EPOLLHUP并关闭连接
+            unmap();
+            shutdown( m_sockfd, SHUT_RDWR );
+            hand_back( EPOLLIN );
+            return;
+        }
+        if ( m_access ) {
+            fill_access( &m_access[ m_response_count - 1 ], bytes_to_send - bytes_before, start - m_queued_ns, now - start );
+        }
+        m_close_after = !m_linger;
+        next_request();
+        // 不保持连接时，后面的请求都不再处理；这一批放满了就先发送，剩下的请求发送完后再处理
+        if ( m_close_after || batch_full() ) {
+            break;
+        }
+    }
+
+    int ev = EPOLLIN;   //重新检测读，手动再次触发读
+    if ( m_response_count > 0 ) {
+        m_batch_ns = now;
+        ev = EPOLLOUT;  //触发写事件，需要触发写时，再把写加入进去
+    }
+    hand_back( ev );  // 之后不能再访问这个连接
 }
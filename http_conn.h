@@ -19,17 +19,72 @@
 #include <stdarg.h>
 #include <errno.h>
 #include "locker.h"
+#include "file_cache.h"
+#include "timer_wheel.h"
+#include "buffer_pool.h"
+#include "http_headers.h"
+#include "http_response.h"
+#include "metrics.h"
+#include "access_log.h"
 #include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <atomic>
+#include <vector>
+
+class uring_reactor;
+class conn_table;
+struct conn_task;
+class http_conn;
+
+/*
+    epoll后端中工作线程交还连接的队列，每个反应堆一个。工作线程减少m_inflight之后，连接随时可能被超时定时器关闭，
+    槽位和fd都可能已经给了新连接，这时再修改epoll会把新连接的事件改掉。所以工作线程只把连接、减少之前取得的句柄和
+    要等待的事件放进队列，由反应堆线程按句柄确认槽位上还是同一个连接后再修改epoll，已经关闭的连接直接丢弃。
+*/
+class epoll_handback
+{
+public:
+    epoll_handback();
+    ~epoll_handback();
+
+    int eventfd() const { return m_eventfd; }   // 加入反应堆的epoll，可读时调用drain
+    void push( http_conn* conn, unsigned long handle, int ev );     // 工作线程调用
+    void drain();   // 反应堆线程调用
+
+private:
+    struct ready_conn {
+        http_conn* conn;
+        unsigned long handle;
+        int ev;
+    };
+
+private:
+    int m_eventfd;
+    locker m_lock;
+    std::vector< ready_conn > m_ready;
+    std::vector< ready_conn > m_draining;  // 反应堆处理中的一批，和m_ready交换，不用每次分配
+};
 
 //任务类
-class http_conn
+class alignas( 64 ) http_conn
 {
 public:
     static const int FILENAME_LEN = 200;        // 文件名的最大长度
-    static const int READ_BUFFER_SIZE = 2048;   // 读缓冲区的大小
-    static const int WRITE_BUFFER_SIZE = 1024;  // 写缓冲区的大小
+    static const int READ_BUFFER_SIZE = 2048;   // 读缓冲区的初始大小
+    static const int WRITE_BUFFER_SIZE = 1024;  // 写缓冲区的初始大小
+    static const int MAX_READ_BUFFER_SIZE = buffer_pool::MAX_BLOCK_SIZE;    // 读缓冲区最大能扩展到的大小，放不下一个请求时关闭连接
+    static const int MAX_WRITE_BUFFER_SIZE = 16384;                         // 写缓冲区最大能扩展到的大小
+    static const int HEADER_TIMEOUT = 10000;    // 从连接建立或收到请求的第一个字节起，必须在这段时间（毫秒）内收到完整的请求
+    static const int KEEPALIVE_TIMEOUT = 15000; // keep-alive连接在两个请求之间最长的空闲时间（毫秒）
+    static const int WRITE_TIMEOUT = 10000;     // 发送响应时，两次发送进展之间最长的停滞时间（毫秒）
+    static const int MAX_PIPELINE = 16;         // 一批最多处理的流水线请求数，它们的响应合并发送
+    static const int MAX_SEGMENTS = 64;         // 一批响应最多由多少段数据组成
+    static const int MAX_EXTRA_HEADERS = 40;    // 一个请求中最多记录的未知头部字段数，更多的被忽略
+    static const int MAX_RANGES = 8;            // 一个请求最多支持的范围数，更多时忽略Range发送整个文件
+    static const int MAX_HEADER_SIZE = 2048;    // 一个响应写入写缓冲区的最大字节数（多个范围时最多），写缓冲区能扩展到的剩余空间不足时这一批就结束
+    static const int SEGMENTS_PER_RESPONSE = 2 + 2 * MAX_RANGES;    // 一个响应最多由几段组成：多个范围时是响应头、每个范围的分隔头和内容、结尾的分隔符
     
-    // HTTP请求方法，这里只支持GET
+    // HTTP请求方法，这里支持GET、HEAD和OPTIONS
     enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT};
     
     /*
@@ -50,76 +105,230 @@ public:
         FILE_REQUEST        :   文件请求,获取文件成功
         INTERNAL_ERROR      :   表示服务器内部错误  internal
         CLOSED_CONNECTION   :   表示客户端已经关闭连接了
+        NOT_MODIFIED        :   条件请求成立，客户端缓存的文件仍然有效，只回复304响应头
+        OPTIONS_REQUEST     :   OPTIONS请求，回复预先生成的响应，不查找文件
+        METRICS_REQUEST     :   请求的是保留的指标路径，正文已经生成在m_body中
     */
-    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION, NOT_MODIFIED, OPTIONS_REQUEST, METRICS_REQUEST };
     
     // 从状态机的三种可能状态，即行的读取状态，分别表示
     // 1.读取到一个完整的行 2.行出错 3.行数据尚且不完整
     enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
+
+    /*
+        发送文件内容的方式
+        TX_WRITEV   :   文件被mmap到内存中，和响应头一起用writev发送
+        TX_SENDFILE :   响应头用带MSG_MORE的send发送，文件内容从缓存的fd用sendfile发送，不需要映射文件
+    */
+    enum TX_MODE { TX_WRITEV = 0, TX_SENDFILE };
+
+    /*
+        连接当前所处的阶段，决定超时定时器使用哪个期限
+        PHASE_IDLE      :   keep-alive连接在等待下一个请求，期限是KEEPALIVE_TIMEOUT
+        PHASE_READING   :   正在接收请求，期限是HEADER_TIMEOUT，从请求开始计时，收到更多数据也不延长
+        PHASE_WRITING   :   响应没能一次发送完，期限是WRITE_TIMEOUT，每次有发送进展就重新计时
+    */
+    enum CONN_PHASE { PHASE_IDLE = 0, PHASE_READING, PHASE_WRITING };
+
+    /*
+        待发送的响应由若干段数据组成
+        SEG_WRITE_BUF   :   写缓冲区中从offset开始的数据（动态生成的响应头）
+        SEG_MEMORY      :   base + offset处的内存，比如文件的内存映射、预先生成的响应头和错误响应
+        SEG_FILE        :   文件缓存项file中从offset开始的内容，用sendfile发送
+    */
+    enum SEGMENT_TYPE { SEG_WRITE_BUF = 0, SEG_MEMORY, SEG_FILE };
+
+    // 请求的一个字节范围，first和last都包含在内
+    struct byte_range {
+        off_t first;
+        off_t last;
+    };
+    struct tx_segment {
+        SEGMENT_TYPE type;
+        const char* base;
+        file_entry* file;
+        off_t offset;
+        size_t len;
+    };
+    // 数据段和这一批引用的缓存项一起放在缓冲区池的一个块中
+    static const int SEGMENT_BLOCK_SIZE = MAX_SEGMENTS * sizeof( tx_segment ) + MAX_PIPELINE * sizeof( file_entry* );
+    // 打开访问日志时，这一批响应的访问记录也放在缓冲区池的一个块中，发送完后复制到访问日志
+    static const int ACCESS_BLOCK_SIZE = MAX_PIPELINE * sizeof( access_record );
+
+    /*
+        一个头部字段在读缓冲区中的位置（不复制字段的内容），偏移都相对于m_read_buf，读缓冲区扩展时不需要修改。
+        value_off为0表示没有这个字段（字段值前面至少有字段名和冒号）。
+    */
+    struct header_slice {
+        unsigned short name_off;
+        unsigned short name_len;
+        unsigned short value_off;
+        unsigned short value_len;
+    };
+    static_assert( MAX_READ_BUFFER_SIZE <= 65536, "header_slice offsets are 16 bits" );
 public:
-    http_conn(){}
+    // 缓冲区在需要时才从缓冲区池中取，没有连接的http_conn只占很少的内存
+    http_conn() : m_gen( 0 ), m_queued_gen( 0 ), m_inflight( 0 ), m_slot( 0 ), m_read_buf( NULL ), m_read_size( 0 ), m_known( NULL ), m_extra( NULL ),
+                  m_write_buf( NULL ), m_write_size( 0 ), m_files( NULL ), m_segments( NULL ), m_body( NULL ), m_body_size( 0 ), m_access( NULL ) {}
     ~http_conn(){}
 public:
-    void init(int sockfd, const sockaddr_in& addr); // 初始化新接受的连接  
-    void close_conn();  // 关闭连接
+    // 初始化新接受的连接，epollfd和wheel是接受它的反应堆的epoll和时间轮，handback是它交还连接的队列；
+    // 使用io_uring后端时ring是接受它的反应堆，epollfd和handback不使用
+    void init(int sockfd, const sockaddr_in& addr, int epollfd, timer_wheel* wheel, epoll_handback* handback = NULL, uring_reactor* ring = NULL);
+    void close_conn();  // 关闭连接，只由连接所属的反应堆线程调用
     void process(); // 处理客户端请求
+    conn_task make_task();          // 反应堆把连接交给线程池之前调用，返回带有连接当前代数的任务
+    bool cancel_task();             // 反应堆取消还没有被工作线程取走的任务，成功时连接可以立即关闭
+    void run_task( unsigned int gen );  // 工作线程执行任务，任务已被取消或连接已经换了代数时直接丢弃
     bool read();// 非阻塞读
     bool write();// 非阻塞写
+    void update_timer();    // read()或write()之后根据连接的阶段重新设置超时定时器，只由反应堆线程调用
+    // 响应发送完毕后读缓冲区中还有客户端流水线发来的数据，需要再交给线程池处理
+    bool has_pipelined_request() const { return bytes_to_send == 0 && m_read_idx > 0; }
+    // 取当前请求的头部字段的值（以'\0'结尾），没有时返回NULL，len返回值的长度。在开始解析下一个请求之前有效
+    const char* get_header( HEADER_ID id, int* len = NULL ) const;
+    // 按字段名（不区分大小写）取头部字段，认识的字段O(1)，其余的按出现顺序比较
+    const char* get_header( const char* name, int* len = NULL ) const;
+
+    // 下面这组函数由io_uring后端的反应堆调用，它代替read()/write()完成收发
+    bool append_input( const char* data, int len );     // 把收到的数据追加到读缓冲区，超过最大的读缓冲区时返回false
+    int gather_segments( struct iovec* iv, bool* more ) const;  // 从发送位置起连续的内存段填入iv，返回段数
+    long pending_bytes() const { return bytes_to_send; }
+    int get_sockfd() const { return m_sockfd; }
+    // 连接的句柄：高32位是代数，低32位是在连接表中的槽位，登记在epoll和io_uring中，连接关闭后就失效
+    unsigned long handle() const { return ( ( unsigned long )m_gen << 32 ) | m_slot; }
+    void advance( long sent );  // 发送了sent字节，推进发送位置
+    bool finish_batch();        // 这一批响应发送完毕，返回false表示需要关闭连接
 private:
+    friend struct pipeline_bench;   // test_presure/pipeline_bench.cpp逐个调用下面的各个阶段
+    friend class conn_table;        // 连接表在分配一块连接时写入m_slot
+    friend class epoll_handback;    // 反应堆线程确认连接没有换代数后调用rearm
+    static void on_timeout( void* arg );    // 超时定时器的回调函数
     void init();    // 初始化连接
+    void rearm( int ev );   // 重新开始等待EPOLLIN或EPOLLOUT：epoll后端修改EPOLLONESHOT事件，io_uring后端提交接收或发送，只由反应堆线程调用
+    // 工作线程处理完后减少m_inflight并把连接交还给反应堆，反应堆发现连接已经换了代数时丢弃
+    void hand_back( int ev );
+    void input_arrived();   // 收到数据之后调用，连接建立后第一次收到数据时记录STAGE_ACCEPT_READ
+    void next_request();    // 丢弃已经处理完的请求，把剩下的数据移到读缓冲区开头，准备解析下一个请求
     HTTP_CODE process_read();    // 解析HTTP请求
     bool process_write( HTTP_CODE ret );    // 填充HTTP应答
+    bool batch_full() const;    // 这一批响应是否已经放不下下一个响应
+    void count_response( int status );  // 这一批中加入了一个状态码为status的响应
+    void fill_access( access_record* record, long bytes, unsigned long queue_ns, unsigned long service_ns ) const;
+    void log_access( unsigned long write_ns );  // 这一批响应发送完，把它们的访问记录交给访问日志
 
     // 下面这一组函数被process_read调用以分析HTTP请求
     HTTP_CODE parse_request_line( char* text );  //解析请求行
-    HTTP_CODE parse_headers( char* text );       //解析头部字段
-    HTTP_CODE parse_content( char* text );       //解析请求体
-    HTTP_CODE do_request();
+    HTTP_CODE parse_headers( char* text, int len ); //解析头部字段，len是这一行的长度
+    HTTP_CODE parse_content();                   //解析请求体
+    HTTP_CODE do_request( bool retry = true );
+    HTTP_CODE render_metrics(); // 生成/metrics的正文
+    bool accepts_gzip() const;  // 请求的Accept-Encoding是否接受gzip
+    bool wants_gzip() const;    // 对m_file（原文件）的请求是否应该回复压缩变体
+    bool not_modified() const;  // If-None-Match / If-Modified-Since 是否表明客户端的缓存仍然有效
+    bool range_applies() const; // 请求带有Range，且If-Range（如果有）与文件的当前版本相符
+    int parse_ranges( off_t size, byte_range* ranges ) const;
     char* get_line() { return m_read_buf + m_start_line; }
     LINE_STATUS parse_line();
 
     // 这一组函数被process_write调用以填充HTTP应答。
     void unmap();
+    bool grow_read_buf();
+    bool grow_write_buf();
+    void release_buffers();
+    void reset_headers();
+    bool add_segment( SEGMENT_TYPE type, const char* base, file_entry* file, off_t offset, size_t len );
+    bool add_body( off_t offset, size_t len );
+    bool add_range_response( const byte_range* ranges, int count );
     bool add_response( const char* format, ... );
-    bool add_content( const char* content );
-    bool add_content_type();
+    bool add_content_type( const char* type );
     bool add_status_line( int status, const char* title );
-    bool add_headers( int content_length );
-    bool add_content_length( int content_length );
+    bool add_content_length( long content_length );
     bool add_linger();
     bool add_blank_line();
 
 public:
-    static int m_epollfd;       // 所有socket上的事件都被注册到同一个epoll内核事件中，所以设置成静态的
-    static int m_user_count;    // 统计用户的数量
+    static std::atomic<int> m_user_count;    // 统计用户的数量，多个反应堆线程和工作线程都会修改
+    static conn_table* m_table;     // 连接所在的连接表，关闭时把槽位还给它；为NULL时（比如基准测试中单独创建的连接）不归还
+    static TX_MODE m_tx_mode;   // 发送文件内容的方式，所有连接相同
 
 private:
-    int m_sockfd;           // 该HTTP连接的socket和对方的socket地址
-    sockaddr_in m_address;
-    
-    char m_read_buf[ READ_BUFFER_SIZE ];    // 读缓冲区
-    int m_read_idx;                         // 标识读缓冲区中已经读入的客户端数据的最后一个字节的下一个位置
-    int m_checked_idx;                      // 当前正在分析的字符在读缓冲区中的位置
-    int m_start_line;                       // 当前正在解析的行的起始位置
-
-    CHECK_STATE m_check_state;              // 主状态机当前所处的状态
-    METHOD m_method;                        // 请求方法
-
-    char m_real_file[ FILENAME_LEN ];       // 客户请求的目标文件的完整路径，其内容等于 doc_root + m_url, doc_root是网站根目录
-    char* m_url;                            // 客户请求的目标文件的文件名
-    char* m_version;                        // HTTP协议版本号，我们仅支持HTTP1.1
-    char* m_host;                           // 主机名
-    int m_content_length;                   // HTTP请求的消息总长度
-    bool m_linger;                          // HTTP请求是否要求保持连接
-
-    char m_write_buf[ WRITE_BUFFER_SIZE ];  // 写缓冲区
-    int m_write_idx;                        // 写缓冲区中待发送的字节数
-    char* m_file_address;                   // 客户请求的目标文件被mmap到内存中的起始位置
-    struct stat m_file_stat;                // 目标文件的状态。通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
-    struct iovec m_iv[2];                   // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量。
-    int m_iv_count;
-    int bytes_to_send;                      //将要发送的数据的字节数
-    int bytes_have_send;                    // 已经发送的字节数
+    /*
+        成员按访问它们的线程和频率排列，整个对象按缓存行对齐，连接表中相邻的连接不共享缓存行（它们常常属于不同的反应堆）。
+        第一个缓存行：反应堆每个事件都要改的定时器和阶段，以及反应堆和工作线程交接任务用的字段。时间轮增删相邻的定时器时也会改m_timer，
+        这些写不会让工作线程正在使用的请求状态所在的缓存行失效；
+        从第二个缓存行开始：解析一个请求、准备和发送一批响应时用到的状态，紧凑排列；
+        最后是只在接受连接时或者偶尔用到的字段。整个对象320字节，五个缓存行。缓冲区、头部字段表、数据段和这一批引用的缓存项都放在缓冲区池的块中，空闲的连接不占用。
+    */
+    wheel_timer m_timer;                        // 嵌入在连接中的超时定时器，不需要单独分配
+    CONN_PHASE m_phase;                         // 连接当前所处的阶段，只由反应堆线程读写
+    unsigned int m_gen;                         // 连接的代数，接受和关闭连接时各加一（跳过0），只由反应堆线程读写
+    std::atomic<unsigned int> m_queued_gen;     // 排队中的任务的代数，没有时为0；工作线程取走或反应堆取消任务时清0，两者只有一个能成功
+    std::atomic<int> m_inflight;                // 已交给线程池但还没有处理完的任务数，不为0时超时定时器不能关闭连接；槽位复用时不清零
+    unsigned long m_queued_ns;                  // 交给线程池的时刻，由反应堆在入队前写入，工作线程用它记录STAGE_QUEUE_WAIT
+
+    alignas( 64 ) int m_sockfd;                 // 该HTTP连接的socket
+    unsigned int m_slot;                        // 在连接表中的槽位，由连接表写入，之后不变
+    int m_epollfd;                              // 该连接所属反应堆的epoll，连接上的事件只注册到这一个epoll中
+    CHECK_STATE m_check_state;                  // 主状态机当前所处的状态
+    union {
+        uring_reactor* m_ring;                  // 使用io_uring后端时（m_uring为true）该连接所属的反应堆
+        epoll_handback* m_handback;             // epoll后端中该连接所属反应堆的交还队列，为NULL时（基准测试）工作线程直接修改epoll
+    };
+    timer_wheel* m_wheel;                       // 该连接所属反应堆的时间轮
+
+    char* m_read_buf;                           // 读缓冲区，从缓冲区池中取得，放满后换成更大的块
+    int m_read_size;                            // 读缓冲区的大小
+    int m_read_idx;                             // 标识读缓冲区中已经读入的客户端数据的最后一个字节的下一个位置
+    int m_checked_idx;                          // 当前正在分析的字符在读缓冲区中的位置
+    int m_start_line;                           // 当前正在解析的行的起始位置
+
+    char* m_url;                                // 客户请求的目标文件的文件名
+    char* m_version;                            // HTTP协议版本号，我们仅支持HTTP1.1
+    char* m_host;                               // 主机名
+    header_slice* m_known;                      // 认识的头部字段，下标是HEADER_ID，同一个字段出现多次时记录最后一个
+    header_slice* m_extra;                      // 其余的头部字段，按出现的顺序，最多MAX_EXTRA_HEADERS个
+    int m_extra_count;                          // 两张表和读缓冲区一起从缓冲区池中取得，空闲的连接不占用
+    int m_content_length;                       // HTTP请求的消息总长度
+    METHOD m_method;                            // 请求方法
+    bool m_linger;                              // HTTP请求是否要求保持连接
+    bool m_close_after;                         // 这一批响应发送完后关闭连接
+    bool m_uring;                               // 连接属于io_uring后端的反应堆，m_ring有效；否则m_handback有效
+
+    char* m_write_buf;                          // 写缓冲区，一批响应的响应头依次写在这里，从缓冲区池中取得
+    int m_write_size;                           // 写缓冲区的大小
+    int m_write_idx;                            // 写缓冲区中待发送的字节数
+    file_entry* m_file;                         // 客户请求的目标文件在文件缓存中的缓存项，包含文件的状态信息和共享的内存映射
+    char* m_file_address;                       // 客户请求的目标文件被mmap到内存中的起始位置
+    file_entry** m_files;                       // 这一批响应引用的缓存项，全部发送完后释放；在数据段所在的块中，紧跟在数据段后面
+    int m_file_count;
+    int m_response_count;                       // 这一批中的响应数
+
+    tx_segment* m_segments;                     // 这一批响应按顺序排列的数据段，连续的内存段用一次sendmsg发送，和写缓冲区一起从池中取得
+    int m_segment_count;
+    int m_segment_idx;                          // 正在发送的数据段
+    size_t m_segment_sent;                      // 正在发送的数据段中已经发送的字节数
+    long bytes_to_send;                         //将要发送的数据的字节数
+    long bytes_have_send;                       // 已经发送的字节数
+    unsigned long m_batch_ns;                   // 这一批响应准备好的时刻
+
+    char* m_body;                               // 动态生成的响应正文（/metrics），从缓冲区池中取得，这一批发送完后归还；一批中最多一个
+    int m_body_size;
+    int m_body_len;
+    access_record* m_access;                    // 这一批响应的访问记录，下标和响应的顺序相同；没有打开访问日志时为NULL
+    unsigned long m_accept_ns;                  // 接受连接的时刻，收到第一个请求的数据后清零
+    sockaddr_in m_address;                      // 对方的socket地址
+};
+
+/*
+    交给线程池的任务：连接和入队时连接的代数。连接在排队期间被关闭后，同一个http_conn可能已经属于复用这个槽位的新连接；
+    工作线程取任务时用一次CAS核对代数，已被取消或过期的任务直接丢弃，不会解析请求、查找文件或改动新连接的状态
+*/
+struct conn_task {
+    http_conn* conn;
+    unsigned int gen;
+
+    void process() { conn->run_task( gen ); }
 };
 
 #endif
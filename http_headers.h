@@ -0,0 +1,81 @@
+#ifndef HTTP_HEADERS_H
+#define HTTP_HEADERS_H
+
+#include <strings.h>
+
+// 服务器认识的请求头部字段，每个请求中这些字段可以O(1)地取得
+enum HEADER_ID {
+    HDR_UNKNOWN = 0,
+    HDR_HOST, HDR_CONNECTION, HDR_CONTENT_LENGTH, HDR_CONTENT_TYPE,
+    HDR_ACCEPT, HDR_ACCEPT_ENCODING, HDR_ACCEPT_LANGUAGE,
+    HDR_RANGE, HDR_IF_RANGE, HDR_IF_NONE_MATCH, HDR_IF_MODIFIED_SINCE,
+    HDR_USER_AGENT, HDR_COOKIE, HDR_REFERER, HDR_TRANSFER_ENCODING,
+    HDR_EXPECT, HDR_UPGRADE, HDR_CACHE_CONTROL, HDR_AUTHORIZATION,
+    HDR_COUNT
+};
+
+struct header_name {
+    const char* name;   // 小写的字段名
+    int len;
+};
+
+// 下标是HEADER_ID
+constexpr header_name known_headers[ HDR_COUNT ] = {
+    { "", 0 },
+    { "host", 4 }, { "connection", 10 }, { "content-length", 14 }, { "content-type", 12 },
+    { "accept", 6 }, { "accept-encoding", 15 }, { "accept-language", 15 },
+    { "range", 5 }, { "if-range", 8 }, { "if-none-match", 13 }, { "if-modified-since", 17 },
+    { "user-agent", 10 }, { "cookie", 6 }, { "referer", 7 }, { "transfer-encoding", 17 },
+    { "expect", 6 }, { "upgrade", 7 }, { "cache-control", 13 }, { "authorization", 13 },
+};
+
+/*
+    字段名的完美哈希：只用长度、首字符和末字符，已知的字段名落在各不相同的槽中（由下面的static_assert保证）。
+    查找时算出槽，再和槽中唯一的候选比较一次，未知的字段名最多比较一次就能确定。
+    增加字段时如果static_assert失败，需要重新选择系数或者增大HEADER_HASH_SIZE。
+*/
+const int HEADER_HASH_SIZE = 32;
+
+constexpr char header_lower( char c ) {
+    return ( c >= 'A' && c <= 'Z' ) ? ( char )( c - 'A' + 'a' ) : c;
+}
+
+constexpr unsigned int header_hash( const char* name, int len ) {
+    return ( len + 7 * ( unsigned char )header_lower( name[0] )
+             + 24 * ( unsigned char )header_lower( name[ len - 1 ] ) ) & ( HEADER_HASH_SIZE - 1 );
+}
+
+// 槽 -> HEADER_ID，编译期生成
+struct header_slot_table {
+    unsigned char id[ HEADER_HASH_SIZE ];
+    constexpr header_slot_table() : id() {
+        for( int i = 1; i < HDR_COUNT; ++i ) {
+            id[ header_hash( known_headers[i].name, known_headers[i].len ) ] = ( unsigned char )i;
+        }
+    }
+};
+constexpr header_slot_table header_slots;
+
+constexpr bool header_hash_is_perfect() {
+    for( int i = 1; i < HDR_COUNT; ++i ) {
+        if( header_slots.id[ header_hash( known_headers[i].name, known_headers[i].len ) ] != i ) {
+            return false;
+        }
+    }
+    return true;
+}
+static_assert( header_hash_is_perfect(), "known header names collide in header_hash" );
+
+// 返回字段名对应的HEADER_ID，不认识的字段返回HDR_UNKNOWN，字段名不区分大小写
+inline HEADER_ID lookup_header( const char* name, int len ) {
+    if( len <= 0 ) {
+        return HDR_UNKNOWN;
+    }
+    int id = header_slots.id[ header_hash( name, len ) ];
+    if( id && known_headers[ id ].len == len && strncasecmp( name, known_headers[ id ].name, len ) == 0 ) {
+        return ( HEADER_ID )id;
+    }
+    return HDR_UNKNOWN;
+}
+
+#endif
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "http_response.h"
+
+// 定义HTTP响应的一些状态信息
+const char* ok_200_title = "OK";
+const char* error_400_title = "Bad Request";
+const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
+const char* error_403_title = "Forbidden";
+const char* error_403_form = "You do not have permission to get file from this server.\n";
+const char* error_404_title = "Not Found";
+const char* error_404_form = "The requested file was not found on this server.\n";
+const char* error_500_title = "Internal Error";
+const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+const char* error_503_title = "Service Unavailable";
+const char* error_503_form = "The server is too busy to handle the request, please try again later.\n";
+
+static const char keep_alive_text[] = "Connection: keep-alive\r\n\r\n";
+static const char close_text[] = "Connection: close\r\n\r\n";
+const static_response connection_keep_alive = { keep_alive_text, sizeof( keep_alive_text ) - 1 };
+const static_response connection_close = { close_text, sizeof( close_text ) - 1 };
+
+// 204不能带Content-Length和正文
+static const char options_text[] = "HTTP/1.1 204 No Content\r\nAllow: GET, HEAD, OPTIONS\r\n";
+const static_response options_response = { options_text, sizeof( options_text ) - 1 };
+
+const char* status_title( int status ) {
+    switch( status ) {
+        case 200: return ok_200_title;
+        case 204: return "No Content";
+        case 206: return "Partial Content";
+        case 304: return "Not Modified";
+        case 416: return "Range Not Satisfiable";
+        case 400: return error_400_title;
+        case 403: return error_403_title;
+        case 404: return error_404_title;
+        case 503: return error_503_title;
+        default: return error_500_title;
+    }
+}
+
+int http_date( time_t t, char* buf, int size ) {
+    struct tm tm;
+    gmtime_r( &t, &tm );
+    return strftime( buf, size, "%a, %d %b %Y %H:%M:%S GMT", &tm );
+}
+
+int render_file_header( const char* path, long length, time_t mtime, const char* etag, bool gzip, bool vary, char* buf, int size ) {
+    char date[ 64 ];
+    http_date( mtime, date, sizeof( date ) );
+    int len = snprintf( buf, size,
+        "HTTP/1.1 200 %s\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %ld\r\n"
+        "Last-Modified: %s\r\n"
+        "ETag: %s\r\n"
+        "%s%s",
+        ok_200_title, mime_type( path ), length, date, etag,
+        gzip ? "Content-Encoding: gzip\r\n" : "Accept-Ranges: bytes\r\n", vary ? "Vary: Accept-Encoding\r\n" : "" );
+    if( len < 0 || len >= size ) {
+        return -1;
+    }
+    return len;
+}
+
+void gzip_etag( const char* etag, char* buf, int size ) {
+    int len = strlen( etag );
+    snprintf( buf, size, "%.*s-gz\"", len - 1, etag );
+}
+
+bool etag_list_matches( const char* list, const char* etag ) {
+    int etag_len = strlen( etag );
+    const char* p = list;
+    while( *p ) {
+        p += strspn( p, " \t," );
+        if( *p == '*' ) {
+            return true;
+        }
+        if( strncmp( p, "W/", 2 ) == 0 ) {
+            p += 2;
+        }
+        int len = strcspn( p, " \t," );
+        if( len == etag_len && strncmp( p, etag, len ) == 0 ) {
+            return true;
+        }
+        p += len;
+    }
+    return false;
+}
+
+bool parse_http_date( const char* text, time_t* t ) {
+    struct tm tm;
+    memset( &tm, 0, sizeof( tm ) );
+    const char* end = strptime( text, "%a, %d %b %Y %H:%M:%S GMT", &tm );
+    if( !end || *end != '\0' ) {
+        return false;
+    }
+    *t = timegm( &tm );
+    return true;
+}
+
+/*
+    错误响应只有这几种，程序启动时各生成保持连接和关闭连接两个版本，之后只读，所有线程共享。
+*/
+static const int ERROR_STATUS[] = { 400, 403, 404, 500 };
+static const int ERROR_COUNT = sizeof( ERROR_STATUS ) / sizeof( ERROR_STATUS[0] );
+static char error_text[ ERROR_COUNT ][ 2 ][ 512 ];
+static static_response error_responses[ ERROR_COUNT ][ 2 ];
+static static_response error_heads[ ERROR_COUNT ][ 2 ];     // 同一段内容，只到响应头结束
+
+static const char* error_form( int status ) {
+    switch( status ) {
+        case 400: return error_400_form;
+        case 403: return error_403_form;
+        case 404: return error_404_form;
+        default: return error_500_form;
+    }
+}
+
+static bool build_error_responses() {
+    for( int i = 0; i < ERROR_COUNT; ++i ) {
+        int status = ERROR_STATUS[i];
+        const char* form = error_form( status );
+        for( int keep_alive = 0; keep_alive < 2; ++keep_alive ) {
+            const static_response& conn = keep_alive ? connection_keep_alive : connection_close;
+            int len = snprintf( error_text[i][ keep_alive ], sizeof( error_text[i][ keep_alive ] ),
+                "HTTP/1.1 %d %s\r\n"
+                "Content-Length: %d\r\n"
+                "Content-Type: text/html\r\n"
+                "%s%s",
+                status, status_title( status ), ( int )strlen( form ), conn.data, form );
+            error_responses[i][ keep_alive ].data = error_text[i][ keep_alive ];
+            error_responses[i][ keep_alive ].len = len;
+            error_heads[i][ keep_alive ].data = error_text[i][ keep_alive ];
+            error_heads[i][ keep_alive ].len = len - strlen( form );
+        }
+    }
+    return true;
+}
+
+static bool errors_built = build_error_responses();
+
+// 过载时的503总是关闭连接，Retry-After让客户端过一会儿再重试
+static const int RETRY_AFTER_SECONDS = 1;
+static char unavailable_text[ 512 ];
+static static_response unavailable = {
+    unavailable_text,
+    snprintf( unavailable_text, sizeof( unavailable_text ),
+        "HTTP/1.1 503 %s\r\n"
+        "Retry-After: %d\r\n"
+        "Content-Length: %d\r\n"
+        "Content-Type: text/html\r\n"
+        "%s%s",
+        error_503_title, RETRY_AFTER_SECONDS, ( int )strlen( error_503_form ), close_text, error_503_form )
+};
+
+const static_response* error_response( int status, bool keep_alive, bool head_only ) {
+    int i = 0;
+    while( i < ERROR_COUNT - 1 && ERROR_STATUS[i] != status ) {
+        i++;
+    }
+    return head_only ? &error_heads[i][ keep_alive ? 1 : 0 ] : &error_responses[i][ keep_alive ? 1 : 0 ];
+}
+
+const static_response* unavailable_response() {
+    return &unavailable;
+}
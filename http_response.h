@@ -0,0 +1,103 @@
+#ifndef HTTP_RESPONSE_H
+#define HTTP_RESPONSE_H
+
+#include <sys/stat.h>
+#include <strings.h>
+#include <time.h>
+
+/*
+    预先生成的响应内容，发送时直接作为一段内存加入响应，不需要再格式化：
+    文件响应的固定部分在文件被加载进文件缓存时生成一次；错误响应在程序启动时生成；
+    每个响应只有Connection字段和连接有关，从两个常量中选一个拼在后面。
+*/
+
+// 扩展名 -> MIME类型，编译期的常量表，扩展名不区分大小写；compressible表示值得用gzip压缩（文本类）
+struct mime_entry {
+    const char* ext;
+    const char* type;
+    bool compressible;
+};
+
+constexpr mime_entry mime_types[] = {
+    { "html", "text/html", true }, { "htm", "text/html", true }, { "css", "text/css", true },
+    { "js", "application/javascript", true }, { "json", "application/json", true },
+    { "txt", "text/plain", true }, { "xml", "application/xml", true },
+    { "jpg", "image/jpeg", false }, { "jpeg", "image/jpeg", false }, { "png", "image/png", false },
+    { "gif", "image/gif", false }, { "svg", "image/svg+xml", true }, { "ico", "image/x-icon", true },
+    { "webp", "image/webp", false }, { "bmp", "image/bmp", true },
+    { "pdf", "application/pdf", false }, { "zip", "application/zip", false }, { "gz", "application/gzip", false },
+    { "mp3", "audio/mpeg", false }, { "mp4", "video/mp4", false },
+    { "woff", "font/woff", false }, { "woff2", "font/woff2", false }, { "wasm", "application/wasm", true },
+};
+const mime_entry default_mime = { "", "application/octet-stream", false };
+
+// 按文件路径的扩展名查找MIME类型，没有扩展名或不认识时返回default_mime
+inline const mime_entry* find_mime( const char* path ) {
+    const char* dot = NULL;
+    for( const char* p = path; *p; ++p ) {
+        if( *p == '.' ) {
+            dot = p;
+        } else if( *p == '/' ) {
+            dot = NULL;
+        }
+    }
+    if( dot ) {
+        for( unsigned i = 0; i < sizeof( mime_types ) / sizeof( mime_types[0] ); ++i ) {
+            if( strcasecmp( dot + 1, mime_types[i].ext ) == 0 ) {
+                return &mime_types[i];
+            }
+        }
+    }
+    return &default_mime;
+}
+
+inline const char* mime_type( const char* path ) {
+    return find_mime( path )->type;
+}
+
+inline bool mime_compressible( const char* path ) {
+    return find_mime( path )->compressible;
+}
+
+// 一段预先生成的响应
+struct static_response {
+    const char* data;
+    int len;
+};
+
+// 响应头的结尾：Connection字段和空行，按是否保持连接选择
+extern const static_response connection_keep_alive;
+extern const static_response connection_close;
+
+// 状态码的描述，比如404返回"Not Found"
+const char* status_title( int status );
+
+// 把时间格式化成HTTP日期（RFC 7231的IMF-fixdate），比如"Sun, 06 Nov 1994 08:49:37 GMT"，返回长度
+int http_date( time_t t, char* buf, int size );
+
+/*
+    生成文件响应的固定部分（状态行、Content-Type、Content-Length、Last-Modified、ETag、Accept-Ranges），写入buf，返回长度，size不够时返回-1。
+    path决定Content-Type，length是发送的字节数；gzip为true时加上Content-Encoding（压缩变体不支持范围请求），
+    vary为true时加上Vary: Accept-Encoding（同一个URL按请求头会返回不同的内容，缓存需要区分）。由文件缓存在加载文件时调用
+*/
+int render_file_header( const char* path, long length, time_t mtime, const char* etag, bool gzip, bool vary, char* buf, int size );
+
+// 由原文件的ETag生成压缩变体的ETag：在结尾的引号前加上-gz。两种表示的内容不同，强ETag必须不同
+void gzip_etag( const char* etag, char* buf, int size );
+
+// If-None-Match的值（逗号分隔的ETag列表或*）中是否有etag，按弱比较（忽略W/前缀）
+bool etag_list_matches( const char* list, const char* etag );
+
+// 解析HTTP日期（If-Modified-Since等），成功时返回true
+bool parse_http_date( const char* text, time_t* t );
+
+// 完整的错误响应（响应头和HTML正文），status是400、403、404或500；head_only为true时不含正文（HEAD请求）
+const static_response* error_response( int status, bool keep_alive, bool head_only = false );
+
+// 过载时由反应堆直接发送的503响应（带Retry-After和Connection: close），完整的一段，不需要再拼接
+const static_response* unavailable_response();
+
+// OPTIONS请求的响应（204和Allow字段），不含Connection字段和空行
+extern const static_response options_response;
+
+#endif
@@ -0,0 +1,151 @@
+#include <immintrin.h>
+#include "http_scan.h"
+
+// 逐字节查找，也用来处理向量实现剩下的不足一个向量的尾部
+static const char* line_end_scalar( const char* p, const char* end ) {
+    for( ; p < end; ++p ) {
+        if( *p == '\r' || *p == '\n' ) {
+            break;
+        }
+    }
+    return p;
+}
+
+static const char* token_end_scalar( const char* p, const char* end ) {
+    for( ; p < end; ++p ) {
+        if( *p == ' ' || *p == '\t' || *p == '\0' ) {
+            break;
+        }
+    }
+    return p;
+}
+
+/*
+    SSE4.2：PCMPESTRI一条指令在16个字节中查找字符集合中任一字符第一次出现的位置。
+    使用显式长度的版本，字符集合中可以包含'\0'，缓冲区中的'\0'也不会提前结束比较。
+*/
+__attribute__(( target( "sse4.2" ) ))
+static const char* line_end_sse42( const char* p, const char* end ) {
+    const __m128i set = _mm_setr_epi8( '\r', '\n', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 );
+    for( ; end - p >= 16; p += 16 ) {
+        __m128i v = _mm_loadu_si128( ( const __m128i* )p );
+        int idx = _mm_cmpestri( set, 2, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT );
+        if( idx < 16 ) {
+            return p + idx;
+        }
+    }
+    return line_end_scalar( p, end );
+}
+
+__attribute__(( target( "sse4.2" ) ))
+static const char* token_end_sse42( const char* p, const char* end ) {
+    const __m128i set = _mm_setr_epi8( ' ', '\t', '\0', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 );
+    for( ; end - p >= 16; p += 16 ) {
+        __m128i v = _mm_loadu_si128( ( const __m128i* )p );
+        int idx = _mm_cmpestri( set, 3, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT );
+        if( idx < 16 ) {
+            return p + idx;
+        }
+    }
+    return token_end_scalar( p, end );
+}
+
+// AVX2：每次比较32个字节，把各个字符的比较结果合并成位掩码，最低的置位就是第一次出现的位置
+__attribute__(( target( "avx2" ) ))
+static const char* line_end_avx2( const char* p, const char* end ) {
+    const __m256i cr = _mm256_set1_epi8( '\r' );
+    const __m256i lf = _mm256_set1_epi8( '\n' );
+    for( ; end - p >= 32; p += 32 ) {
+        __m256i v = _mm256_loadu_si256( ( const __m256i* )p );
+        __m256i hit = _mm256_or_si256( _mm256_cmpeq_epi8( v, cr ), _mm256_cmpeq_epi8( v, lf ) );
+        unsigned int mask = ( unsigned int )_mm256_movemask_epi8( hit );
+        if( mask ) {
+            return p + __builtin_ctz( mask );
+        }
+    }
+    return line_end_sse42( p, end );
+}
+
+__attribute__(( target( "avx2" ) ))
+static const char* token_end_avx2( const char* p, const char* end ) {
+    const __m256i sp = _mm256_set1_epi8( ' ' );
+    const __m256i tab = _mm256_set1_epi8( '\t' );
+    const __m256i nul = _mm256_setzero_si256();
+    for( ; end - p >= 32; p += 32 ) {
+        __m256i v = _mm256_loadu_si256( ( const __m256i* )p );
+        __m256i hit = _mm256_or_si256( _mm256_or_si256( _mm256_cmpeq_epi8( v, sp ), _mm256_cmpeq_epi8( v, tab ) ),
+                                       _mm256_cmpeq_epi8( v, nul ) );
+        unsigned int mask = ( unsigned int )_mm256_movemask_epi8( hit );
+        if( mask ) {
+            return p + __builtin_ctz( mask );
+        }
+    }
+    return token_end_sse42( p, end );
+}
+
+static bool cpu_supports( SCAN_IMPL impl ) {
+    __builtin_cpu_init();
+    switch( impl ) {
+        case SCAN_AVX2:
+            // AVX2的实现用SSE4.2处理不足32字节的尾部
+            return __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "sse4.2" );
+        case SCAN_SSE42:
+            return __builtin_cpu_supports( "sse4.2" );
+        default:
+            return true;
+    }
+}
+
+static SCAN_IMPL best_impl() {
+    if( cpu_supports( SCAN_AVX2 ) ) {
+        return SCAN_AVX2;
+    }
+    if( cpu_supports( SCAN_SSE42 ) ) {
+        return SCAN_SSE42;
+    }
+    return SCAN_SCALAR;
+}
+
+static SCAN_IMPL current_impl = SCAN_SCALAR;
+const char* ( *scan_line_end )( const char* p, const char* end ) = line_end_scalar;
+const char* ( *scan_token_end )( const char* p, const char* end ) = token_end_scalar;
+
+bool http_scan_select( SCAN_IMPL impl ) {
+    if( !cpu_supports( impl ) ) {
+        return false;
+    }
+    switch( impl ) {
+        case SCAN_AVX2:
+            scan_line_end = line_end_avx2;
+            scan_token_end = token_end_avx2;
+            break;
+        case SCAN_SSE42:
+            scan_line_end = line_end_sse42;
+            scan_token_end = token_end_sse42;
+            break;
+        default:
+            scan_line_end = line_end_scalar;
+            scan_token_end = token_end_scalar;
+            break;
+    }
+    current_impl = impl;
+    return true;
+}
+
+SCAN_IMPL http_scan_impl() {
+    return current_impl;
+}
+
+const char* http_scan_impl_name( SCAN_IMPL impl ) {
+    switch( impl ) {
+        case SCAN_AVX2:
+            return "avx2";
+        case SCAN_SSE42:
+            return "sse4.2";
+        default:
+            return "scalar";
+    }
+}
+
+// 程序启动时（main之前）选择CPU支持的最快实现
+static bool scan_selected = http_scan_select( best_impl() );
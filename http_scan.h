@@ -0,0 +1,22 @@
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+/*
+    解析HTTP请求时查找分隔符的函数，一次比较16~32个字节。
+    程序启动时按CPUID选择实现：支持AVX2时用AVX2，否则支持SSE4.2时用PCMPESTRI，都不支持时逐字节查找。
+    所有实现只读取[p, end)范围内的字节，结果与逐字节查找完全相同。
+*/
+enum SCAN_IMPL { SCAN_SCALAR = 0, SCAN_SSE42, SCAN_AVX2 };
+
+// 返回[p, end)中第一个'\r'或'\n'的位置，没有时返回end
+extern const char* ( *scan_line_end )( const char* p, const char* end );
+// 返回[p, end)中第一个' '、'\t'或'\0'的位置，没有时返回end
+extern const char* ( *scan_token_end )( const char* p, const char* end );
+
+// 切换到指定的实现，CPU不支持时返回false并保持原来的实现（用于基准测试）
+bool http_scan_select( SCAN_IMPL impl );
+// 当前使用的实现
+SCAN_IMPL http_scan_impl();
+const char* http_scan_impl_name( SCAN_IMPL impl );
+
+#endif
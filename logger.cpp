@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "logger.h"
+
+thread_local log_ring* logger::m_local = NULL;
+
+static const char* LEVEL_NAMES[] = { "DEBUG", "INFO ", "WARN ", "ERROR" };
+
+logger* logger::get_instance() {
+    static logger instance;
+    return &instance;
+}
+
+bool logger::start( const char* path ) {
+    if ( m_running.load() ) {
+        return true;
+    }
+    m_fd = path ? open( path, O_WRONLY | O_CREAT | O_APPEND, 0644 ) : STDOUT_FILENO;
+    if ( m_fd < 0 ) {
+        return false;
+    }
+    m_batch = new char[ BATCH_SIZE ];
+    m_now_ns.store( realtime_ns() );
+    m_stop.store( false );
+    if ( pthread_create( &m_thread, NULL, flusher, this ) != 0 ) {
+        delete [] m_batch;
+        m_batch = NULL;
+        return false;
+    }
+    m_running.store( true );
+    return true;
+}
+
+void logger::stop() {
+    if ( !m_running.load() ) {
+        return;
+    }
+    m_running.store( false );
+    m_stop.store( true );
+    pthread_join( m_thread, NULL );
+    if ( m_fd != STDOUT_FILENO ) {
+        close( m_fd );
+    }
+    m_fd = -1;
+    delete [] m_batch;
+    m_batch = NULL;
+}
+
+log_ring* logger::add_ring() {
+    log_ring* ring = new log_ring;
+    ring->head.store( 0 );
+    ring->tail.store( 0 );
+    ring->tail_cache = 0;
+    ring->reserved_at = 0;
+    ring->dropped.store( 0 );
+    // 先写一遍，缺页发生在线程第一次记录日志时，而不是之后处理请求的过程中
+    memset( ring->data, 0, log_ring::SIZE );
+    m_lock.lock();
+    ring->index = m_ring_count++;
+    ring->next = m_rings;
+    m_rings = ring;
+    m_lock.unlock();
+    m_local = ring;
+    return ring;
+}
+
+unsigned long logger::dropped() {
+    m_lock.lock();
+    log_ring* ring = m_rings;
+    m_lock.unlock();
+    unsigned long total = 0;
+    // 缓冲区只会插到链表头部，已经在链表中的节点的next不会再变
+    for ( ; ring; ring = ring->next ) {
+        total += ring->dropped.load( std::memory_order_relaxed );
+    }
+    return total;
+}
+
+unsigned long logger::realtime_ns() {
+    struct timespec ts;
+    clock_gettime( CLOCK_REALTIME, &ts );
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void* logger::flusher( void* arg ) {
+    logger* log = ( logger* )arg;
+    unsigned long last_write = 0;
+    while ( !log->m_stop.load() ) {
+        unsigned long now = realtime_ns();
+        log->m_now_ns.store( now, std::memory_order_relaxed );
+        // 每个tick都把缓冲区取空，突发的日志不会很快填满缓冲区；攒满一批或者到了刷新间隔才写文件
+        bool busy = log->drain();
+        if ( now - last_write >= FLUSH_INTERVAL_MS * 1000000UL ) {
+            log->write_batch();
+            last_write = now;
+        }
+        if ( !busy ) {
+            struct timespec tick = { 0, CLOCK_TICK_MS * 1000000L };
+            nanosleep( &tick, NULL );
+        }
+    }
+    // 停止前把剩下的记录写完
+    log->drain();
+    log->write_batch();
+    return NULL;
+}
+
+bool logger::drain() {
+    m_lock.lock();
+    log_ring* rings = m_rings;
+    m_lock.unlock();
+    bool busy = false;
+    for ( log_ring* ring = rings; ring; ring = ring->next ) {
+        size_t head = ring->head.load( std::memory_order_acquire );
+        size_t tail = ring->tail.load( std::memory_order_relaxed );
+        if ( tail == head ) {
+            continue;
+        }
+        busy = true;
+        while ( tail != head ) {
+            const log_record* record = ( const log_record* )( ring->data + ( tail & ( log_ring::SIZE - 1 ) ) );
+            if ( record->level != log_record::LOG_PAD ) {
+                append_record( ring, record );
+            }
+            tail += record->len;
+        }
+        ring->tail.store( tail, std::memory_order_release );
+    }
+    unsigned long drops = dropped();
+    if ( drops != m_reported_drops ) {
+        char text[ 64 ];
+        int len = snprintf( text, sizeof( text ), "%lu log records dropped", drops - m_reported_drops );
+        append_line( LOG_LEVEL_WARN, -1, realtime_ns(), text, len );
+        m_reported_drops = drops;
+    }
+    return busy;
+}
+
+// 向out追加格式化的内容，截断时返回false
+static bool append( char* out, int size, int* len, const char* format, ... ) {
+    va_list arg_list;
+    va_start( arg_list, format );
+    int n = vsnprintf( out + *len, size - *len, format, arg_list );
+    va_end( arg_list );
+    if ( n < 0 ) {
+        return false;
+    }
+    if ( n >= size - *len ) {
+        *len = size - 1;
+        return false;
+    }
+    *len += n;
+    return true;
+}
+
+/*
+    按格式串解释记录中的参数。转换说明中的标志、宽度和精度原样保留，长度修饰符换成参数实际的类型（整数都按64位记录）；
+    参数的类型和转换说明不符时按参数自己的类型输出，参数不够时原样输出转换说明。不支持'*'宽度和%n
+*/
+void logger::append_record( const log_ring* ring, const log_record* record ) {
+    char text[ MAX_LINE ];
+    int len = 0;
+    const char* arg = ( const char* )( record + 1 );
+    int left = record->argc;
+    const char* f = record->format;
+    bool ok = true;
+    while ( *f && ok ) {
+        const char* percent = strchr( f, '%' );
+        int literal = percent ? percent - f : ( int )strlen( f );
+        if ( literal > 0 ) {
+            ok = append( text, sizeof( text ), &len, "%.*s", literal, f );
+            f += literal;
+            continue;
+        }
+        if ( f[1] == '%' ) {
+            ok = append( text, sizeof( text ), &len, "%%" );
+            f += 2;
+            continue;
+        }
+        // 标志、宽度和精度
+        const char* spec_end = f + 1;
+        while ( *spec_end && strchr( "-+ #0123456789.", *spec_end ) ) {
+            spec_end++;
+        }
+        char spec[ 32 ];
+        int spec_len = spec_end - f < 24 ? spec_end - f : 24;
+        memcpy( spec, f, spec_len );
+        while ( *spec_end && strchr( "hlLqjzt", *spec_end ) ) {
+            spec_end++;
+        }
+        char conv = *spec_end;
+        if ( !conv || left == 0 ) {
+            ok = append( text, sizeof( text ), &len, "%.*s", ( int )( spec_end - f ) + ( conv ? 1 : 0 ), f );
+            f = conv ? spec_end + 1 : spec_end;
+            continue;
+        }
+        f = spec_end + 1;
+        char type = *arg;
+        if ( type == log_args::ARG_STR ) {
+            unsigned short n;
+            memcpy( &n, arg + 1, 2 );
+            char value[ log_args::MAX_STRING + 1 ];
+            memcpy( value, arg + 3, n );
+            value[n] = '\0';
+            arg += 3 + n;
+            spec[ spec_len ] = 's';
+            spec[ spec_len + 1 ] = '\0';
+            ok = append( text, sizeof( text ), &len, conv == 's' ? spec : "%s", value );
+        } else {
+            unsigned long raw;
+            memcpy( &raw, arg + 1, 8 );
+            arg += 9;
+            if ( type == log_args::ARG_DOUBLE ) {
+                double value;
+                memcpy( &value, &raw, 8 );
+                bool fits = conv && strchr( "fFeEgGaA", conv );
+                spec[ spec_len ] = fits ? conv : 'g';
+                spec[ spec_len + 1 ] = '\0';
+                ok = append( text, sizeof( text ), &len, fits ? spec : "%g", value );
+            } else if ( type == log_args::ARG_PTR ) {
+                ok = append( text, sizeof( text ), &len, "%p", ( void* )raw );
+            } else if ( conv == 'c' ) {
+                ok = append( text, sizeof( text ), &len, "%c", ( int )raw );
+            } else {
+                bool fits = strchr( "diouxX", conv ) != NULL;
+                if ( !fits ) {
+                    conv = ( type == log_args::ARG_INT ) ? 'd' : 'u';
+                    spec_len = 1;
+                }
+                spec[ spec_len ] = 'l';
+                spec[ spec_len + 1 ] = conv;
+                spec[ spec_len + 2 ] = '\0';
+                ok = append( text, sizeof( text ), &len, spec, raw );
+            }
+        }
+        left--;
+    }
+    append_line( record->level, ring->index, record->ts_ns, text, len );
+}
+
+// 一行日志：本地时间（毫秒）、级别、线程编号（-1表示日志系统自己）和内容
+void logger::append_line( int level, int thread, unsigned long ts_ns, const char* text, int len ) {
+    if ( m_batch_len + MAX_LINE + 64 > BATCH_SIZE ) {
+        write_batch();
+    }
+    long sec = ts_ns / 1000000000UL;
+    if ( sec != m_last_sec ) {
+        time_t t = sec;
+        struct tm tm;
+        localtime_r( &t, &tm );
+        strftime( m_time_prefix, sizeof( m_time_prefix ), "%Y-%m-%d %H:%M:%S", &tm );
+        m_last_sec = sec;
+    }
+    m_batch_len += snprintf( m_batch + m_batch_len, BATCH_SIZE - m_batch_len, "%s.%03lu %s [%d] %.*s\n",
+                             m_time_prefix, ts_ns / 1000000 % 1000, LEVEL_NAMES[ level & 3 ], thread, len, text );
+}
+
+void logger::write_batch() {
+    if ( m_batch_len == 0 ) {
+        return;
+    }
+    size_t done = 0;
+    while ( done < m_batch_len ) {
+        ssize_t n = write( m_fd, m_batch + done, m_batch_len - done );
+        if ( n < 0 && errno == EINTR ) {
+            continue;
+        }
+        if ( n <= 0 ) {
+            break;      // 写不进去的日志丢弃，不能让后台线程卡住
+        }
+        done += n;
+    }
+    m_batch_len = 0;
+}
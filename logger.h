@@ -0,0 +1,226 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <atomic>
+#include <type_traits>
+#include "locker.h"
+
+// 日志级别。低于LOG_LEVEL的日志语句在编译时就被去掉，参数也不会求值；默认保留INFO及以上，编译时加-DLOG_LEVEL=0打开DEBUG
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// 格式串和参数按printf检查（-Wformat），不会被调用
+static inline void log_check_format( const char*, ... ) __attribute__(( format( printf, 1, 2 ) ));
+static inline void log_check_format( const char*, ... ) {}
+
+#define LOG_AT( level, format, ... ) \
+    do { \
+        if ( false ) { \
+            log_check_format( format, ##__VA_ARGS__ ); \
+        } \
+        if constexpr ( ( level ) >= LOG_LEVEL ) { \
+            logger::get_instance()->log( level, format, ##__VA_ARGS__ ); \
+        } \
+    } while ( 0 )
+#define LOG_DEBUG( format, ... ) LOG_AT( LOG_LEVEL_DEBUG, format, ##__VA_ARGS__ )
+#define LOG_INFO( format, ... ) LOG_AT( LOG_LEVEL_INFO, format, ##__VA_ARGS__ )
+#define LOG_WARN( format, ... ) LOG_AT( LOG_LEVEL_WARN, format, ##__VA_ARGS__ )
+#define LOG_ERROR( format, ... ) LOG_AT( LOG_LEVEL_ERROR, format, ##__VA_ARGS__ )
+
+/*
+    一条日志记录的头部，后面紧跟着编码后的参数，整条记录按8字节对齐。
+    格式串必须是字符串字面量（只保存指针），由后台线程在写文件时才格式化。
+    level为LOG_PAD的记录只用来填满环形缓冲区末尾放不下下一条记录的空间
+*/
+struct log_record {
+    static const unsigned char LOG_PAD = 0xff;
+    unsigned int len;
+    unsigned char level;
+    unsigned char argc;
+    unsigned short reserved;
+    unsigned long ts_ns;        // 后台线程每CLOCK_TICK_MS毫秒更新一次的时钟
+    const char* format;
+};
+
+/*
+    参数的编码：一个字节的类型，整数、浮点数和指针各8字节，字符串是2字节的长度加内容（不含'\0'，最长MAX_STRING字节，更长的截断）。
+    字符串在记录时就复制，调用者的缓冲区（比如读缓冲区）之后被改写也没有关系
+*/
+class log_args {
+public:
+    enum ARG_TYPE { ARG_INT = 'i', ARG_UINT = 'u', ARG_DOUBLE = 'f', ARG_PTR = 'p', ARG_STR = 's' };
+    static const size_t MAX_STRING = 512;
+
+    static size_t size() { return 0; }
+    template< typename T, typename... Rest >
+    static size_t size( T value, Rest... rest ) { return arg_size( value ) + size( rest... ); }
+
+    static char* encode( char* p ) { return p; }
+    template< typename T, typename... Rest >
+    static char* encode( char* p, T value, Rest... rest ) { return encode( put( p, value ), rest... ); }
+
+private:
+    static size_t str_len( const char* s ) { return s ? strnlen( s, MAX_STRING ) : 6; }
+    static size_t arg_size( const char* s ) { return 3 + str_len( s ); }
+    static size_t arg_size( char* s ) { return 3 + str_len( s ); }
+    template< typename T >
+    static size_t arg_size( T ) { return 9; }
+
+    static char* put( char* p, const char* s ) {
+        unsigned short len = str_len( s );
+        *p = ARG_STR;
+        memcpy( p + 1, &len, 2 );
+        memcpy( p + 3, s ? s : "(null)", len );
+        return p + 3 + len;
+    }
+    static char* put( char* p, char* s ) { return put( p, ( const char* )s ); }
+    template< typename T >
+    static char* put( char* p, T value ) {
+        if constexpr ( std::is_floating_point< T >::value ) {
+            double d = value;
+            *p = ARG_DOUBLE;
+            memcpy( p + 1, &d, 8 );
+        } else if constexpr ( std::is_pointer< T >::value ) {
+            const void* ptr = value;
+            *p = ARG_PTR;
+            memcpy( p + 1, &ptr, 8 );
+        } else if constexpr ( std::is_enum< T >::value || std::is_signed< T >::value ) {
+            long l = ( long )value;
+            *p = ARG_INT;
+            memcpy( p + 1, &l, 8 );
+        } else {
+            unsigned long u = ( unsigned long )value;
+            *p = ARG_UINT;
+            memcpy( p + 1, &u, 8 );
+        }
+        return p + 9;
+    }
+};
+
+/*
+    一个线程的日志环形缓冲区：单生产者（所属线程）单消费者（后台写日志的线程），没有锁。
+    head和tail是只增不减的字节位置，各占一个缓存行；生产者缓存一份tail，只在看起来放不下时才去读消费者的缓存行。
+    放不下的记录直接丢弃并计数，记录日志的线程从不等待
+*/
+struct alignas( 64 ) log_ring {
+    static const size_t SIZE = 1 << 16;
+
+    std::atomic<size_t> head;           // 生产者写
+    size_t tail_cache;                  // 生产者最近一次看到的tail
+    size_t reserved_at;                 // reserve得到的记录的位置，commit时用
+    std::atomic<unsigned long> dropped; // 放不下而丢弃的记录数
+    int index;                          // 第几个记录日志的线程，写在每一行中
+    log_ring* next;
+    alignas( 64 ) std::atomic<size_t> tail;     // 消费者写
+    alignas( 64 ) char data[ SIZE ];
+
+    // 取len字节（8的倍数）的连续空间，放不下时返回NULL；末尾剩下的空间不够时先用一条填充记录跳到开头
+    char* reserve( size_t len ) {
+        size_t pos = head.load( std::memory_order_relaxed );
+        size_t offset = pos & ( SIZE - 1 );
+        size_t pad = offset + len > SIZE ? SIZE - offset : 0;
+        if ( pos + pad + len - tail_cache > SIZE ) {
+            tail_cache = tail.load( std::memory_order_acquire );
+            if ( pos + pad + len - tail_cache > SIZE ) {
+                dropped.store( dropped.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+                return NULL;
+            }
+        }
+        if ( pad ) {
+            log_record* filler = ( log_record* )( data + offset );
+            filler->len = pad;
+            filler->level = log_record::LOG_PAD;
+            pos += pad;
+        }
+        reserved_at = pos;
+        return data + ( pos & ( SIZE - 1 ) );
+    }
+    // 记录写完，对消费者可见（填充记录一起可见）
+    void commit( size_t len ) { head.store( reserved_at + len, std::memory_order_release ); }
+};
+
+/*
+    异步日志：记录日志的线程只把格式串指针、时间戳和参数的原始值写进自己的环形缓冲区（线程第一次记录时分配，和指标分片一样永不释放），
+    不格式化、不加锁、不进入内核，时间戳也不读时钟，而是读后台线程每毫秒更新的一个变量（clock_gettime比整条记录的其余部分还慢）；
+    后台线程每毫秒（有积压时连续地）把各个缓冲区中的记录取出、格式化成文本，攒满一批或者每FLUSH_INTERVAL_MS毫秒用一次write写到日志文件。
+    同一个线程的记录保持顺序，不同线程之间按缓冲区轮流输出，不按时间排序。
+    start之前和stop之后记录的日志被忽略（比如基准测试中直接使用http_conn时）
+*/
+class logger
+{
+public:
+    static const int FLUSH_INTERVAL_MS = 50;   // 不满一批的日志最多等这么久写出
+    static const int CLOCK_TICK_MS = 1;         // 后台线程取缓冲区的间隔，也是记录中时间戳的精度
+    static const size_t BATCH_SIZE = 1 << 16;   // 每次write的最大字节数
+    static const int MAX_LINE = 2048;           // 一行日志格式化后的最大长度，更长的截断
+
+public:
+    static logger* get_instance();
+
+    // 打开日志文件（path为NULL时写到标准输出）并启动后台线程
+    bool start( const char* path );
+    // 写完已经记录的日志，停止后台线程
+    void stop();
+
+    template< typename... Args >
+    void log( int level, const char* format, Args... args ) {
+        if ( !m_running.load( std::memory_order_relaxed ) ) {
+            return;
+        }
+        log_ring* ring = m_local ? m_local : add_ring();
+        size_t len = ( sizeof( log_record ) + log_args::size( args... ) + 7 ) & ~( size_t )7;
+        char* p = ring->reserve( len );
+        if ( !p ) {
+            return;
+        }
+        log_record* record = ( log_record* )p;
+        record->len = len;
+        record->level = level;
+        record->argc = sizeof...( args );
+        record->ts_ns = m_now_ns.load( std::memory_order_relaxed );
+        record->format = format;
+        log_args::encode( p + sizeof( log_record ), args... );
+        ring->commit( len );
+    }
+
+    // 所有线程丢弃的记录数
+    unsigned long dropped();
+
+private:
+    logger() : m_now_ns( 0 ), m_rings( NULL ), m_ring_count( 0 ), m_fd( -1 ), m_running( false ), m_stop( false ),
+               m_batch( NULL ), m_batch_len( 0 ), m_reported_drops( 0 ), m_last_sec( -1 ) {}
+    log_ring* add_ring();
+    static void* flusher( void* arg );
+    static unsigned long realtime_ns();
+    bool drain();       // 取出所有缓冲区中的记录格式化到m_batch中（满了就写出），返回是否取到了
+    void append_record( const log_ring* ring, const log_record* record );
+    void append_line( int level, int thread, unsigned long ts_ns, const char* text, int len );
+    void write_batch();
+
+private:
+    static thread_local log_ring* m_local;
+    alignas( 64 ) std::atomic<unsigned long> m_now_ns;     // 后台线程写，所有记录日志的线程读，单独占一个缓存行
+    alignas( 64 ) locker m_lock;                 // 保护缓冲区链表的插入
+    log_ring* m_rings;
+    int m_ring_count;
+    int m_fd;
+    pthread_t m_thread;
+    std::atomic<bool> m_running;
+    std::atomic<bool> m_stop;
+    // 下面的只由后台线程使用
+    char* m_batch;
+    size_t m_batch_len;
+    unsigned long m_reported_drops;
+    long m_last_sec;                // 缓存的时间前缀对应的秒数
+    char m_time_prefix[ 32 ];
+};
+
+#endif
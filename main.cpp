@@ -8,16 +8,34 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
+#include "uring_reactor.h"
+#include "admission.h"
+#include "logger.h"
+#include "access_log.h"
 #include <signal.h>
+#include <getopt.h>
+#include <libgen.h>
 
-#define MAX_FD 65536   // 最大的文件描述符个数
 #define MAX_EVENT_NUMBER 10000  // 监听的最大的事件数量
+#define MAX_REACTOR 64  // 反应堆线程的最大数量
+#define TIMESLOT_MS 100 // 时间轮每个tick的毫秒数
+#define MAX_REQUESTS 10000  // 请求队列的容量
+#define MAX_QUEUE_WAIT_MS 100   // 请求在队列中等待超过这个时间就认为过载
+#define RESERVED_FDS 64 // 连接之外需要的文件描述符（监听socket、epoll、timerfd、文件缓存打开的文件等）
+
+// epoll事件中监听socket、timerfd和交还队列的eventfd的标识。连接的句柄高32位是代数，不会为0，所以不会和它们相同
+#define LISTEN_TOKEN 0UL
+#define TIMER_TOKEN 1UL
+#define HANDBACK_TOKEN 2UL
 
 // 添加文件描述符（extern置于函数前,标示函数的定义在别的文件中，提示编译器遇到此函数时在其他模块中寻找其定义。）
-extern void addfd( int epollfd, int fd, bool one_shot );
+extern void addfd( int epollfd, int fd, bool one_shot, unsigned long data );
 extern void removefd( int epollfd, int fd );
 //添加信号捕捉
 void addsig(int sig, void( handler )(int)){ //处理信号
@@ -29,29 +47,36 @@ void addsig(int sig, void( handler )(int)){ //处理信号
     assert( sigaction( sig, &sa, NULL ) != -1 );
 }
 
-int main( int argc, char* argv[] ) {
-    
-    if( argc <= 1 ) {//至少要传递端口号
-        printf( "usage: %s port_number\n", basename(argv[0])); //获取程序的名称
-        return 1;
-    }
+void show_usage( const char* prog ) {
+    printf( "usage: %s [-t writev|sendfile] [-r reactors] [-e epoll|uring] [-H] [-l logfile] [-a access_log_dir] port_number\n", basename( (char*)prog ) );
+}
 
-    int port = atoi( argv[1] ); //字符串转化为整数 获取端口号
-    /*
-       SIGPIPE:当向一个disconnected socket发送数据时，会让底层抛出一个SIGPIPE信号
-    */
-    addsig( SIGPIPE, SIG_IGN );  //对SIGPIE信号进行处理，当捕捉到这个信号时，忽略它
-    
-	//创建线程池，初始化线程池
-	
-    threadpool< http_conn >* pool = NULL; //任务： http连接任务
-    try {
-        pool = new threadpool<http_conn>; //创建一个解决http连接任务的线程池
-    } catch( ... ) {
-        return 1;
-    }
+/*
+    反应堆：一个线程独占一个监听socket和一个epoll实例，只处理自己接受的那部分连接。
+    多个反应堆的监听socket都设置了SO_REUSEPORT并绑定同一个端口，由内核把新连接分散到各个监听socket上，
+    所有反应堆共享同一个线程池和连接表，epoll事件带回的是连接的句柄，反应堆按句柄在连接表中找到连接。
+    每个反应堆还有自己的时间轮，由加入epoll的timerfd每TIMESLOT_MS毫秒驱动一次，负责回收超时的连接。
+    工作线程处理完的连接放进反应堆的交还队列，由反应堆线程确认连接没有被关闭后再重新注册事件。
+    使用io_uring后端时ring不为NULL，反应堆线程运行ring的事件循环，epollfd不使用。
+*/
+struct reactor {
+    int listenfd;
+    int epollfd;
+    int timerfd;
+    timer_wheel* wheel;
+    epoll_handback* handback;
+    uring_reactor* ring;
+    pthread_t thread;
+};
+
+static conn_table* table = NULL;
+// 请求队列使用工作窃取队列：每个工作线程一个队列，按fd分配任务，同一个连接的请求尽量留在同一个线程上
+// 队列中是带代数的任务，连接在排队期间被关闭时工作线程会丢弃它
+typedef threadpool< conn_task, stealing_queue > http_conn_pool;
+static http_conn_pool* pool = NULL;
 
-    http_conn* users = new http_conn[ MAX_FD ];// 创建多个任务
+// 创建一个监听port的socket，reuseport为true时允许多个socket绑定同一个端口
+int create_listenfd( int port, bool reuseport ) {
     //创建一个用于监听的套接字
     /*
        AF_INET： ipv4
@@ -62,9 +87,12 @@ int main( int argc, char* argv[] ) {
 
     */
     int listenfd = socket( PF_INET, SOCK_STREAM, 0 ); //创建一个socket对象
+    if( listenfd < 0 ) {
+        return -1;
+    }
 
-    int ret = 0;
     struct sockaddr_in address;
+    memset( &address, 0, sizeof( address ) );
     address.sin_addr.s_addr = INADDR_ANY;  //表示本机所有IP
     address.sin_family = AF_INET;//网络协议
     address.sin_port = htons( port ); //端口号
@@ -72,18 +100,57 @@ int main( int argc, char* argv[] ) {
     // 端口复用
     int reuse = 1; //设置套接字的选项
     setsockopt( listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
+    if( reuseport ) {
+        setsockopt( listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof( reuse ) );
+    }
     /*
        将这个监听文件描述符与服务器的IP和端口绑定（IP和端口就是服务器的地址信息，也是客户端用来连接的）
     */
-    ret = bind( listenfd, ( struct sockaddr* )&address, sizeof( address ) );
-    ret = listen( listenfd, 5 ); // 设置监听，监听的fd开始工作
+    if( bind( listenfd, ( struct sockaddr* )&address, sizeof( address ) ) < 0
+        || listen( listenfd, SOMAXCONN ) < 0 ) { // 设置监听，监听的fd开始工作；队列太短时大量同时到来的连接会被丢弃SYN，客户端要等1秒重传
+        close( listenfd );
+        return -1;
+    }
+    return listenfd;
+}
 
-    // 创建epoll对象，和事件数组，添加
-    epoll_event events[ MAX_EVENT_NUMBER ];
-    int epollfd = epoll_create( 5 );  //创建一个epoll的句柄
-    // 添加到epoll对象中
-    addfd( epollfd, listenfd, false ); //把listenfd添加到epollfd,设置为非阻塞
-    http_conn::m_epollfd = epollfd; //自始至终都只有一个epollfd 
+// 把连接交给线程池处理已经读到的请求
+void dispatch( http_conn* conn, int sockfd ) {
+    if( !pool->append( conn->make_task(), sockfd ) ) { //数据读取这个工作是主线程干的，按fd选择工作线程
+        // 入队失败：进入过载状态，直接回复503并关闭连接，否则这个连接不会再有事件，只能等超时
+        conn->cancel_task();
+        admission::get_instance()->queue_full();
+        admission::send_unavailable( sockfd );
+        metrics::local()->count( CNT_SHED_QUEUE_FULL );
+        conn->close_conn();
+    }
+}
+
+// 准入控制用来采样请求队列的长度
+static int queue_depth() {
+    return pool->queue_depth();
+}
+
+// 指标输出时取每个工作线程的统计信息
+static void worker_stats_of( int worker, worker_stats* stats ) {
+    pool->get_worker_stats( worker, stats );
+}
+
+// 反应堆的事件循环
+void* reactor_loop( void* arg ) {
+    reactor* r = ( reactor* )arg;
+    if( r->ring ) {
+        if( !r->ring->run() ) {
+            LOG_ERROR( "io_uring setup failed, errno is: %d", errno );
+        }
+        return NULL;
+    }
+    int listenfd = r->listenfd;
+    int epollfd = r->epollfd;
+    int timerfd = r->timerfd;
+    // 事件数组，每个反应堆一个
+    epoll_event* events = new epoll_event[ MAX_EVENT_NUMBER ];
+    bool timeout = false;
 
     while(true) {
         //等待事件的产生，参数events用来从内核得到事件的集合。
@@ -91,15 +158,15 @@ int main( int argc, char* argv[] ) {
         int number = epoll_wait( epollfd, events, MAX_EVENT_NUMBER, -1 );
         
         if ( ( number < 0 ) && ( errno != EINTR ) ) {
-            printf( "epoll failure\n" );
+            LOG_ERROR( "epoll failure" );
             break;
         }
 
         for ( int i = 0; i < number; i++ ) {
             
-            int sockfd = events[i].data.fd;
+            unsigned long token = events[i].data.u64;
             
-            if( sockfd == listenfd ) { //监听到fd
+            if( token == LISTEN_TOKEN ) { //监听到fd
                 
                 struct sockaddr_in client_address;
                 socklen_t client_addrlength = sizeof( client_address );
@@ -112,15 +179,22 @@ int main( int argc, char* argv[] ) {
                 int connfd = accept( listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
                 
                 if ( connfd < 0 ) {
-                    printf( "errno is: %d\n", errno );
+                    LOG_ERROR( "accept failure, errno is: %d", errno );
                     continue;
                 } 
 
-                if( http_conn::m_user_count >= MAX_FD ) {
+                if( !admission::get_instance()->admit() ) {
+                    // 过载时不注册新连接，回复503后关闭
+                    admission::refuse( connfd );
+                    continue;
+                }
+                http_conn* conn = table->acquire();
+                if( !conn ) {
+                    // 连接表已满
                     close(connfd);
                     continue;
                 }
-                users[connfd].init( connfd, client_address);  //拿id,和客户端的地址来初始化一个任务。
+                conn->init( connfd, client_address, epollfd, r->wheel, r->handback );  //拿id,和客户端的地址来初始化一个任务，连接归属于本反应堆的epoll和时间轮。
                 /*
                    初始化所做的事：
                    （1）创建端口复用；
@@ -129,36 +203,248 @@ int main( int argc, char* argv[] ) {
 
                 */
 
-            } else if( events[i].events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) {
+                continue;
+            }
+
+            if( token == HANDBACK_TOKEN ) {
+                // 工作线程处理完交还的连接，按句柄确认没有被关闭后重新注册事件
+                r->handback->drain();
+                continue;
+            }
+
+            if( token == TIMER_TOKEN ) {
+                // 用timeout变量标记有定时任务需要处理，但不立即处理定时任务
+                // 这是因为定时任务的优先级不是很高，我们优先处理其他更重要的任务。
+                timeout = true;
+                continue;
+            }
+
+            http_conn* conn = table->lookup( token );
+            if( !conn ) {
+                // 同一批事件中前面已经关闭的连接，槽位可能已经给了新连接
+                continue;
+            }
+            if( events[i].events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) {
 
                 //EPOLLHUP：表示对应的文件描述符被挂断;
                 //EPOLLERR: 表示对应的文件描述符发生错误；
                 //以上两个不需要在epoll_event时针对fd作设置，一样会被触发
                 //EPOLLRDHUP:对端关闭时会触发，需要显示地在epoll_ctl调用时，设置在events中
 
-                users[sockfd].close_conn();  //从epollfd中去掉sockfd
+                conn->close_conn();  //从epollfd中去掉sockfd
 
             } else if(events[i].events & EPOLLIN) {//表示对应的文件描述符可以读
                 //根本没有把异步io模拟出来，这个把数据从内核态拷贝到用户态这个过程还是需要等待的。
-                if(users[sockfd].read()) {  //把数据一次性读出来(此时的fd是什么触发方式ET or LT),没有设置，就应该是LT吧？
-                    pool->append(users + sockfd); //数据读取这个工作是主线程干的
+                if(conn->read()) {  //把数据一次性读出来(此时的fd是什么触发方式ET or LT),没有设置，就应该是LT吧？
+                    conn->update_timer();
+                    dispatch( conn, conn->get_sockfd() );
                 } else {
-                    users[sockfd].close_conn();
+                    conn->close_conn();
                 }
 
             }  else if( events[i].events & EPOLLOUT ) {//表示对应的文件描述符可以写 ，捕捉到写
 
-                if( !users[sockfd].write() ) { //如果HTTP请求没有要求保持连接，就断开连接
-                    users[sockfd].close_conn();
+                if( !conn->write() ) { //如果HTTP请求没有要求保持连接，就断开连接
+                    conn->close_conn();
+                } else {
+                    conn->update_timer();
+                    if( conn->has_pipelined_request() ) {
+                        // 上一批响应发完了，读缓冲区中还有流水线请求，直接交给线程池继续处理
+                        dispatch( conn, conn->get_sockfd() );
+                    }
                 }
 
             }
         }
+
+        // 最后处理定时事件，因为I/O事件有更高的优先级。
+        if( timeout ) {
+            uint64_t expirations = 0;
+            if( read( timerfd, &expirations, sizeof( expirations ) ) == sizeof( expirations ) ) {
+                r->wheel->tick( expirations );
+            }
+            admission::get_instance()->update();
+            access_log::get_instance()->tick();
+            timeout = false;
+        }
+    }
+
+    delete [] events;
+    return NULL;
+}
+
+int main( int argc, char* argv[] ) {
+    
+    // -t：发送文件内容的方式，writev（默认）或 sendfile
+    // -r：反应堆线程的数量，默认1个，即只有主线程一个epoll
+    // -e：I/O后端，epoll（默认）或 uring
+    // -H：连接表用大页存放
+    // -l：日志文件，默认写到标准输出
+    // -a：访问日志的目录，不指定时不记录访问日志
+    int reactor_number = 1;
+    bool use_uring = false;
+    bool huge_pages = false;
+    const char* log_path = NULL;
+    const char* access_dir = NULL;
+    int opt;
+    while( ( opt = getopt( argc, argv, "t:r:e:Hl:a:" ) ) != -1 ) {
+        switch( opt ) {
+            case 't':
+                if( strcmp( optarg, "sendfile" ) == 0 ) {
+                    http_conn::m_tx_mode = http_conn::TX_SENDFILE;
+                } else if( strcmp( optarg, "writev" ) == 0 ) {
+                    http_conn::m_tx_mode = http_conn::TX_WRITEV;
+                } else {
+                    printf( "unknown transmit mode %s\n", optarg );
+                    return 1;
+                }
+                break;
+            case 'r':
+                reactor_number = atoi( optarg );
+                if( reactor_number <= 0 || reactor_number > MAX_REACTOR ) {
+                    printf( "reactor number must be in [1, %d]\n", MAX_REACTOR );
+                    return 1;
+                }
+                break;
+            case 'e':
+                if( strcmp( optarg, "uring" ) == 0 ) {
+                    use_uring = true;
+                } else if( strcmp( optarg, "epoll" ) != 0 ) {
+                    printf( "unknown backend %s\n", optarg );
+                    return 1;
+                }
+                break;
+            case 'H':
+                huge_pages = true;
+                break;
+            case 'l':
+                log_path = optarg;
+                break;
+            case 'a':
+                access_dir = optarg;
+                break;
+            default:
+                show_usage( argv[0] );
+                return 1;
+        }
     }
+
+    if( optind >= argc ) {//至少要传递端口号
+        show_usage( argv[0] ); //获取程序的名称
+        return 1;
+    }
+
+    int port = atoi( argv[optind] ); //字符串转化为整数 获取端口号
+    // 之后的日志由后台线程成批写出，请求处理中不再调用printf
+    if( !logger::get_instance()->start( log_path ) ) {
+        printf( "cannot open log file %s\n", log_path );
+        return 1;
+    }
+    if( access_dir && !access_log::get_instance()->open( access_dir ) ) {
+        LOG_ERROR( "cannot create access log in %s, errno is: %d", access_dir, errno );
+        logger::get_instance()->stop();
+        return 1;
+    }
+    if( use_uring ) {
+        if( !uring_reactor::supported() ) {
+            LOG_WARN( "io_uring is not supported by this kernel, using epoll" );
+            use_uring = false;
+        } else if( http_conn::m_tx_mode == http_conn::TX_SENDFILE ) {
+            // io_uring没有sendfile，文件内容通过mmap的内存和响应头一起发送
+            LOG_INFO( "io_uring backend sends files with writev" );
+            http_conn::m_tx_mode = http_conn::TX_WRITEV;
+        }
+    }
+    /*
+       SIGPIPE:当向一个disconnected socket发送数据时，会让底层抛出一个SIGPIPE信号
+    */
+    addsig( SIGPIPE, SIG_IGN );  //对SIGPIE信号进行处理，当捕捉到这个信号时，忽略它
     
-    close( epollfd ); // epoll句柄本身会占一个fd的值，使用完epoll,必须调用close关闭。
-    close( listenfd );
-    delete [] users;
+	//创建线程池，初始化线程池
+	
+    try {
+        pool = new http_conn_pool( 8, MAX_REQUESTS ); //创建一个解决http连接任务的线程池
+    } catch( ... ) {
+        logger::get_instance()->stop();
+        return 1;
+    }
+    // 队列用到一半时开始拒绝新连接，降到四分之一以下恢复
+    admission::get_instance()->configure( MAX_REQUESTS / 2, MAX_REQUESTS / 4, MAX_QUEUE_WAIT_MS * 1000000UL, queue_depth );
+    metrics::get_instance()->set_workers( pool->thread_number(), worker_stats_of );
+
+    // 连接表的容量由打开文件数的限制决定：先把软限制提高到硬限制，再留出连接之外需要的fd
+    struct rlimit limit;
+    getrlimit( RLIMIT_NOFILE, &limit );
+    if( limit.rlim_cur < limit.rlim_max ) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit( RLIMIT_NOFILE, &limit );
+        getrlimit( RLIMIT_NOFILE, &limit );
+    }
+    rlim_t capacity = limit.rlim_cur > RESERVED_FDS * 2 ? limit.rlim_cur - RESERVED_FDS : RESERVED_FDS;
+    if( capacity > ( rlim_t )conn_table::MAX_CAPACITY ) {
+        capacity = conn_table::MAX_CAPACITY;
+    }
+    table = new conn_table( ( int )capacity, huge_pages );  // 连接按需分配
+    http_conn::m_table = table;
+
+    // 每个反应堆一个监听socket和一个epoll对象，多于一个反应堆时用SO_REUSEPORT绑定同一个端口
+    reactor reactors[ MAX_REACTOR ];
+    for( int i = 0; i < reactor_number; ++i ) {
+        reactors[i].listenfd = create_listenfd( port, reactor_number > 1 );
+        if( reactors[i].listenfd < 0 ) {
+            LOG_ERROR( "listen on port %d failed, errno is: %d", port, errno );
+            logger::get_instance()->stop();
+            return 1;
+        }
+        // 周期性的timerfd驱动时间轮
+        reactors[i].wheel = new timer_wheel( TIMESLOT_MS );
+        reactors[i].timerfd = timerfd_create( CLOCK_MONOTONIC, 0 );
+        struct itimerspec its;
+        its.it_value.tv_sec = TIMESLOT_MS / 1000;
+        its.it_value.tv_nsec = ( TIMESLOT_MS % 1000 ) * 1000000;
+        its.it_interval = its.it_value;
+        timerfd_settime( reactors[i].timerfd, 0, &its, NULL );
+
+        reactors[i].epollfd = epoll_create( 5 );  //创建一个epoll的句柄
+        reactors[i].ring = NULL;
+        reactors[i].handback = NULL;
+        if( use_uring ) {
+            // io_uring在反应堆线程中创建，监听socket和timerfd由它提交读请求
+            reactors[i].ring = new uring_reactor( reactors[i].listenfd, reactors[i].timerfd, reactors[i].wheel,
+                                                  table, dispatch );
+            continue;
+        }
+        // 添加到epoll对象中
+        addfd( reactors[i].epollfd, reactors[i].listenfd, false, LISTEN_TOKEN ); //把listenfd添加到epollfd,设置为非阻塞
+        addfd( reactors[i].epollfd, reactors[i].timerfd, false, TIMER_TOKEN );
+        reactors[i].handback = new epoll_handback();
+        addfd( reactors[i].epollfd, reactors[i].handback->eventfd(), false, HANDBACK_TOKEN );
+    }
+
+    // 第0个反应堆在主线程中运行，其余的各自创建一个线程
+    for( int i = 1; i < reactor_number; ++i ) {
+        if( pthread_create( &reactors[i].thread, NULL, reactor_loop, &reactors[i] ) != 0 ) {
+            LOG_ERROR( "create reactor thread failed" );
+            logger::get_instance()->stop();
+            return 1;
+        }
+    }
+    reactor_loop( &reactors[0] );
+    for( int i = 1; i < reactor_number; ++i ) {
+        pthread_join( reactors[i].thread, NULL );
+    }
+
+    for( int i = 0; i < reactor_number; ++i ) {
+        close( reactors[i].epollfd ); // epoll句柄本身会占一个fd的值，使用完epoll,必须调用close关闭。
+        close( reactors[i].listenfd );
+        close( reactors[i].timerfd );
+        delete reactors[i].ring;
+        delete reactors[i].handback;
+        delete reactors[i].wheel;
+    }
+    delete table;
     delete pool;
+    access_log::get_instance()->close();
+    logger::get_instance()->stop();
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "metrics.h"
+#include "file_cache.h"
+#include "buffer_pool.h"
+#include "admission.h"
+#include "logger.h"
+#include "access_log.h"
+
+const char* const metrics::PATH = "/metrics";
+const char* const metrics::CONTENT_TYPE = "text/plain; version=0.0.4; charset=utf-8";
+
+thread_local metrics_shard* metrics::m_local = NULL;
+
+static const char* STAGE_NAMES[ STAGE_COUNT ] = { "accept_read", "queue_wait", "parse", "lookup", "write" };
+
+// 分别计数的状态码，其余的记在最后一项（500）中
+static const int STATUS_CODES[] = { 200, 204, 206, 304, 400, 403, 404, 416, 503, 500 };
+static const int STATUS_COUNT = sizeof( STATUS_CODES ) / sizeof( STATUS_CODES[0] );
+static_assert( STATUS_COUNT == sizeof( metrics_shard::responses ) / sizeof( metrics_shard::responses[0] ), "one counter per status code" );
+
+// 输出的直方图的上界是2^MIN_LE_EXP到2^MAX_LE_EXP纳秒（约1微秒到17秒），正好落在内部桶的边界上，累计计数是精确的
+static const int MIN_LE_EXP = 10;
+static const int MAX_LE_EXP = 34;
+
+// 输出的分位数
+static const double QUANTILES[] = { 0.5, 0.9, 0.99, 0.999 };
+
+void metrics_shard::count_status( int status ) {
+    int i = 0;
+    while ( i < STATUS_COUNT - 1 && STATUS_CODES[i] != status ) {
+        i++;
+    }
+    responses[i].store( responses[i].load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+}
+
+metrics* metrics::get_instance() {
+    static metrics instance;
+    return &instance;
+}
+
+metrics_shard* metrics::add_shard() {
+    // 值初始化，所有计数从0开始
+    metrics_shard* shard = new metrics_shard();
+    m_lock.lock();
+    shard->next = m_shards;
+    m_shards = shard;
+    m_lock.unlock();
+    m_local = shard;
+    return shard;
+}
+
+// 向buf追加格式化的内容，放不下时返回false
+static bool append( char* buf, int size, int* len, const char* format, ... ) {
+    va_list arg_list;
+    va_start( arg_list, format );
+    int n = vsnprintf( buf + *len, size - *len, format, arg_list );
+    va_end( arg_list );
+    if ( n < 0 || n >= size - *len ) {
+        return false;
+    }
+    *len += n;
+    return true;
+}
+
+int metrics::render( char* buf, int size ) {
+    // 合并各线程的分片，合并用的数组是静态的，整个过程持有锁。分片的写入者不加锁，读到的是某个时刻附近的值，同一个直方图的桶和总和可能相差一两次记录
+    static unsigned long buckets[ STAGE_COUNT ][ latency_histogram::BUCKET_COUNT ];
+    unsigned long sums[ STAGE_COUNT ] = { 0 };
+    unsigned long counters[ COUNTER_COUNT ] = { 0 };
+    unsigned long responses[ STATUS_COUNT ] = { 0 };
+
+    m_lock.lock();
+    memset( buckets, 0, sizeof( buckets ) );
+    for ( metrics_shard* shard = m_shards; shard; shard = shard->next ) {
+        for ( int s = 0; s < STAGE_COUNT; ++s ) {
+            for ( int b = 0; b < latency_histogram::BUCKET_COUNT; ++b ) {
+                buckets[s][b] += shard->stages[s].bucket( b );
+            }
+            sums[s] += shard->stages[s].sum();
+        }
+        for ( int c = 0; c < COUNTER_COUNT; ++c ) {
+            counters[c] += shard->counters[c].load( std::memory_order_relaxed );
+        }
+        for ( int i = 0; i < STATUS_COUNT; ++i ) {
+            responses[i] += shard->responses[i].load( std::memory_order_relaxed );
+        }
+    }
+
+    int len = 0;
+    bool ok = append( buf, size, &len,
+        "# HELP webserver_stage_duration_seconds Time spent in each stage of request handling.\n"
+        "# TYPE webserver_stage_duration_seconds histogram\n" );
+    unsigned long totals[ STAGE_COUNT ];
+    for ( int s = 0; s < STAGE_COUNT && ok; ++s ) {
+        unsigned long cumulative = 0;
+        int b = 0;
+        for ( int exp = MIN_LE_EXP; exp <= MAX_LE_EXP && ok; ++exp ) {
+            // 小于2^exp的值都在这个桶之前
+            int end = latency_histogram::bucket_of( 1UL << exp );
+            for ( ; b < end; ++b ) {
+                cumulative += buckets[s][b];
+            }
+            ok = append( buf, size, &len, "webserver_stage_duration_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %lu\n",
+                         STAGE_NAMES[s], ( double )( 1UL << exp ) / 1e9, cumulative );
+        }
+        for ( ; b < latency_histogram::BUCKET_COUNT; ++b ) {
+            cumulative += buckets[s][b];
+        }
+        totals[s] = cumulative;
+        ok = ok && append( buf, size, &len,
+            "webserver_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n"
+            "webserver_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n"
+            "webserver_stage_duration_seconds_count{stage=\"%s\"} %lu\n",
+            STAGE_NAMES[s], cumulative, STAGE_NAMES[s], sums[s] / 1e9, STAGE_NAMES[s], cumulative );
+    }
+
+    // 分位数用内部的细分桶计算，取所在桶的上界，误差不超过1/SUB_COUNT
+    ok = ok && append( buf, size, &len,
+        "# HELP webserver_stage_duration_quantile_seconds Stage latency quantiles estimated from the histogram buckets.\n"
+        "# TYPE webserver_stage_duration_quantile_seconds gauge\n" );
+    for ( int s = 0; s < STAGE_COUNT && ok; ++s ) {
+        for ( unsigned q = 0; q < sizeof( QUANTILES ) / sizeof( QUANTILES[0] ) && ok; ++q ) {
+            unsigned long rank = ( unsigned long )( QUANTILES[q] * totals[s] + 0.5 );
+            unsigned long seen = 0;
+            int b = 0;
+            while ( b < latency_histogram::BUCKET_COUNT - 1 && ( seen += buckets[s][b] ) < rank ) {
+                b++;
+            }
+            double value = totals[s] ? latency_histogram::bucket_max( b ) / 1e9 : 0;
+            ok = append( buf, size, &len, "webserver_stage_duration_quantile_seconds{stage=\"%s\",quantile=\"%g\"} %.9g\n",
+                         STAGE_NAMES[s], QUANTILES[q], value );
+        }
+    }
+    m_lock.unlock();
+
+    ok = ok && append( buf, size, &len,
+        "# HELP webserver_responses_total Responses by status code.\n"
+        "# TYPE webserver_responses_total counter\n" );
+    for ( int i = 0; i < STATUS_COUNT && ok; ++i ) {
+        ok = append( buf, size, &len, "webserver_responses_total{code=\"%d\"} %lu\n", STATUS_CODES[i], responses[i] );
+    }
+
+    file_cache_stats cache;
+    file_cache::get_instance()->get_stats( &cache );
+    ok = ok && append( buf, size, &len,
+        "# TYPE webserver_connections_accepted_total counter\n"
+        "webserver_connections_accepted_total %lu\n"
+        "# TYPE webserver_connections_closed_total counter\n"
+        "webserver_connections_closed_total %lu\n"
+        "# TYPE webserver_connections gauge\n"
+        "webserver_connections %ld\n"
+        "# TYPE webserver_sent_bytes_total counter\n"
+        "webserver_sent_bytes_total %lu\n"
+        "# HELP webserver_shed_total Connections answered with 503 because the server was overloaded.\n"
+        "# TYPE webserver_shed_total counter\n"
+        "webserver_shed_total{reason=\"accept\"} %lu\n"
+        "webserver_shed_total{reason=\"queue_full\"} %lu\n"
+        "# HELP webserver_stale_tasks_total Queued requests dropped because their connection was closed while waiting.\n"
+        "# TYPE webserver_stale_tasks_total counter\n"
+        "webserver_stale_tasks_total %lu\n"
+        "# TYPE webserver_overloaded gauge\n"
+        "webserver_overloaded %d\n"
+        "# TYPE webserver_queue_depth gauge\n"
+        "webserver_queue_depth %d\n"
+        "# HELP webserver_log_dropped_total Log records dropped because a thread's log buffer was full.\n"
+        "# TYPE webserver_log_dropped_total counter\n"
+        "webserver_log_dropped_total %lu\n"
+        "# HELP webserver_access_log_records_total Access log records written to segment files.\n"
+        "# TYPE webserver_access_log_records_total counter\n"
+        "webserver_access_log_records_total %lu\n"
+        "# HELP webserver_access_log_dropped_total Access log records dropped because no segment file was ready.\n"
+        "# TYPE webserver_access_log_dropped_total counter\n"
+        "webserver_access_log_dropped_total %lu\n"
+        "# TYPE webserver_file_cache_hits_total counter\n"
+        "webserver_file_cache_hits_total %lu\n"
+        "# TYPE webserver_file_cache_misses_total counter\n"
+        "webserver_file_cache_misses_total %lu\n"
+        "# TYPE webserver_file_cache_evictions_total counter\n"
+        "webserver_file_cache_evictions_total %lu\n"
+        "# TYPE webserver_file_cache_entries gauge\n"
+        "webserver_file_cache_entries %lu\n"
+        "# TYPE webserver_file_cache_bytes gauge\n"
+        "webserver_file_cache_bytes %lu\n"
+        "# TYPE webserver_buffer_pool_blocks_in_use gauge\n",
+        counters[ CNT_ACCEPTED ], counters[ CNT_CLOSED ], ( long )( counters[ CNT_ACCEPTED ] - counters[ CNT_CLOSED ] ),
+        counters[ CNT_BYTES_SENT ], counters[ CNT_SHED_ACCEPT ], counters[ CNT_SHED_QUEUE_FULL ], counters[ CNT_STALE_TASKS ],
+        admission::get_instance()->overloaded() ? 1 : 0, admission::get_instance()->last_depth(),
+        logger::get_instance()->dropped(), access_log::get_instance()->records(), access_log::get_instance()->dropped(),
+        cache.hits, cache.misses, cache.evictions, cache.entries, cache.bytes );
+    for ( int i = 0; i < buffer_pool::CLASS_COUNT && ok; ++i ) {
+        buffer_class_stats stats;
+        buffer_pool::get_instance()->get_stats( i, &stats );
+        ok = append( buf, size, &len, "webserver_buffer_pool_blocks_in_use{size=\"%lu\"} %lu\n", stats.block_size, stats.in_use );
+    }
+
+    // 每个工作线程按worker标签输出一条，同一指标的各条放在一起
+    static const char* const WORKER_SERIES[] = {
+        "webserver_worker_tasks_total", "webserver_worker_steals_total",
+        "webserver_worker_idle_seconds_total", "webserver_worker_queue_depth" };
+    for ( int m = 0; m < 4 && m_worker_stats && ok; ++m ) {
+        ok = append( buf, size, &len, "# TYPE %s %s\n", WORKER_SERIES[m], m == 3 ? "gauge" : "counter" );
+        for ( int i = 0; i < m_worker_count && ok; ++i ) {
+            worker_stats stats;
+            m_worker_stats( i, &stats );
+            if ( m == 2 ) {
+                ok = append( buf, size, &len, "%s{worker=\"%d\"} %.6f\n", WORKER_SERIES[m], i, stats.idle_us / 1e6 );
+            } else {
+                unsigned long value = m == 0 ? stats.tasks : m == 1 ? stats.steals : ( unsigned long )stats.depth;
+                ok = append( buf, size, &len, "%s{worker=\"%d\"} %lu\n", WORKER_SERIES[m], i, value );
+            }
+        }
+    }
+    return ok ? len : -1;
+}
@@ -0,0 +1,132 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <time.h>
+#include <atomic>
+#include "locker.h"
+#include "work_queue.h"
+
+/*
+    请求处理各阶段的耗时，每个阶段一个直方图
+    STAGE_ACCEPT_READ   :   从接受连接到读到第一个请求的数据
+    STAGE_QUEUE_WAIT    :   从反应堆把连接交给线程池到工作线程开始处理（在请求队列中等待的时间）
+    STAGE_PARSE         :   解析一个请求（请求行和头部字段）
+    STAGE_LOOKUP        :   查找文件缓存、打开和映射文件，即do_request
+    STAGE_WRITE         :   从一批响应准备好到全部发送完
+*/
+enum METRIC_STAGE { STAGE_ACCEPT_READ = 0, STAGE_QUEUE_WAIT, STAGE_PARSE, STAGE_LOOKUP, STAGE_WRITE, STAGE_COUNT };
+
+// 计数器，CNT_SHED_ACCEPT是过载时在接受连接处拒绝的连接数，CNT_SHED_QUEUE_FULL是因请求队列已满而回复503的次数，
+// CNT_STALE_TASKS是连接在排队期间被关闭、工作线程丢弃的任务数
+enum METRIC_COUNTER { CNT_ACCEPTED = 0, CNT_CLOSED, CNT_BYTES_SENT, CNT_SHED_ACCEPT, CNT_SHED_QUEUE_FULL, CNT_STALE_TASKS, COUNTER_COUNT };
+
+/*
+    HDR风格的对数-线性直方图，单位是纳秒：每个2的幂的区间再等分成SUB_COUNT个桶，相对误差不超过1/SUB_COUNT。
+    小于SUB_COUNT的值每个值一个桶；大于2^MAX_EXP的值都记在最后一个桶中。
+    每个直方图只由一个线程写，计数用relaxed的读和写代替原子加，没有lock前缀；合并时其他线程只读
+*/
+class latency_histogram {
+public:
+    static const int SUB_BITS = 3;
+    static const int SUB_COUNT = 1 << SUB_BITS;
+    static const int MAX_EXP = 40;      // 2^40纳秒约18分钟
+    static const int BUCKET_COUNT = ( MAX_EXP - SUB_BITS + 2 ) * SUB_COUNT;
+
+    static int bucket_of( unsigned long ns ) {
+        if ( ns < ( unsigned long )SUB_COUNT ) {
+            return ns;
+        }
+        if ( ns >> ( MAX_EXP + 1 ) ) {
+            return BUCKET_COUNT - 1;
+        }
+        int exp = 63 - __builtin_clzl( ns );
+        return ( exp - SUB_BITS + 1 ) * SUB_COUNT + ( int )( ns >> ( exp - SUB_BITS ) ) - SUB_COUNT;
+    }
+    // 桶中最大的值（包含），用来估计分位数
+    static unsigned long bucket_max( int index ) {
+        if ( index < SUB_COUNT ) {
+            return index;
+        }
+        int shift = index / SUB_COUNT - 1;
+        unsigned long sub = index % SUB_COUNT + SUB_COUNT;
+        return ( ( sub + 1 ) << shift ) - 1;
+    }
+
+    void record( unsigned long ns ) {
+        std::atomic<unsigned long>& bucket = m_buckets[ bucket_of( ns ) ];
+        bucket.store( bucket.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+        m_sum.store( m_sum.load( std::memory_order_relaxed ) + ns, std::memory_order_relaxed );
+    }
+
+    unsigned long bucket( int index ) const { return m_buckets[ index ].load( std::memory_order_relaxed ); }
+    unsigned long sum() const { return m_sum.load( std::memory_order_relaxed ); }
+
+private:
+    std::atomic<unsigned long> m_buckets[ BUCKET_COUNT ];
+    std::atomic<unsigned long> m_sum;
+};
+
+/*
+    一个线程的全部直方图和计数器，线程第一次记录时分配，之后只由这个线程写，线程之间没有任何共享的写。
+    分片挂在metrics的链表上永不释放，线程退出后它的计数仍然保留在合并结果中
+*/
+struct alignas( 64 ) metrics_shard {
+    latency_histogram stages[ STAGE_COUNT ];
+    std::atomic<unsigned long> counters[ COUNTER_COUNT ];
+    std::atomic<unsigned long> responses[ 10 ];      // 按状态码计数，下标见metrics.cpp中的STATUS_CODES
+    metrics_shard* next;
+
+    void record( METRIC_STAGE stage, unsigned long ns ) { stages[ stage ].record( ns ); }
+    void count( METRIC_COUNTER counter, unsigned long n = 1 ) {
+        counters[ counter ].store( counters[ counter ].load( std::memory_order_relaxed ) + n, std::memory_order_relaxed );
+    }
+    void count_status( int status );
+};
+
+/*
+    进程内共享的指标注册表。各线程记录到自己的分片中，不加锁；
+    请求/metrics时把所有分片的直方图和计数器加起来，按Prometheus的文本格式输出，同时带上文件缓存和缓冲区池的统计信息
+*/
+class metrics
+{
+public:
+    static const char* const PATH;          // 保留的路径，请求它时返回指标而不是查找文件
+    static const char* const CONTENT_TYPE;
+
+public:
+    static metrics* get_instance();
+
+    // 单调时钟的纳秒数，走vDSO，不进入内核
+    static unsigned long now_ns() {
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+    }
+
+    // 当前线程的分片，第一次调用时创建
+    static metrics_shard* local() {
+        return m_local ? m_local : get_instance()->add_shard();
+    }
+
+    // 把合并后的指标写入buf，返回长度，size不够时返回-1
+    int render( char* buf, int size );
+
+    // 线程池的工作线程数和取第i个工作线程统计信息的函数，输出指标时按worker标签逐个输出；没有设置时不输出
+    void set_workers( int count, void ( *stats )( int, worker_stats* ) ) {
+        m_worker_count = count;
+        m_worker_stats = stats;
+    }
+
+private:
+    metrics() : m_shards( NULL ), m_worker_count( 0 ), m_worker_stats( NULL ) {}
+    metrics_shard* add_shard();
+
+private:
+    static thread_local metrics_shard* m_local;
+    locker m_lock;              // 保护分片链表，只在线程第一次记录和输出指标时使用
+    metrics_shard* m_shards;
+    int m_worker_count;
+    void ( *m_worker_stats )( int, worker_stats* );
+};
+
+#endif
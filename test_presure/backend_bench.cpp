@@ -0,0 +1,352 @@
+/*
+    比较epoll和io_uring两种I/O后端：用keep-alive连接反复请求同一个文件，输出每秒请求数和服务器每个请求的系统调用数。
+    客户端是单线程的epoll循环，每个连接发出一个请求、收完响应再发下一个（闭环）。
+    分两轮：第一轮不跟踪，测吞吐量；第二轮用ptrace附加到服务器的所有线程，统计这段时间内的系统调用，
+    除以完成的请求数（跟踪会让服务器慢很多，所以两轮分开）。
+
+    编译运行（在仓库根目录）：
+        g++ -O2 -pthread *.cpp -o server -lz
+        g++ -O2 test_presure/backend_bench.cpp -o backend_bench
+        ./server -e epoll 10000 &  ./backend_bench -p $! 10000;  kill %1
+        ./server -e uring 10000 &  ./backend_bench -p $! 10000;  kill %1
+    参数：-c 连接数（默认64） -n 第一轮的请求数（默认200000） -u 请求的URL（默认/index.html） -p 服务器的pid（不给时不统计系统调用）
+*/
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <sys/user.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#define MAX_CONNS 4096
+#define RESPONSE_BUF 65536
+
+struct client_conn {
+    int fd;
+    int got;            // 已经收到的字节数
+    int expect;         // 完整响应的字节数，响应头还没收完时为-1
+    char buf[ RESPONSE_BUF ];
+};
+
+static char request[ 512 ];
+static int request_len;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_to( int port ) {
+    int fd = socket( AF_INET, SOCK_STREAM, 0 );
+    struct sockaddr_in addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( port );
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    if( connect( fd, ( struct sockaddr* )&addr, sizeof( addr ) ) < 0 ) {
+        close( fd );
+        return -1;
+    }
+    int one = 1;
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+    fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
+    return fd;
+}
+
+// 响应头收完后算出整个响应的长度，只认Content-Length
+static int response_length( const char* buf, int len ) {
+    const char* end = ( const char* )memmem( buf, len, "\r\n\r\n", 4 );
+    if( !end ) {
+        return -1;
+    }
+    const char* cl = ( const char* )memmem( buf, end - buf, "Content-Length: ", 16 );
+    int body = cl ? atoi( cl + 16 ) : 0;
+    return ( end - buf ) + 4 + body;
+}
+
+// 用conns个连接完成total个请求，返回用时（秒），失败时返回负数
+static double run_requests( int port, int conns, long total ) {
+    std::vector< client_conn* > clients;
+    int epollfd = epoll_create1( 0 );
+    long sent = 0, done = 0;
+    double start = now_seconds();
+    for( int i = 0; i < conns && sent < total; ++i ) {
+        client_conn* c = new client_conn;
+        c->fd = connect_to( port );
+        if( c->fd < 0 ) {
+            fprintf( stderr, "connect failed: %s\n", strerror( errno ) );
+            return -1;
+        }
+        c->got = 0;
+        c->expect = -1;
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl( epollfd, EPOLL_CTL_ADD, c->fd, &ev );
+        clients.push_back( c );
+        if( ::write( c->fd, request, request_len ) != request_len ) {
+            return -1;
+        }
+        sent++;
+    }
+    struct epoll_event events[ MAX_CONNS ];
+    while( done < total ) {
+        int n = epoll_wait( epollfd, events, MAX_CONNS, 5000 );
+        if( n <= 0 ) {
+            fprintf( stderr, "server stopped responding (%ld/%ld done)\n", done, total );
+            return -1;
+        }
+        for( int i = 0; i < n; ++i ) {
+            client_conn* c = ( client_conn* )events[i].data.ptr;
+            int r = recv( c->fd, c->buf + c->got, RESPONSE_BUF - c->got, 0 );
+            if( r <= 0 ) {
+                if( r < 0 && errno == EAGAIN ) {
+                    continue;
+                }
+                fprintf( stderr, "connection closed by server\n" );
+                return -1;
+            }
+            c->got += r;
+            if( c->expect < 0 ) {
+                c->expect = response_length( c->buf, c->got );
+            }
+            // 正文比缓冲区大时只数字节，不保存
+            if( c->expect >= 0 && c->got >= RESPONSE_BUF ) {
+                c->expect -= c->got;
+                c->got = 0;
+            }
+            if( c->expect >= 0 && c->got >= c->expect ) {
+                done++;
+                c->got = 0;
+                c->expect = -1;
+                if( sent < total ) {
+                    if( ::write( c->fd, request, request_len ) != request_len ) {
+                        return -1;
+                    }
+                    sent++;
+                }
+            }
+        }
+    }
+    double elapsed = now_seconds() - start;
+    for( size_t i = 0; i < clients.size(); ++i ) {
+        close( clients[i]->fd );
+        delete clients[i];
+    }
+    close( epollfd );
+    return elapsed;
+}
+
+/*
+    系统调用计数：附加到pid的所有线程，每个线程在系统调用的入口和出口各停一次，只数入口（x86-64）。
+    计数线程和客户端在同一个进程里，所以放在fork出的子进程中，客户端跑完后通知它分离。
+*/
+static volatile sig_atomic_t stop_tracing = 0;
+
+static void on_stop( int ) {
+    stop_tracing = 1;
+}
+
+static std::vector< int > list_threads( int pid ) {
+    std::vector< int > tids;
+    char path[ 64 ];
+    snprintf( path, sizeof( path ), "/proc/%d/task", pid );
+    DIR* dir = opendir( path );
+    if( !dir ) {
+        return tids;
+    }
+    struct dirent* d;
+    while( ( d = readdir( dir ) ) != NULL ) {
+        if( d->d_name[0] != '.' ) {
+            tids.push_back( atoi( d->d_name ) );
+        }
+    }
+    closedir( dir );
+    return tids;
+}
+
+static const char* syscall_name( long nr ) {
+    switch( nr ) {
+        case SYS_read: return "read";
+        case SYS_write: return "write";
+        case SYS_close: return "close";
+        case SYS_recvfrom: return "recvfrom";
+        case SYS_sendto: return "sendto";
+        case SYS_sendmsg: return "sendmsg";
+        case SYS_sendfile: return "sendfile";
+        case SYS_accept: return "accept";
+        case SYS_accept4: return "accept4";
+        case SYS_epoll_wait: return "epoll_wait";
+        case SYS_epoll_ctl: return "epoll_ctl";
+        case SYS_fcntl: return "fcntl";
+        case SYS_setsockopt: return "setsockopt";
+        case SYS_shutdown: return "shutdown";
+        case SYS_futex: return "futex";
+        case SYS_io_uring_enter: return "io_uring_enter";
+        case SYS_newfstatat: return "newfstatat";
+        case SYS_openat: return "openat";
+        case SYS_mmap: return "mmap";
+        case SYS_munmap: return "munmap";
+        default: return NULL;
+    }
+}
+
+// 子进程：跟踪到收到SIGUSR1为止，然后把每种系统调用的次数写到out
+static void trace_server( int pid, int out ) {
+    // 不能用SA_RESTART，服务器空闲时waitpid一直阻塞，要靠信号打断它。
+    // 信号可能正好在检查stop_tracing和调用waitpid之间到达，所以父进程会重复发送，直到这个进程退出
+    struct sigaction sa;
+    memset( &sa, 0, sizeof( sa ) );
+    sa.sa_handler = on_stop;
+    sigaction( SIGUSR1, &sa, NULL );
+    std::vector< int > tids = list_threads( pid );
+    for( size_t i = 0; i < tids.size(); ++i ) {
+        if( ptrace( PTRACE_SEIZE, tids[i], 0, PTRACE_O_TRACESYSGOOD ) < 0
+            || ptrace( PTRACE_INTERRUPT, tids[i], 0, 0 ) < 0 ) {
+            fprintf( stderr, "ptrace %d failed: %s\n", tids[i], strerror( errno ) );
+            _exit( 1 );
+        }
+    }
+    std::map< long, long > counts;
+    while( !stop_tracing ) {
+        int status;
+        int tid = waitpid( -1, &status, __WALL );
+        if( tid < 0 ) {
+            if( errno == EINTR ) {
+                if( stop_tracing ) {
+                    break;
+                }
+                continue;
+            }
+            break;
+        }
+        if( WIFEXITED( status ) || WIFSIGNALED( status ) ) {
+            continue;
+        }
+        int sig = 0;
+        if( WIFSTOPPED( status ) && WSTOPSIG( status ) == ( SIGTRAP | 0x80 ) ) {
+            // 入口处rax还是-ENOSYS；附加时阻塞在系统调用中的线程第一次停下是在出口，不能靠交替计数
+            struct user_regs_struct regs;
+            ptrace( PTRACE_GETREGS, tid, 0, &regs );
+            if( ( long )regs.rax == -ENOSYS ) {
+                counts[ regs.orig_rax ]++;
+            }
+        } else if( WIFSTOPPED( status ) && ( status >> 16 ) == PTRACE_EVENT_STOP ) {
+            // PTRACE_INTERRUPT或group-stop，继续
+        } else if( WIFSTOPPED( status ) ) {
+            sig = WSTOPSIG( status );
+        }
+        ptrace( PTRACE_SYSCALL, tid, 0, sig );
+    }
+    // 还停在跟踪中的线程先打断再分离
+    for( size_t i = 0; i < tids.size(); ++i ) {
+        if( ptrace( PTRACE_INTERRUPT, tids[i], 0, 0 ) == 0 ) {
+            int status;
+            while( waitpid( tids[i], &status, __WALL ) < 0 && errno == EINTR ) {
+            }
+            ptrace( PTRACE_DETACH, tids[i], 0, 0 );
+        }
+    }
+    for( std::map< long, long >::iterator it = counts.begin(); it != counts.end(); ++it ) {
+        dprintf( out, "%ld %ld\n", it->first, it->second );
+    }
+    close( out );
+    _exit( 0 );
+}
+
+int main( int argc, char* argv[] ) {
+    int conns = 64;
+    long total = 200000;
+    const char* url = "/index.html";
+    int server_pid = 0;
+    int opt;
+    while( ( opt = getopt( argc, argv, "c:n:u:p:" ) ) != -1 ) {
+        switch( opt ) {
+            case 'c': conns = atoi( optarg ); break;
+            case 'n': total = atol( optarg ); break;
+            case 'u': url = optarg; break;
+            case 'p': server_pid = atoi( optarg ); break;
+            default:
+                fprintf( stderr, "usage: %s [-c conns] [-n requests] [-u url] [-p server_pid] port\n", argv[0] );
+                return 1;
+        }
+    }
+    if( optind >= argc || conns <= 0 || conns > MAX_CONNS ) {
+        fprintf( stderr, "usage: %s [-c conns] [-n requests] [-u url] [-p server_pid] port\n", argv[0] );
+        return 1;
+    }
+    int port = atoi( argv[ optind ] );
+    request_len = snprintf( request, sizeof( request ), "GET %s HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: keep-alive\r\n\r\n", url );
+
+    // 先预热文件缓存
+    if( run_requests( port, 1, 100 ) < 0 ) {
+        return 1;
+    }
+    double elapsed = run_requests( port, conns, total );
+    if( elapsed < 0 ) {
+        return 1;
+    }
+    printf( "%-18s %ld requests, %d connections, %.2f s\n", url, total, conns, elapsed );
+    printf( "%-18s %.0f\n", "requests/s", total / elapsed );
+
+    if( server_pid <= 0 ) {
+        return 0;
+    }
+    // 第二轮：跟踪服务器，请求数少一些
+    long traced = total / 10;
+    int pipefd[2];
+    if( pipe( pipefd ) < 0 ) {
+        return 1;
+    }
+    pid_t tracer = fork();
+    if( tracer == 0 ) {
+        close( pipefd[0] );
+        trace_server( server_pid, pipefd[1] );
+    }
+    close( pipefd[1] );
+    usleep( 200000 );   // 等待附加完成
+    if( run_requests( port, conns, traced ) < 0 ) {
+        kill( tracer, SIGKILL );
+        return 1;
+    }
+    do {
+        kill( tracer, SIGUSR1 );
+        usleep( 100000 );
+    } while( waitpid( tracer, NULL, WNOHANG ) != tracer );
+    std::vector< std::pair< long, long > > counts;
+    FILE* in = fdopen( pipefd[0], "r" );
+    long nr, count, sum = 0;
+    while( fscanf( in, "%ld %ld", &nr, &count ) == 2 ) {
+        counts.push_back( std::make_pair( count, nr ) );
+        sum += count;
+    }
+    fclose( in );
+    std::sort( counts.rbegin(), counts.rend() );
+    printf( "%-18s %.2f  (%ld syscalls / %ld requests)\n", "syscalls/request", ( double )sum / traced, sum, traced );
+    for( size_t i = 0; i < counts.size() && i < 8; ++i ) {
+        const char* name = syscall_name( counts[i].second );
+        char buf[ 32 ];
+        if( !name ) {
+            snprintf( buf, sizeof( buf ), "syscall %ld", counts[i].second );
+            name = buf;
+        }
+        printf( "  %-16s %.2f\n", name, ( double )counts[i].first / traced );
+    }
+    return 0;
+}
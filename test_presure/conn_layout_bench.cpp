@@ -0,0 +1,241 @@
+/*
+    连接表内存布局的基准：在一张连接表中建立大量连接，多个线程各自扮演一个反应堆和一个工作线程，
+    按槽位交错分配连接（槽位i属于线程i % 线程数，相邻的连接属于不同的线程），每个线程轮流在自己的每个连接上处理一个keep-alive请求：
+        append_input    收到请求（io_uring后端的收包路径，不经过socket）
+        update_timer    反应堆根据阶段重设超时定时器
+        make_task       反应堆交给线程池，随后由同一个线程run_task：解析、查找文件缓存、生成响应
+        gather_segments / advance / finish_batch    发送这一批响应（只收集数据段，不写socket），连接回到空闲
+    连接多到连接表和定时器放不进缓存时，每个请求的缓存缺失主要来自http_conn本身和时间轮中相邻的定时器，比较不同布局时其余部分相同。
+    输出 ns/request，以及每个请求的L1D读缺失、末级缓存缺失和dTLB读缺失（perf的用户态计数，内核不允许或没有PMU时显示-）。
+    连接没有真正的socket，都用同一个socketpair的一端初始化；epollfd为-1，重新注册事件的epoll_ctl直接失败，它的开销计入耗时但不计入缓存缺失。
+    文件从仓库的resources目录读取，所以要在仓库根目录运行。
+
+    编译运行（在仓库根目录）：
+        g++ -O2 -pthread -I. test_presure/conn_layout_bench.cpp $(ls *.cpp | grep -v main.cpp) -o conn_layout_bench -lz && ./conn_layout_bench
+    参数：-c 连接数（默认65536） -t 线程数（默认2） -n 每个连接处理的请求数（默认20） -H 连接表使用大页
+*/
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include "http_conn.h"
+#include "conn_table.h"
+
+extern const char* doc_root;
+
+static const char* REQUEST =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: 192.168.110.129:10000\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+    "\r\n";
+
+enum COUNTER { C_L1D = 0, C_LLC, C_DTLB, C_COUNT };
+static const char* COUNTER_NAMES[ C_COUNT ] = { "L1D-miss/req", "LLC-miss/req", "dTLB-miss/req" };
+
+static int open_counter( unsigned int type, unsigned long config ) {
+    struct perf_event_attr attr;
+    memset( &attr, 0, sizeof( attr ) );
+    attr.size = sizeof( attr );
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall( SYS_perf_event_open, &attr, 0, -1, -1, 0 );
+}
+
+static unsigned long cache_read_miss( unsigned long cache ) {
+    return cache | ( PERF_COUNT_HW_CACHE_OP_READ << 8 ) | ( PERF_COUNT_HW_CACHE_RESULT_MISS << 16 );
+}
+
+static long read_counter( int fd ) {
+    long long value = 0;
+    if( fd < 0 || read( fd, &value, sizeof( value ) ) != sizeof( value ) ) {
+        return -1;
+    }
+    return value;
+}
+
+struct bench_thread {
+    pthread_t thread;
+    int index;
+    std::vector< http_conn* > conns;    // 这个线程拥有的连接，按槽位从小到大
+    timer_wheel* wheel;
+    long rounds;
+    long requests;
+    long failures;
+    long counts[ C_COUNT ];
+};
+
+static pthread_barrier_t start_barrier;
+static int request_len;
+
+// 一个连接上的一个请求，返回false表示没有按预期处理完
+static bool serve_one( http_conn* conn ) {
+    if( !conn->append_input( REQUEST, request_len ) ) {
+        return false;
+    }
+    conn->update_timer();
+    conn_task task = conn->make_task();
+    task.process();
+    struct iovec iv[ http_conn::MAX_SEGMENTS ];
+    while( conn->pending_bytes() > 0 ) {
+        bool more = false;
+        int count = conn->gather_segments( iv, &more );
+        if( count == 0 ) {
+            return false;
+        }
+        long sent = 0;
+        for( int i = 0; i < count; ++i ) {
+            sent += iv[i].iov_len;
+        }
+        conn->advance( sent );
+    }
+    bool ok = conn->finish_batch();
+    conn->update_timer();
+    return ok;
+}
+
+static void* run_thread( void* arg ) {
+    bench_thread* t = ( bench_thread* )arg;
+    int fds[ C_COUNT ];
+    fds[ C_L1D ] = open_counter( PERF_TYPE_HW_CACHE, cache_read_miss( PERF_COUNT_HW_CACHE_L1D ) );
+    fds[ C_LLC ] = open_counter( PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES );
+    fds[ C_DTLB ] = open_counter( PERF_TYPE_HW_CACHE, cache_read_miss( PERF_COUNT_HW_CACHE_DTLB ) );
+
+    // 预热：每个连接先处理一个请求，文件缓存和缓冲区池准备好，连接表的页都已经分配
+    for( size_t i = 0; i < t->conns.size(); ++i ) {
+        serve_one( t->conns[i] );
+    }
+    pthread_barrier_wait( &start_barrier );
+    for( int c = 0; c < C_COUNT; ++c ) {
+        ioctl( fds[c], PERF_EVENT_IOC_ENABLE, 0 );
+    }
+    for( long r = 0; r < t->rounds; ++r ) {
+        for( size_t i = 0; i < t->conns.size(); ++i ) {
+            if( serve_one( t->conns[i] ) ) {
+                t->requests++;
+            } else {
+                t->failures++;
+            }
+        }
+    }
+    for( int c = 0; c < C_COUNT; ++c ) {
+        ioctl( fds[c], PERF_EVENT_IOC_DISABLE, 0 );
+        t->counts[c] = read_counter( fds[c] );
+        if( fds[c] >= 0 ) {
+            close( fds[c] );
+        }
+    }
+    pthread_barrier_wait( &start_barrier );
+    return NULL;
+}
+
+int main( int argc, char* argv[] ) {
+    int conn_number = 65536;
+    int thread_number = 2;
+    long rounds = 20;
+    bool huge_pages = false;
+    int opt;
+    while( ( opt = getopt( argc, argv, "c:t:n:H" ) ) != -1 ) {
+        switch( opt ) {
+            case 'c': conn_number = atoi( optarg ); break;
+            case 't': thread_number = atoi( optarg ); break;
+            case 'n': rounds = atol( optarg ); break;
+            case 'H': huge_pages = true; break;
+            default:
+                fprintf( stderr, "usage: %s [-c connections] [-t threads] [-n rounds] [-H]\n", argv[0] );
+                return 1;
+        }
+    }
+    if( conn_number <= 0 || thread_number <= 0 || rounds <= 0 ) {
+        return 1;
+    }
+
+    doc_root = "resources";
+    request_len = strlen( REQUEST );
+    // 结果写到原来的标准输出，服务器代码中的printf写到/dev/null
+    FILE* out = fdopen( dup( STDOUT_FILENO ), "w" );
+    if( !out || !freopen( "/dev/null", "w", stdout ) ) {
+        return 1;
+    }
+
+    int fds[2];
+    if( socketpair( AF_UNIX, SOCK_STREAM, 0, fds ) < 0 ) {
+        return 1;
+    }
+    conn_table table( conn_number, huge_pages );
+    std::vector< bench_thread > threads( thread_number );
+    for( int i = 0; i < thread_number; ++i ) {
+        threads[i].index = i;
+        threads[i].wheel = new timer_wheel( 100 );
+        threads[i].rounds = rounds;
+        threads[i].requests = 0;
+        threads[i].failures = 0;
+    }
+    sockaddr_in addr;
+    memset( &addr, 0, sizeof( addr ) );
+    for( int i = 0; i < conn_number; ++i ) {
+        http_conn* conn = table.acquire();
+        if( !conn ) {
+            fprintf( out, "connection table is full after %d connections\n", i );
+            return 1;
+        }
+        bench_thread& t = threads[ i % thread_number ];
+        conn->init( fds[0], addr, -1, t.wheel );
+        t.conns.push_back( conn );
+    }
+
+    pthread_barrier_init( &start_barrier, NULL, thread_number + 1 );
+    for( int i = 0; i < thread_number; ++i ) {
+        pthread_create( &threads[i].thread, NULL, run_thread, &threads[i] );
+    }
+    pthread_barrier_wait( &start_barrier );
+    unsigned long begin = metrics::now_ns();
+    pthread_barrier_wait( &start_barrier );
+    unsigned long elapsed = metrics::now_ns() - begin;
+
+    long requests = 0;
+    long failures = 0;
+    long counts[ C_COUNT ] = { 0 };
+    for( int i = 0; i < thread_number; ++i ) {
+        pthread_join( threads[i].thread, NULL );
+        requests += threads[i].requests;
+        failures += threads[i].failures;
+        for( int c = 0; c < C_COUNT; ++c ) {
+            counts[c] = ( counts[c] < 0 || threads[i].counts[c] < 0 ) ? -1 : counts[c] + threads[i].counts[c];
+        }
+    }
+
+    fprintf( out, "sizeof(http_conn) %zu, alignof %zu, %d connections, %d threads, %s\n",
+             sizeof( http_conn ), alignof( http_conn ), conn_number, thread_number,
+             huge_pages ? "huge pages" : "normal pages" );
+    if( failures > 0 ) {
+        fprintf( out, "%ld requests were not handled completely\n", failures );
+    }
+    fprintf( out, "%12s", "ns/req" );
+    for( int c = 0; c < C_COUNT; ++c ) {
+        fprintf( out, " %14s", COUNTER_NAMES[c] );
+    }
+    fprintf( out, "\n%12.1f", requests ? ( double )elapsed / requests : 0.0 );
+    for( int c = 0; c < C_COUNT; ++c ) {
+        if( counts[c] < 0 || requests == 0 ) {
+            fprintf( out, " %14s", "-" );
+        } else {
+            fprintf( out, " %14.2f", ( double )counts[c] / requests );
+        }
+    }
+    fprintf( out, "\n" );
+    fclose( out );
+    return 0;
+}
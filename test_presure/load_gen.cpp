@@ -0,0 +1,410 @@
+/*
+    开环负载生成器：按固定的速率发出请求，不管服务器是否跟得上，输出吞吐量和延迟分位数（JSON）。
+    webbench每个客户端一个进程、HTTP/1.0、每个请求一个新连接，只能报告每分钟的页面数；
+    这里每个线程一个epoll，管理上千个keep-alive连接。
+
+    开环和协调遗漏（coordinated omission）：每个线程按 速率/线程数 排出请求的计划发送时刻，依次轮流分给它的各个连接。
+    一个连接同时只有一个请求在路上，轮到它时上一个响应还没回来，这个请求就等到响应回来后立即发出；
+    延迟从计划发送时刻算起，而不是实际发出的时刻，服务器变慢时排队等待的时间也算在延迟里，不会因为客户端跟着变慢而被漏掉。
+
+    编译运行（在仓库根目录）：
+        g++ -O2 -pthread *.cpp -o server -lz
+        g++ -O2 -pthread -I. test_presure/load_gen.cpp -o load_gen
+        ./server 10000 &  ./load_gen -t 4 -c 4000 -r 50000 -d 10 10000;  kill %1
+    参数：-t 线程数（默认2） -c 连接总数（默认1000） -r 每秒请求数（默认10000） -d 测量的秒数（默认10）
+          -w 预热的秒数，这段时间内的请求不计入结果（默认1） -u 请求的URL（默认/index.html） -a 服务器地址（默认127.0.0.1）
+    延迟用metrics.h中的直方图统计，分位数的相对误差不超过1/8。
+*/
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include "metrics.h"
+
+#define MAX_EVENTS 1024
+#define HEADER_BUF 8192     // 只保存响应头，正文只数字节
+#define DRAIN_NS 2000000000UL   // 发送结束后等待还在路上的响应的最长时间
+
+struct client_conn {
+    int fd;
+    bool busy;                  // 有一个请求在路上
+    unsigned long next_seq;     // 这个连接下一个要发送的请求在线程计划中的序号
+    unsigned long intended;     // 在路上的请求的计划发送时刻
+    long got;                   // 这个响应已经收到的字节数
+    long expect;                // 完整响应的字节数，响应头还没收完时为-1
+    int status;
+    char buf[ HEADER_BUF ];
+};
+
+struct load_thread {
+    pthread_t thread;
+    int index;
+    int conns;
+    double rate;                // 这个线程的每秒请求数
+    unsigned long last;         // 计划中最后一个请求的序号
+    latency_histogram* latency;
+    unsigned long max_latency;
+    unsigned long completed;    // 测量期间完成的请求
+    unsigned long errors;       // 连接失败、被服务器关闭、响应不完整
+    unsigned long non_2xx;      // 状态码不是2xx或3xx的响应
+    unsigned long bytes;        // 测量期间内收到的响应字节数
+    unsigned long late;         // 轮到时连接还忙、推迟发出的请求数
+    unsigned long unsent;       // 等待还在路上的响应超时，计划中没有发出的请求数
+    unsigned long in_window;    // 在测量期间内完成的响应数，用来计算吞吐量
+};
+
+static struct sockaddr_in server_addr;
+static char request[ 512 ];
+static int request_len;
+static pthread_barrier_t connected;     // 所有连接都建立好之后才开始计时
+static pthread_barrier_t started;
+static unsigned long start_ns;  // 所有线程共用的计划起点
+static unsigned long measure_ns;    // 从这个时刻起计划发送的请求计入结果
+static unsigned long end_ns;        // 计划发送的最后时刻
+
+static unsigned long now_ns() {
+    return metrics::now_ns();
+}
+
+static int connect_server() {
+    int fd = socket( AF_INET, SOCK_STREAM, 0 );
+    if( fd < 0 ) {
+        return -1;
+    }
+    if( connect( fd, ( struct sockaddr* )&server_addr, sizeof( server_addr ) ) < 0 ) {
+        close( fd );
+        return -1;
+    }
+    int one = 1;
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+    fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
+    return fd;
+}
+
+// 响应头收完后算出整个响应的长度和状态码，只认Content-Length
+static long response_length( const char* buf, int len, int* status ) {
+    const char* end = ( const char* )memmem( buf, len, "\r\n\r\n", 4 );
+    if( !end ) {
+        return -1;
+    }
+    *status = ( len > 12 ) ? atoi( buf + 9 ) : 0;
+    const char* cl = ( const char* )memmem( buf, end - buf, "Content-Length: ", 16 );
+    long body = cl ? atol( cl + 16 ) : 0;
+    return ( end - buf ) + 4 + body;
+}
+
+// 第seq个请求的计划发送时刻
+static unsigned long intended_time( const load_thread* t, unsigned long seq ) {
+    return start_ns + ( unsigned long )( seq * 1e9 / t->rate );
+}
+
+static bool send_request( client_conn* c, unsigned long intended ) {
+    c->busy = true;
+    c->intended = intended;
+    c->got = 0;
+    c->expect = -1;
+    return ::write( c->fd, request, request_len ) == request_len;
+}
+
+// 连接出错或被关闭：丢掉在路上的请求，重新连接，继续按原来的计划发送
+static void reconnect( load_thread* t, int epollfd, client_conn* c ) {
+    if( c->busy && c->intended >= measure_ns ) {
+        t->errors++;
+    }
+    epoll_ctl( epollfd, EPOLL_CTL_DEL, c->fd, NULL );
+    close( c->fd );
+    c->busy = false;
+    c->fd = connect_server();
+    if( c->fd < 0 ) {
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl( epollfd, EPOLL_CTL_ADD, c->fd, &ev );
+}
+
+// 连接空闲且它的下一个请求已经到了计划时刻，就发出去
+static void send_due( load_thread* t, int epollfd, client_conn* c, unsigned long now ) {
+    if( c->busy || c->fd < 0 || c->next_seq > t->last ) {
+        return;
+    }
+    unsigned long intended = intended_time( t, c->next_seq );
+    if( intended > now ) {
+        return;
+    }
+    c->next_seq += t->conns;
+    if( !send_request( c, intended ) ) {
+        reconnect( t, epollfd, c );
+    }
+}
+
+static void on_readable( load_thread* t, int epollfd, client_conn* c ) {
+    while( true ) {
+        char* dst = c->buf;
+        long room = HEADER_BUF;
+        if( c->expect < 0 ) {
+            dst += c->got;
+            room -= c->got;
+        }
+        int r = recv( c->fd, dst, room, 0 );
+        if( r < 0 && errno == EAGAIN ) {
+            return;
+        }
+        if( r <= 0 || !c->busy ) {
+            reconnect( t, epollfd, c );
+            return;
+        }
+        c->got += r;
+        if( c->expect < 0 ) {
+            c->expect = response_length( c->buf, c->got, &c->status );
+            if( c->expect < 0 && c->got >= HEADER_BUF ) {
+                reconnect( t, epollfd, c );
+                return;
+            }
+        }
+        if( c->expect >= 0 && c->got >= c->expect ) {
+            unsigned long now = now_ns();
+            if( c->intended >= measure_ns ) {
+                unsigned long latency = now - c->intended;
+                t->latency->record( latency );
+                if( latency > t->max_latency ) {
+                    t->max_latency = latency;
+                }
+                t->completed++;
+                if( now <= end_ns ) {
+                    t->in_window++;
+                    t->bytes += c->expect;
+                }
+                if( c->status < 200 || c->status >= 400 ) {
+                    t->non_2xx++;
+                }
+            }
+            c->busy = false;
+            // 这个连接的下一个请求已经过了计划时刻，立即发出，排队的时间算在它的延迟里
+            unsigned long next = intended_time( t, c->next_seq );
+            if( c->next_seq <= t->last && next <= now && next >= measure_ns ) {
+                t->late++;
+            }
+            send_due( t, epollfd, c, now );
+            return;
+        }
+    }
+}
+
+static void* load_loop( void* arg ) {
+    load_thread* t = ( load_thread* )arg;
+    int epollfd = epoll_create1( 0 );
+    client_conn* conns = new client_conn[ t->conns ];
+    for( int i = 0; i < t->conns; ++i ) {
+        client_conn* c = &conns[i];
+        c->busy = false;
+        c->next_seq = i;
+        c->fd = connect_server();
+        if( c->fd < 0 ) {
+            fprintf( stderr, "connect failed: %s\n", strerror( errno ) );
+            exit( 1 );
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl( epollfd, EPOLL_CTL_ADD, c->fd, &ev );
+    }
+    pthread_barrier_wait( &connected );
+    pthread_barrier_wait( &started );
+
+    // 请求按序号轮流分给各个连接，due是下一个到期的序号
+    unsigned long due = 0;
+    unsigned long last = t->last;
+    struct epoll_event events[ MAX_EVENTS ];
+    while( true ) {
+        unsigned long now = now_ns();
+        while( due <= last && intended_time( t, due ) <= now ) {
+            send_due( t, epollfd, &conns[ due % t->conns ], now );
+            due++;
+        }
+        int busy = 0;
+        for( int i = 0; i < t->conns && due > last; ++i ) {
+            busy += conns[i].busy;
+        }
+        if( due > last && ( busy == 0 || now > end_ns + DRAIN_NS ) ) {
+            break;
+        }
+        // 等到下一个请求的计划时刻（毫秒精度），或者有响应到达
+        int timeout = 100;
+        if( due <= last ) {
+            unsigned long next = intended_time( t, due );
+            timeout = next > now ? ( next - now ) / 1000000 : 0;
+        }
+        int n = epoll_wait( epollfd, events, MAX_EVENTS, timeout );
+        for( int i = 0; i < n; ++i ) {
+            on_readable( t, epollfd, ( client_conn* )events[i].data.ptr );
+        }
+    }
+    for( int i = 0; i < t->conns; ++i ) {
+        if( conns[i].busy && conns[i].intended >= measure_ns ) {
+            t->errors++;
+        }
+        if( conns[i].next_seq <= last ) {
+            t->unsent += ( last - conns[i].next_seq ) / t->conns + 1;
+        }
+        if( conns[i].fd >= 0 ) {
+            close( conns[i].fd );
+        }
+    }
+    delete [] conns;
+    close( epollfd );
+    return NULL;
+}
+
+// 合并后的直方图中第q分位的延迟（微秒），取桶的上界，不超过实际的最大值
+static double percentile_us( const unsigned long* buckets, unsigned long total, unsigned long max, double q ) {
+    if( total == 0 ) {
+        return 0;
+    }
+    unsigned long rank = ( unsigned long )( q * total + 0.5 );
+    unsigned long seen = 0;
+    int b = 0;
+    while( b < latency_histogram::BUCKET_COUNT - 1 && ( seen += buckets[b] ) < rank ) {
+        b++;
+    }
+    unsigned long value = latency_histogram::bucket_max( b );
+    return ( value < max ? value : max ) / 1e3;
+}
+
+static void usage( const char* prog ) {
+    fprintf( stderr, "usage: %s [-t threads] [-c conns] [-r rate] [-d seconds] [-w warmup] [-u url] [-a addr] port\n", prog );
+}
+
+int main( int argc, char* argv[] ) {
+    int threads = 2;
+    int conns = 1000;
+    double rate = 10000;
+    double duration = 10;
+    double warmup = 1;
+    const char* url = "/index.html";
+    const char* addr = "127.0.0.1";
+    int opt;
+    while( ( opt = getopt( argc, argv, "t:c:r:d:w:u:a:" ) ) != -1 ) {
+        switch( opt ) {
+            case 't': threads = atoi( optarg ); break;
+            case 'c': conns = atoi( optarg ); break;
+            case 'r': rate = atof( optarg ); break;
+            case 'd': duration = atof( optarg ); break;
+            case 'w': warmup = atof( optarg ); break;
+            case 'u': url = optarg; break;
+            case 'a': addr = optarg; break;
+            default:
+                usage( argv[0] );
+                return 1;
+        }
+    }
+    if( optind >= argc || threads <= 0 || conns < threads || rate <= 0 || duration <= 0 || warmup < 0 ) {
+        usage( argv[0] );
+        return 1;
+    }
+    memset( &server_addr, 0, sizeof( server_addr ) );
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons( atoi( argv[ optind ] ) );
+    if( inet_pton( AF_INET, addr, &server_addr.sin_addr ) != 1 ) {
+        fprintf( stderr, "bad address %s\n", addr );
+        return 1;
+    }
+    request_len = snprintf( request, sizeof( request ), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n", url, addr );
+    signal( SIGPIPE, SIG_IGN );
+
+    // 上千个连接需要提高打开文件数的限制
+    struct rlimit rl;
+    if( getrlimit( RLIMIT_NOFILE, &rl ) == 0 && rl.rlim_cur < rl.rlim_max ) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit( RLIMIT_NOFILE, &rl );
+    }
+
+    pthread_barrier_init( &connected, NULL, threads + 1 );
+    pthread_barrier_init( &started, NULL, threads + 1 );
+    load_thread* workers = new load_thread[ threads ];
+    for( int i = 0; i < threads; ++i ) {
+        load_thread* t = &workers[i];
+        memset( t, 0, sizeof( *t ) );
+        t->index = i;
+        t->conns = conns / threads + ( i < conns % threads ? 1 : 0 );
+        t->rate = rate / threads;
+        t->last = ( unsigned long )( ( warmup + duration ) * t->rate );
+        t->latency = new latency_histogram();
+        if( pthread_create( &t->thread, NULL, load_loop, t ) != 0 ) {
+            fprintf( stderr, "create thread failed\n" );
+            return 1;
+        }
+    }
+    // 连接在各线程中建立，全部建立好之后再定下计划的起点
+    pthread_barrier_wait( &connected );
+    start_ns = now_ns();
+    measure_ns = start_ns + ( unsigned long )( warmup * 1e9 );
+    end_ns = measure_ns + ( unsigned long )( duration * 1e9 );
+    pthread_barrier_wait( &started );
+
+    static unsigned long buckets[ latency_histogram::BUCKET_COUNT ];
+    unsigned long total = 0, errors = 0, non_2xx = 0, bytes = 0, late = 0, max_latency = 0, sum = 0, in_window = 0, unsent = 0;
+    for( int i = 0; i < threads; ++i ) {
+        load_thread* t = &workers[i];
+        pthread_join( t->thread, NULL );
+        for( int b = 0; b < latency_histogram::BUCKET_COUNT; ++b ) {
+            buckets[b] += t->latency->bucket( b );
+        }
+        sum += t->latency->sum();
+        total += t->completed;
+        errors += t->errors;
+        non_2xx += t->non_2xx;
+        bytes += t->bytes;
+        late += t->late;
+        unsent += t->unsent;
+        in_window += t->in_window;
+        if( t->max_latency > max_latency ) {
+            max_latency = t->max_latency;
+        }
+        delete t->latency;
+    }
+    delete [] workers;
+    // 吞吐量只数测量期间内完成的响应：服务器跟不上时，计划内的请求要到发送结束之后才能全部完成，不能按计划的数量算
+
+    printf( "{\n"
+            "  \"url\": \"%s\",\n"
+            "  \"threads\": %d,\n"
+            "  \"connections\": %d,\n"
+            "  \"target_rps\": %.0f,\n"
+            "  \"duration_s\": %.3f,\n"
+            "  \"requests\": %lu,\n"
+            "  \"errors\": %lu,\n"
+            "  \"non_2xx_3xx\": %lu,\n"
+            "  \"late_sends\": %lu,\n"
+            "  \"unsent\": %lu,\n"
+            "  \"throughput_rps\": %.1f,\n"
+            "  \"throughput_mbps\": %.2f,\n"
+            "  \"latency_us\": {\n"
+            "    \"mean\": %.1f,\n"
+            "    \"p50\": %.1f,\n"
+            "    \"p90\": %.1f,\n"
+            "    \"p99\": %.1f,\n"
+            "    \"p999\": %.1f,\n"
+            "    \"max\": %.1f\n"
+            "  }\n"
+            "}\n",
+            url, threads, conns, rate, duration, total, errors, non_2xx, late, unsent,
+            in_window / duration, bytes * 8 / duration / 1e6,
+            total ? sum / 1e3 / total : 0.0,
+            percentile_us( buckets, total, max_latency, 0.5 ), percentile_us( buckets, total, max_latency, 0.9 ),
+            percentile_us( buckets, total, max_latency, 0.99 ), percentile_us( buckets, total, max_latency, 0.999 ),
+            max_latency / 1e3 );
+    return 0;
+}
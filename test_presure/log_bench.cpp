@@ -0,0 +1,135 @@
+/*
+    日志的微基准：多个线程同时在循环中记录日志，测量每次调用的耗时，和原来在请求处理中直接printf比较：
+        printf      printf请求行到标准输出（重定向到/dev/null），各线程在stdio的锁上串行
+        log-str     LOG_INFO记录请求行（复制字符串）
+        log-int     LOG_INFO记录两个整数
+        log-debug   LOG_DEBUG，默认的LOG_LEVEL下在编译时被去掉
+    日志写到/dev/null。每个线程连续调用BURST次（放得进一个线程的环形缓冲区）后停几个tick，让后台线程取空缓冲区，
+    只统计连续调用的耗时，测的是不丢弃时的开销；输出中同时给出被丢弃的比例，正常应为0。
+
+    编译运行（在仓库根目录）：
+        g++ -O2 -pthread -I. test_presure/log_bench.cpp logger.cpp -o log_bench && ./log_bench
+    参数：-t 线程数（默认4） -n 每个线程每种情况的调用次数（默认20000）
+*/
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "logger.h"
+
+enum BENCH_CASE { B_PRINTF = 0, B_LOG_STR, B_LOG_INT, B_LOG_DEBUG, B_CASES };
+static const char* CASE_NAMES[ B_CASES ] = { "printf", "log-str", "log-int", "log-debug" };
+
+static const char* LINE = "GET /images/image1.jpg HTTP/1.1";
+
+static const int BURST = 512;
+
+static long calls = 20000;
+static int current_case;
+static pthread_barrier_t barrier;
+
+static unsigned long now_ns() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void* run_thread( void* arg ) {
+    unsigned long* ns = ( unsigned long* )arg;    // 每种情况连续调用的总耗时
+    for( int c = 0; c < B_CASES; ++c ) {
+        pthread_barrier_wait( &barrier );
+        for( long i = 0; i < calls; ++i ) {
+            if( i % BURST == 0 && i > 0 ) {
+                ns[c] += now_ns();
+                struct timespec pause = { 0, 5 * logger::CLOCK_TICK_MS * 1000000L };
+                nanosleep( &pause, NULL );
+            }
+            if( i % BURST == 0 ) {
+                ns[c] -= now_ns();
+            }
+            switch( current_case ) {
+                case B_PRINTF:
+                    printf( "got 1 http line: %s\n", LINE );
+                    break;
+                case B_LOG_STR:
+                    LOG_INFO( "got 1 http line: %s", LINE );
+                    break;
+                case B_LOG_INT:
+                    LOG_INFO( "fd %d sent %ld bytes", ( int )i, i * 3 );
+                    break;
+                case B_LOG_DEBUG:
+                    LOG_DEBUG( "got 1 http line: %s", LINE );
+                    break;
+            }
+        }
+        ns[c] += now_ns();
+        pthread_barrier_wait( &barrier );
+    }
+    return NULL;
+}
+
+int main( int argc, char* argv[] ) {
+    int thread_number = 4;
+    int opt;
+    while( ( opt = getopt( argc, argv, "t:n:" ) ) != -1 ) {
+        switch( opt ) {
+            case 't': thread_number = atoi( optarg ); break;
+            case 'n': calls = atol( optarg ); break;
+            default:
+                fprintf( stderr, "usage: %s [-t threads] [-n calls]\n", argv[0] );
+                return 1;
+        }
+    }
+    if( thread_number <= 0 || calls <= 0 ) {
+        return 1;
+    }
+    // 结果写到原来的标准输出，printf写到/dev/null
+    FILE* out = fdopen( dup( STDOUT_FILENO ), "w" );
+    if( !out || !freopen( "/dev/null", "w", stdout ) ) {
+        return 1;
+    }
+    logger* log = logger::get_instance();
+    if( !log->start( "/dev/null" ) ) {
+        return 1;
+    }
+
+    pthread_barrier_init( &barrier, NULL, thread_number + 1 );
+    pthread_t* threads = new pthread_t[ thread_number ];
+    unsigned long ( *ns )[ B_CASES ] = new unsigned long[ thread_number ][ B_CASES ]();
+    for( int i = 0; i < thread_number; ++i ) {
+        pthread_create( &threads[i], NULL, run_thread, ns[i] );
+    }
+    fprintf( out, "%d threads, %ld calls per thread\n", thread_number, calls );
+    fprintf( out, "%-10s %10s %10s\n", "case", "ns/call", "dropped" );
+    for( int c = 0; c < B_CASES; ++c ) {
+        current_case = c;
+        unsigned long dropped = log->dropped();
+        pthread_barrier_wait( &barrier );
+        pthread_barrier_wait( &barrier );
+        fflush( stdout );
+        // 各线程连续调用的耗时之和除以调用总数；CPU比线程少时包含了等待CPU的时间
+        double total = ( double )calls * thread_number;
+        unsigned long elapsed = 0;
+        for( int i = 0; i < thread_number; ++i ) {
+            elapsed += ns[i][c];
+        }
+        fprintf( out, "%-10s %10.1f", CASE_NAMES[c], elapsed / total );
+        if( c == B_LOG_STR || c == B_LOG_INT ) {
+            fprintf( out, " %9.1f%%\n", 100.0 * ( log->dropped() - dropped ) / total );
+        } else {
+            fprintf( out, " %10s\n", "-" );
+        }
+        // 等后台线程把缓冲区取空，下一种情况从空的缓冲区开始
+        usleep( 2 * logger::FLUSH_INTERVAL_MS * 1000 );
+    }
+    for( int i = 0; i < thread_number; ++i ) {
+        pthread_join( threads[i], NULL );
+    }
+    log->stop();
+    delete [] threads;
+    delete [] ns;
+    fclose( out );
+    return 0;
+}
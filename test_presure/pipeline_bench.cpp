@@ -0,0 +1,465 @@
+/*
+    请求处理流水线的微基准：不经过网络，把录下来的请求通过socketpair喂给http_conn，分阶段测量：
+        recv        read()，从socket读入读缓冲区
+        parse       process_read()，解析请求行和头部字段
+        lookup      do_request()，查找文件缓存
+        serialize   process_write()，生成响应的数据段
+        send        write()，发送这一批响应
+    每个阶段输出 ns/request、instructions/request（perf的用户态指令计数，内核不允许时显示-）和 allocations/request（malloc/calloc/realloc的次数）。
+    计时和计数分两轮，计数用的ioctl不会算进耗时；两种测量自身的开销都先校准再减掉。
+    请求语料内置了curl、Chrome、Firefox、Googlebot、大Cookie、条件请求和非法的Content-Length几种，也可以在命令行上给出文件，每个文件是一个原样录下的请求。
+    文件从仓库的resources目录读取，所以要在仓库根目录运行。process_read中记录请求行的是DEBUG级别的日志，默认在编译时去掉；用-DLOG_LEVEL=0编译时它的开销计入parse（日志系统没有启动，记录直接返回）。
+
+    编译运行（在仓库根目录）：
+        g++ -O2 -pthread -I. test_presure/pipeline_bench.cpp $(ls *.cpp | grep -v main.cpp) -o pipeline_bench -lz && ./pipeline_bench
+    参数：-n 每种请求的次数（默认200000） [请求文件...]
+*/
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <string>
+#include <vector>
+#include "http_conn.h"
+
+extern const char* doc_root;
+
+// 统计分配次数：替换malloc/calloc/realloc，转给glibc的实现（operator new也会走到这里）
+static unsigned long alloc_count = 0;
+extern "C" void* __libc_malloc( size_t size );
+extern "C" void* __libc_calloc( size_t n, size_t size );
+extern "C" void* __libc_realloc( void* ptr, size_t size );
+extern "C" void* malloc( size_t size ) {
+    alloc_count++;
+    return __libc_malloc( size );
+}
+extern "C" void* calloc( size_t n, size_t size ) {
+    alloc_count++;
+    return __libc_calloc( n, size );
+}
+extern "C" void* realloc( void* ptr, size_t size ) {
+    alloc_count++;
+    return __libc_realloc( ptr, size );
+}
+
+enum BENCH_STAGE { B_RECV = 0, B_PARSE, B_LOOKUP, B_SERIALIZE, B_SEND, B_STAGES };
+static const char* STAGE_NAMES[ B_STAGES ] = { "recv", "parse", "lookup", "serialize", "send" };
+
+// 按process()的顺序逐个调用http_conn的各个阶段（http_conn把这个结构声明为友元）
+struct pipeline_bench {
+    static bool recv( http_conn& c ) {
+        return c.read();
+    }
+    static http_conn::HTTP_CODE parse( http_conn& c ) {
+        return c.process_read();
+    }
+    static http_conn::HTTP_CODE lookup( http_conn& c ) {
+        return c.do_request();
+    }
+    static bool serialize( http_conn& c, http_conn::HTTP_CODE ret ) {
+        if( ret == http_conn::BAD_REQUEST ) {
+            c.m_linger = false;
+        }
+        bool ok = c.process_write( ret );
+        c.m_close_after = !c.m_linger;
+        c.next_request();
+        return ok;
+    }
+    static bool send( http_conn& c ) {
+        c.m_batch_ns = metrics::now_ns();
+        return c.write();
+    }
+    // 不保持连接的请求发送完后，服务器会关闭连接；这里只重置连接的状态，继续使用同一个socketpair
+    static void reset( http_conn& c ) {
+        c.unmap();
+        c.init();
+    }
+};
+
+struct corpus {
+    std::string name;
+    std::string request;
+};
+
+static std::vector< corpus > builtin_corpora() {
+    std::vector< corpus > list;
+    corpus c;
+    c.name = "curl";
+    c.request =
+        "GET /index.html HTTP/1.1\r\n"
+        "Host: 127.0.0.1:10000\r\n"
+        "User-Agent: curl/8.4.0\r\n"
+        "Accept: */*\r\n"
+        "\r\n";
+    list.push_back( c );
+    c.name = "chrome";
+    c.request =
+        "GET /index.html HTTP/1.1\r\n"
+        "Host: 192.168.110.129:10000\r\n"
+        "Connection: keep-alive\r\n"
+        "Cache-Control: max-age=0\r\n"
+        "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+        "sec-ch-ua-mobile: ?0\r\n"
+        "sec-ch-ua-platform: \"Windows\"\r\n"
+        "Upgrade-Insecure-Requests: 1\r\n"
+        "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n"
+        "Sec-Fetch-Site: none\r\n"
+        "Sec-Fetch-Mode: navigate\r\n"
+        "Sec-Fetch-User: ?1\r\n"
+        "Sec-Fetch-Dest: document\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+        "Cookie: _ga=GA1.1.1234567890.1697000000; session=8f14e45fceea167a5a36dedd4bea2543\r\n"
+        "\r\n";
+    list.push_back( c );
+    c.name = "firefox-image";
+    c.request =
+        "GET /images/image1.jpg HTTP/1.1\r\n"
+        "Host: 192.168.110.129:10000\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:119.0) Gecko/20100101 Firefox/119.0\r\n"
+        "Accept: image/avif,image/webp,*/*\r\n"
+        "Accept-Language: en-US,en;q=0.5\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Connection: keep-alive\r\n"
+        "Referer: http://192.168.110.129:10000/index.html\r\n"
+        "Sec-Fetch-Dest: image\r\n"
+        "Sec-Fetch-Mode: no-cors\r\n"
+        "Sec-Fetch-Site: same-origin\r\n"
+        "\r\n";
+    list.push_back( c );
+    c.name = "googlebot";
+    c.request =
+        "GET /robots.txt HTTP/1.1\r\n"
+        "Host: 192.168.110.129:10000\r\n"
+        "Connection: keep-alive\r\n"
+        "Accept: text/plain,text/html,*/*\r\n"
+        "Accept-Encoding: gzip,deflate,br\r\n"
+        "User-Agent: Mozilla/5.0 (compatible; Googlebot/2.1; +http://www.google.com/bot.html)\r\n"
+        "From: googlebot(at)googlebot.com\r\n"
+        "\r\n";
+    list.push_back( c );
+    // 带很多跟踪Cookie的请求，超过读缓冲区的初始大小
+    c.name = "large-cookie";
+    c.request =
+        "GET /index.html HTTP/1.1\r\n"
+        "Host: 192.168.110.129:10000\r\n"
+        "Connection: keep-alive\r\n"
+        "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.0 Safari/605.1.15\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+        "Cookie: ";
+    for( int i = 0; i < 60; ++i ) {
+        char cookie[ 80 ];
+        snprintf( cookie, sizeof( cookie ), "%strk_%02d=%08x%08x%08x%08x%08x", i ? "; " : "", i,
+                  i * 2654435761u, i * 40503u, i * 2246822519u, i * 3266489917u, i * 668265263u );
+        c.request += cookie;
+    }
+    c.request += "\r\n\r\n";
+    list.push_back( c );
+    // 刷新页面时的条件请求，命中时回复304
+    c.name = "revalidate";
+    c.request =
+        "GET /index.html HTTP/1.1\r\n"
+        "Host: 192.168.110.129:10000\r\n"
+        "Connection: keep-alive\r\n"
+        "Cache-Control: max-age=0\r\n"
+        "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "If-Modified-Since: Sun, 01 Jan 2090 00:00:00 GMT\r\n"
+        "\r\n";
+    list.push_back( c );
+    // 负数的Content-Length：回复400并关闭连接，不能把m_checked_idx移到读缓冲区外面
+    c.name = "bad-length";
+    c.request =
+        "GET /index.html HTTP/1.1\r\n"
+        "Host: 192.168.110.129:10000\r\n"
+        "Connection: keep-alive\r\n"
+        "Content-Length: -100000000\r\n"
+        "\r\n";
+    list.push_back( c );
+    return list;
+}
+
+static bool load_corpus( const char* path, corpus* c ) {
+    FILE* f = fopen( path, "rb" );
+    if( !f ) {
+        return false;
+    }
+    char buf[ 65536 ];
+    size_t len = fread( buf, 1, sizeof( buf ), f );
+    fclose( f );
+    c->name = basename( ( char* )path );
+    c->request.assign( buf, len );
+    return len > 0;
+}
+
+static int open_counter() {
+    struct perf_event_attr attr;
+    memset( &attr, 0, sizeof( attr ) );
+    attr.size = sizeof( attr );
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall( SYS_perf_event_open, &attr, 0, -1, -1, 0 );
+}
+
+static long read_counter( int fd ) {
+    long long value = 0;
+    if( fd < 0 || read( fd, &value, sizeof( value ) ) != sizeof( value ) ) {
+        return -1;
+    }
+    return value;
+}
+
+struct stage_result {
+    double ns;
+    double instructions;
+    double allocations;
+};
+
+// 一个连接加上socketpair的另一端，另一端模拟客户端
+struct bench_conn {
+    http_conn conn;
+    int peer;
+    int epollfd;
+    timer_wheel* wheel;
+};
+
+static bool setup_conn( bench_conn* b ) {
+    int fds[2];
+    if( socketpair( AF_UNIX, SOCK_STREAM, 0, fds ) < 0 ) {
+        return false;
+    }
+    // 响应（包括图片）一次就能写进socket
+    int size = 4 << 20;
+    setsockopt( fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof( size ) );
+    setsockopt( fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof( size ) );
+    fcntl( fds[1], F_SETFL, fcntl( fds[1], F_GETFL ) | O_NONBLOCK );
+    b->peer = fds[1];
+    b->epollfd = epoll_create1( 0 );
+    b->wheel = new timer_wheel( 100 );
+    sockaddr_in addr;
+    memset( &addr, 0, sizeof( addr ) );
+    b->conn.init( fds[0], addr, b->epollfd, b->wheel );
+    return true;
+}
+
+static void drain_peer( bench_conn* b ) {
+    static char sink[ 1 << 16 ];
+    while( recv( b->peer, sink, sizeof( sink ), 0 ) > 0 ) {
+    }
+}
+
+/*
+    处理一个请求，各阶段之间调用probe( stage, begin )和probe( stage, end )。
+    返回false表示请求没有按预期处理完（不完整或发送失败）
+*/
+template< typename Probe >
+static bool run_one( bench_conn* b, const corpus& c, Probe& probe ) {
+    if( ::send( b->peer, c.request.data(), c.request.size(), 0 ) != ( ssize_t )c.request.size() ) {
+        return false;
+    }
+    http_conn& conn = b->conn;
+    probe.begin( B_RECV );
+    bool ok = pipeline_bench::recv( conn );
+    probe.end( B_RECV );
+    if( !ok ) {
+        return false;
+    }
+    probe.begin( B_PARSE );
+    http_conn::HTTP_CODE ret = pipeline_bench::parse( conn );
+    probe.end( B_PARSE );
+    if( ret == http_conn::NO_REQUEST ) {
+        return false;
+    }
+    if( ret == http_conn::GET_REQUEST ) {
+        probe.begin( B_LOOKUP );
+        ret = pipeline_bench::lookup( conn );
+        probe.end( B_LOOKUP );
+    }
+    probe.begin( B_SERIALIZE );
+    ok = pipeline_bench::serialize( conn, ret );
+    probe.end( B_SERIALIZE );
+    if( !ok ) {
+        return false;
+    }
+    probe.begin( B_SEND );
+    ok = pipeline_bench::send( conn );
+    probe.end( B_SEND );
+    drain_peer( b );
+    if( conn.pending_bytes() > 0 ) {
+        return false;
+    }
+    if( !ok ) {
+        pipeline_bench::reset( conn );
+    }
+    return true;
+}
+
+// 第一轮：每个阶段的耗时和分配次数
+struct time_probe {
+    unsigned long ns[ B_STAGES ];
+    unsigned long allocs[ B_STAGES ];
+    unsigned long t0;
+    unsigned long a0;
+    void begin( int ) {
+        a0 = alloc_count;
+        t0 = metrics::now_ns();
+    }
+    void end( int stage ) {
+        ns[ stage ] += metrics::now_ns() - t0;
+        allocs[ stage ] += alloc_count - a0;
+    }
+};
+
+// 第二轮：每个阶段一个指令计数器，只在这个阶段内打开
+struct count_probe {
+    int fds[ B_STAGES ];
+    void begin( int stage ) {
+        ioctl( fds[ stage ], PERF_EVENT_IOC_ENABLE, 0 );
+    }
+    void end( int stage ) {
+        ioctl( fds[ stage ], PERF_EVENT_IOC_DISABLE, 0 );
+    }
+};
+
+int main( int argc, char* argv[] ) {
+    long rounds = 200000;
+    int opt;
+    while( ( opt = getopt( argc, argv, "n:" ) ) != -1 ) {
+        switch( opt ) {
+            case 'n': rounds = atol( optarg ); break;
+            default:
+                fprintf( stderr, "usage: %s [-n rounds] [request_file...]\n", argv[0] );
+                return 1;
+        }
+    }
+    std::vector< corpus > corpora;
+    if( optind < argc ) {
+        for( int i = optind; i < argc; ++i ) {
+            corpus c;
+            if( !load_corpus( argv[i], &c ) ) {
+                fprintf( stderr, "cannot read %s\n", argv[i] );
+                return 1;
+            }
+            corpora.push_back( c );
+        }
+    } else {
+        corpora = builtin_corpora();
+    }
+
+    doc_root = "resources";
+    // 结果写到原来的标准输出，服务器代码中的printf写到/dev/null
+    FILE* out = fdopen( dup( STDOUT_FILENO ), "w" );
+    if( !out || !freopen( "/dev/null", "w", stdout ) ) {
+        return 1;
+    }
+
+    // 测量自身的开销：空的begin/end
+    time_probe empty_time;
+    memset( &empty_time, 0, sizeof( empty_time ) );
+    for( long r = 0; r < rounds; ++r ) {
+        empty_time.begin( 0 );
+        empty_time.end( 0 );
+    }
+    double time_overhead = ( double )empty_time.ns[0] / rounds;
+
+    count_probe counters;
+    bool have_counters = true;
+    for( int s = 0; s < B_STAGES; ++s ) {
+        counters.fds[s] = open_counter();
+        have_counters = have_counters && counters.fds[s] >= 0;
+    }
+    double count_overhead = 0;
+    if( have_counters ) {
+        int fd = counters.fds[0];
+        for( long r = 0; r < rounds; ++r ) {
+            counters.begin( 0 );
+            counters.end( 0 );
+        }
+        count_overhead = ( double )read_counter( fd ) / rounds;
+        ioctl( fd, PERF_EVENT_IOC_RESET, 0 );
+    } else {
+        fprintf( out, "perf_event_open failed (%s), instruction counts not available\n", strerror( errno ) );
+    }
+
+    fprintf( out, "%-14s %-10s %10s %14s %12s\n", "corpus", "stage", "ns/req", "instr/req", "allocs/req" );
+    for( size_t i = 0; i < corpora.size(); ++i ) {
+        const corpus& c = corpora[i];
+        bench_conn b;
+        if( !setup_conn( &b ) ) {
+            return 1;
+        }
+        // 预热文件缓存和缓冲区池
+        time_probe warm;
+        memset( &warm, 0, sizeof( warm ) );
+        for( int r = 0; r < 1000; ++r ) {
+            if( !run_one( &b, c, warm ) ) {
+                fprintf( out, "%-14s request was not handled completely, skipped\n", c.name.c_str() );
+                break;
+            }
+        }
+
+        time_probe timing;
+        memset( &timing, 0, sizeof( timing ) );
+        bool ok = true;
+        for( long r = 0; r < rounds && ok; ++r ) {
+            ok = run_one( &b, c, timing );
+        }
+        if( !ok ) {
+            continue;
+        }
+        long instructions[ B_STAGES ];
+        if( have_counters ) {
+            for( int s = 0; s < B_STAGES; ++s ) {
+                ioctl( counters.fds[s], PERF_EVENT_IOC_RESET, 0 );
+            }
+            for( long r = 0; r < rounds && ok; ++r ) {
+                ok = run_one( &b, c, counters );
+            }
+            for( int s = 0; s < B_STAGES; ++s ) {
+                instructions[s] = read_counter( counters.fds[s] );
+            }
+        }
+
+        double total_ns = 0, total_instr = 0, total_allocs = 0;
+        for( int s = 0; s < B_STAGES; ++s ) {
+            // 没有经过lookup的请求（比如400）这一阶段的次数少于rounds，仍按请求数平均
+            double ns = ( double )timing.ns[s] / rounds;
+            double allocs = ( double )timing.allocs[s] / rounds;
+            double instr = have_counters ? ( double )instructions[s] / rounds : 0;
+            if( timing.ns[s] > 0 ) {
+                ns -= time_overhead;
+                instr -= count_overhead;
+            }
+            total_ns += ns;
+            total_instr += instr;
+            total_allocs += allocs;
+            char instr_text[ 32 ] = "-";
+            if( have_counters ) {
+                snprintf( instr_text, sizeof( instr_text ), "%.0f", instr );
+            }
+            fprintf( out, "%-14s %-10s %10.1f %14s %12.2f\n", s == 0 ? c.name.c_str() : "", STAGE_NAMES[s], ns, instr_text, allocs );
+        }
+        char instr_text[ 32 ] = "-";
+        if( have_counters ) {
+            snprintf( instr_text, sizeof( instr_text ), "%.0f", total_instr );
+        }
+        fprintf( out, "%-14s %-10s %10.1f %14s %12.2f\n", "", "total", total_ns, instr_text, total_allocs );
+        b.conn.close_conn();
+        close( b.peer );
+        close( b.epollfd );
+        delete b.wheel;
+    }
+    fclose( out );
+    return 0;
+}
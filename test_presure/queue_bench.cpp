@@ -0,0 +1,125 @@
+/*
+    线程池请求队列的微基准：比较 locked_queue、lockfree_queue 和 stealing_queue 的入队/出队吞吐量。
+    线程数为 1~64，一半线程做生产者、一半做消费者（1个线程时生产者和消费者各1个）。
+    每种配置传递同样数量的元素，输出每秒完成的入队+出队操作数。
+
+    编译运行（在仓库根目录）：
+        g++ -O2 -pthread -I. test_presure/queue_bench.cpp -o queue_bench && ./queue_bench
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <atomic>
+#include "work_queue.h"
+
+#define TOTAL_ITEMS 2000000     // 每种配置传递的元素总数
+#define QUEUE_SIZE 10000        // 与线程池默认的max_requests相同
+
+template< typename Q >
+struct bench_ctx {
+    Q* queue;
+    int producers;
+    int consumers;
+    long per_producer;
+    std::atomic< long > consumed;
+};
+
+// 线程参数：共享的上下文和线程自己的编号
+template< typename Q >
+struct thread_arg {
+    bench_ctx< Q >* ctx;
+    int index;
+};
+
+template< typename Q >
+void* producer( void* arg ) {
+    bench_ctx< Q >* ctx = ( ( thread_arg< Q >* )arg )->ctx;
+    for( long i = 1; i <= ctx->per_producer; ++i ) {
+        // 队列满时让出CPU，相当于主线程入队失败后稍后重试；affinity模拟按连接分配
+        while( !ctx->queue->push( ( int* )i, ( unsigned int )i ) ) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+template< typename Q >
+void* consumer( void* arg ) {
+    bench_ctx< Q >* ctx = ( ( thread_arg< Q >* )arg )->ctx;
+    int index = ( ( thread_arg< Q >* )arg )->index;
+    int* item;
+    while( ctx->queue->pop( item, index ) ) {
+        if( !item ) {
+            break;  // 结束标记
+        }
+        ctx->consumed.fetch_add( 1, std::memory_order_relaxed );
+    }
+    return NULL;
+}
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 返回每秒操作数（一次入队和一次出队各算一次操作）
+template< typename Q >
+double run( int threads ) {
+    bench_ctx< Q > ctx;
+    ctx.producers = threads > 1 ? threads / 2 : 1;
+    ctx.consumers = threads > 1 ? threads - ctx.producers : 1;
+    ctx.queue = new Q( QUEUE_SIZE, ctx.consumers );
+    ctx.per_producer = TOTAL_ITEMS / ctx.producers;
+    ctx.consumed = 0;
+
+    pthread_t* tids = new pthread_t[ ctx.producers + ctx.consumers ];
+    thread_arg< Q >* args = new thread_arg< Q >[ ctx.producers + ctx.consumers ];
+    for( int i = 0; i < ctx.producers + ctx.consumers; ++i ) {
+        args[i].ctx = &ctx;
+        args[i].index = i < ctx.consumers ? i : i - ctx.consumers;
+    }
+    double start = now_seconds();
+    for( int i = 0; i < ctx.consumers; ++i ) {
+        pthread_create( &tids[i], NULL, consumer< Q >, &args[i] );
+    }
+    for( int i = 0; i < ctx.producers; ++i ) {
+        pthread_create( &tids[ ctx.consumers + i ], NULL, producer< Q >, &args[ ctx.consumers + i ] );
+    }
+    for( int i = 0; i < ctx.producers; ++i ) {
+        pthread_join( tids[ ctx.consumers + i ], NULL );
+    }
+    // 等所有元素都被取走后，再给每个消费者一个结束标记
+    while( ctx.consumed.load() < ctx.per_producer * ctx.producers ) {
+        sched_yield();
+    }
+    for( int i = 0; i < ctx.consumers; ++i ) {
+        while( !ctx.queue->push( NULL, i ) ) {
+            sched_yield();
+        }
+    }
+    for( int i = 0; i < ctx.consumers; ++i ) {
+        pthread_join( tids[i], NULL );
+    }
+    double elapsed = now_seconds() - start;
+
+    long ops = 2 * ctx.per_producer * ctx.producers;
+    delete [] tids;
+    delete [] args;
+    delete ctx.queue;
+    return ops / elapsed;
+}
+
+int main( int argc, char* argv[] ) {
+    int counts[] = { 1, 2, 4, 8, 16, 32, 64 };
+    printf( "%8s %18s %18s %18s\n", "threads", "locked ops/s", "lockfree ops/s", "stealing ops/s" );
+    for( unsigned i = 0; i < sizeof( counts ) / sizeof( counts[0] ); ++i ) {
+        double locked = run< locked_queue< int* > >( counts[i] );
+        double lockfree = run< lockfree_queue< int* > >( counts[i] );
+        double stealing = run< stealing_queue< int* > >( counts[i] );
+        printf( "%8d %18.0f %18.0f %18.0f\n", counts[i], locked, lockfree, stealing );
+    }
+    return 0;
+}
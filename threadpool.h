@@ -1,25 +1,44 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
-#include <list>
 #include <cstdio>
 #include <exception>
 #include <pthread.h>
+#include <time.h>
+#include <atomic>
 #include "locker.h"
+#include "work_queue.h"
+#include "logger.h"
 
-// 线程池类，将它定义为模板类是为了代码复用，模板参数T是任务类
-template<typename T>  //请求队列是共享资源，要加锁
+// 线程池类，将它定义为模板类是为了代码复用，模板参数T是任务类型，按值放入队列，需要有process()
+// 模板参数Queue是请求队列的实现策略：locked_queue（互斥锁+信号量）、lockfree_queue（无锁环形队列）
+// 或stealing_queue（每个线程一个队列，空闲线程窃取其他线程的任务）
+template< typename T, template< typename > class Queue = locked_queue >
 class threadpool {
 public:
     /*thread_number是线程池中线程的数量，max_requests是请求队列中最多允许的、等待处理的请求的数量*/
     threadpool(int thread_number = 8, int max_requests = 10000);
     ~threadpool();
-    bool append(T* request);
+    /*affinity是亲和性键，比如连接的fd，相同的键尽量交给同一个工作线程处理*/
+    bool append(const T& request, unsigned int affinity = 0);
+    int thread_number() const { return m_thread_number; }
+    // 请求队列中等待处理的任务数（近似值）
+    int queue_depth() { return m_workqueue.size(); }
+    // 获取第i个工作线程的统计信息
+    void get_worker_stats(int i, worker_stats* stats);
 
 private:
     /*工作线程运行的函数，它不断从工作队列中取出任务并执行之*/
     static void* worker(void* arg);
-    void run();
+    void run(int index);
+
+    // 工作线程的参数和计数器，每个线程独占一个缓存行，只有它自己写（和指标的分片一样先读再写，不用原子加），输出指标时读
+    struct alignas( 64 ) worker_slot {
+        threadpool* pool;
+        int index;
+        std::atomic<unsigned long> tasks;
+        std::atomic<unsigned long> idle_us;
+    };
 
 private:
     // 线程的数量
@@ -28,29 +47,23 @@ private:
     // 描述线程池的数组，大小为m_thread_number    
     pthread_t * m_threads;
 
+    // 每个工作线程的参数和计数器，大小为m_thread_number
+    worker_slot * m_slots;
+
     // 请求队列中最多允许的、等待处理的请求的数量  
     int m_max_requests; 
     
-    // 请求队列
-    std::list< T* > m_workqueue;  //用一个列表表来表示请求队列
-
-    // 保护请求队列的互斥锁
-    locker m_queuelocker; //用来对共享资源的保护  
-    /*
-       信号量针对初始值的不同，既可以是互斥信号量，又可以是同步互斥量
-    */
-    // 是否有任务需要处理
-    sem m_queuestat;  //同步信号量
-    
+    // 请求队列，同步方式由队列策略决定
+    Queue< T > m_workqueue;
 
     // 是否结束线程          
     bool m_stop;                    
 };
 
-template< typename T >
-threadpool< T >::threadpool(int thread_number, int max_requests) : 
-        m_thread_number(thread_number), m_max_requests(max_requests), 
-        m_stop(false), m_threads(NULL) {
+template< typename T, template< typename > class Queue >
+threadpool< T, Queue >::threadpool(int thread_number, int max_requests) : 
+        m_thread_number(thread_number), m_threads(NULL), m_slots(NULL), m_max_requests(max_requests), 
+        m_workqueue(max_requests, thread_number), m_stop(false) {
 
     if((thread_number <= 0) || (max_requests <= 0) ) {
         throw std::exception();
@@ -60,68 +73,80 @@ threadpool< T >::threadpool(int thread_number, int max_requests) :
     if(!m_threads) {
         throw std::exception();
     }
+    m_slots = new worker_slot[m_thread_number];
+    for ( int i = 0; i < thread_number; ++i ) {
+        m_slots[i].pool = this;
+        m_slots[i].index = i;
+        m_slots[i].tasks.store( 0, std::memory_order_relaxed );
+        m_slots[i].idle_us.store( 0, std::memory_order_relaxed );
+    }
 
     // 创建thread_number 个线程，并将他们设置为脱离线程。//与主线程分离
     for ( int i = 0; i < thread_number; ++i ) {
-        printf( "create the %dth thread\n", i);
-        if(pthread_create(m_threads + i, NULL, worker, this ) != 0) {
+        LOG_INFO( "create the %dth thread", i );
+        if(pthread_create(m_threads + i, NULL, worker, m_slots + i ) != 0) {
             delete [] m_threads;
+            delete [] m_slots;
             throw std::exception();
         }
         
         if( pthread_detach( m_threads[i] ) ) {
             delete [] m_threads;
+            delete [] m_slots;
             throw std::exception();
         }
     }
 }
 
-template< typename T >
-threadpool< T >::~threadpool() {
+template< typename T, template< typename > class Queue >
+threadpool< T, Queue >::~threadpool() {
     delete [] m_threads;
     m_stop = true;
+    m_workqueue.stop( m_thread_number );
+    delete [] m_slots;
 }
 
-template< typename T >
-bool threadpool< T >::append( T* request )
+template< typename T, template< typename > class Queue >
+bool threadpool< T, Queue >::append( const T& request, unsigned int affinity )
 {
-    // 操作工作队列时一定要加锁，因为它被所有线程共享。
-    m_queuelocker.lock();
-    if ( m_workqueue.size() > m_max_requests ) {
-        m_queuelocker.unlock();
-        return false;
-    }
-    m_workqueue.push_back(request);
-    m_queuelocker.unlock();
-    m_queuestat.post(); //增加信号量，资源数增加一个
-    return true;
+    // 队列已满时返回false
+    return m_workqueue.push( request, affinity );
 }
 
-template< typename T >
-void* threadpool< T >::worker( void* arg )
+template< typename T, template< typename > class Queue >
+void threadpool< T, Queue >::get_worker_stats( int i, worker_stats* stats )
 {
-    threadpool* pool = ( threadpool* )arg;  //传了一个this参数
-    pool->run();
+    m_workqueue.get_stats( i, stats );
+    stats->tasks = m_slots[i].tasks.load( std::memory_order_relaxed );
+    stats->idle_us = m_slots[i].idle_us.load( std::memory_order_relaxed );
+}
+
+template< typename T, template< typename > class Queue >
+void* threadpool< T, Queue >::worker( void* arg )
+{
+    worker_slot* slot = ( worker_slot* )arg;  //传了线程自己的参数
+    threadpool* pool = slot->pool;
+    pool->run( slot->index );
     return pool;
 }
 
-template< typename T >
-void threadpool< T >::run() {
+template< typename T, template< typename > class Queue >
+void threadpool< T, Queue >::run( int index ) {
 
+    worker_slot& slot = m_slots[index];
+    struct timespec begin, end;
     while (!m_stop) {
-        m_queuestat.wait();  //有没有剩余任务
-        m_queuelocker.lock();//利用互斥锁，将共享资源，任务队列锁住
-        if ( m_workqueue.empty() ) {
-            m_queuelocker.unlock();
-            continue;
-        }
-        T* request = m_workqueue.front(); //取出一个任务来
-        m_workqueue.pop_front(); 
-        m_queuelocker.unlock();
-        if ( !request ) {
-            continue;
+        T request;
+        clock_gettime( CLOCK_MONOTONIC, &begin );
+        if ( !m_workqueue.pop( request, index ) ) {   //队列为空时阻塞，直到取出一个任务
+            break;
         }
-        request->process();  //取出一个任务，处理该任务
+        clock_gettime( CLOCK_MONOTONIC, &end );
+        // 在pop中等待的时间算作空闲时间
+        unsigned long idle = ( end.tv_sec - begin.tv_sec ) * 1000000 + ( end.tv_nsec - begin.tv_nsec ) / 1000;
+        slot.idle_us.store( slot.idle_us.load( std::memory_order_relaxed ) + idle, std::memory_order_relaxed );
+        request.process();  //取出一个任务，处理该任务
+        slot.tasks.store( slot.tasks.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
     }
 
 }
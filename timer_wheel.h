@@ -0,0 +1,157 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdio.h>
+
+// 定时器节点，嵌入在需要定时的对象中（比如http_conn），不需要单独分配内存
+class wheel_timer {
+public:
+    wheel_timer() : prev( NULL ), next( NULL ), expire( 0 ), cb_func( NULL ), user_data( NULL ) {}
+    bool pending() const { return next != NULL; }   // 是否在时间轮中
+
+public:
+    wheel_timer* prev;
+    wheel_timer* next;
+    unsigned long expire;               // 到期的tick，使用绝对时间
+    void (*cb_func)( void* );           // 任务回调函数，参数是user_data
+    void* user_data;
+};
+
+/*
+    分层时间轮（与Linux内核早期的定时器实现相同）。
+    第0层有256个槽，每个槽对应一个tick；第1~3层各有64个槽，每个槽分别对应256、256*64、256*64*64个tick。
+    添加、删除、修改定时器都是O(1)；每过一个tick执行第0层的一个槽，第0层转完一圈时把上一层的一个槽重新分散到下层。
+    时间轮本身不加锁，只能由拥有它的线程（反应堆线程）操作。
+*/
+class timer_wheel {
+public:
+    static const int TV1_BITS = 8;
+    static const int TVN_BITS = 6;
+    static const int TV1_SIZE = 1 << TV1_BITS;
+    static const int TVN_SIZE = 1 << TVN_BITS;
+    static const int LEVELS = 4;                // 1个256槽的层 + 3个64槽的层
+    static const unsigned long MAX_TICKS = ( 1UL << ( TV1_BITS + 3 * TVN_BITS ) ) - 1;
+
+public:
+    explicit timer_wheel( int tick_ms ) : m_tick_ms( tick_ms ), m_current( 0 ), m_count( 0 ) {
+        for( int i = 0; i < TV1_SIZE; ++i ) {
+            init_head( &m_tv1[i] );
+        }
+        for( int level = 0; level < LEVELS - 1; ++level ) {
+            for( int i = 0; i < TVN_SIZE; ++i ) {
+                init_head( &m_tvn[level][i] );
+            }
+        }
+    }
+
+    int tick_ms() const { return m_tick_ms; }
+    int size() const { return m_count; }
+
+    // 将定时器添加到时间轮中，timeout_ms毫秒后到期；如果已经在时间轮中则先删除
+    void add_timer( wheel_timer* timer, unsigned long timeout_ms ) {
+        if( timer->pending() ) {
+            unlink( timer );
+        }
+        unsigned long ticks = ( timeout_ms + m_tick_ms - 1 ) / m_tick_ms;
+        if( ticks == 0 ) {
+            ticks = 1;
+        }
+        if( ticks > MAX_TICKS ) {
+            ticks = MAX_TICKS;
+        }
+        timer->expire = m_current + ticks;
+        place( timer );
+        m_count++;
+    }
+
+    // 将定时器从时间轮中删除，不在时间轮中时什么也不做
+    void del_timer( wheel_timer* timer ) {
+        if( timer->pending() ) {
+            unlink( timer );
+        }
+    }
+
+    /* timerfd每次可读时调用，ticks是这期间经过的tick数。依次推进时间轮，执行到期的定时器。
+       回调函数中可以添加或删除任何定时器，包括它自己。 */
+    void tick( unsigned long ticks ) {
+        while( ticks-- > 0 ) {
+            m_current++;
+            int index = m_current & ( TV1_SIZE - 1 );
+            // 第0层转完一圈，把上层对应的槽分散下来，上层转完一圈再继续向上
+            if( index == 0 ) {
+                for( int level = 0; level < LEVELS - 1; ++level ) {
+                    int slot = ( m_current >> ( TV1_BITS + level * TVN_BITS ) ) & ( TVN_SIZE - 1 );
+                    cascade( &m_tvn[level][slot] );
+                    if( slot != 0 ) {
+                        break;
+                    }
+                }
+            }
+            // 逐个摘下到期的定时器再执行回调，回调中修改时间轮不会影响遍历
+            wheel_timer* head = &m_tv1[ index ];
+            while( head->next != head ) {
+                wheel_timer* timer = head->next;
+                unlink( timer );
+                if( timer->cb_func ) {
+                    timer->cb_func( timer->user_data );
+                }
+            }
+        }
+    }
+
+private:
+    static void init_head( wheel_timer* head ) {
+        head->prev = head;
+        head->next = head;
+    }
+
+    // 按到期时间距离现在的远近，把定时器放到对应层的槽中
+    void place( wheel_timer* timer ) {
+        unsigned long expire = timer->expire;
+        unsigned long idx = expire - m_current;
+        wheel_timer* head;
+        if( idx < ( unsigned long )TV1_SIZE ) {
+            head = &m_tv1[ expire & ( TV1_SIZE - 1 ) ];
+        } else {
+            int level = 0;
+            while( level < LEVELS - 2 && idx >= ( 1UL << ( TV1_BITS + ( level + 1 ) * TVN_BITS ) ) ) {
+                level++;
+            }
+            int slot = ( expire >> ( TV1_BITS + level * TVN_BITS ) ) & ( TVN_SIZE - 1 );
+            head = &m_tvn[ level ][ slot ];
+        }
+        // 插入到槽链表的尾部
+        timer->prev = head->prev;
+        timer->next = head;
+        head->prev->next = timer;
+        head->prev = timer;
+    }
+
+    void unlink( wheel_timer* timer ) {
+        timer->prev->next = timer->next;
+        timer->next->prev = timer->prev;
+        timer->prev = NULL;
+        timer->next = NULL;
+        m_count--;
+    }
+
+    // 把一个槽中的所有定时器按新的剩余时间重新放置
+    void cascade( wheel_timer* head ) {
+        wheel_timer* timer = head->next;
+        init_head( head );
+        while( timer != head ) {
+            wheel_timer* next = timer->next;
+            place( timer );
+            timer = next;
+        }
+    }
+
+private:
+    int m_tick_ms;                              // 每个tick的毫秒数
+    unsigned long m_current;                    // 当前的tick
+    int m_count;                                // 时间轮中的定时器数量
+    wheel_timer m_tv1[ TV1_SIZE ];
+    wheel_timer m_tvn[ LEVELS - 1 ][ TVN_SIZE ];
+};
+
+#endif
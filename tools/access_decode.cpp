@@ -0,0 +1,130 @@
+/*
+    访问日志的解码工具：把服务器用-a写出的段文件（access-<创建时间>.bin）转换成文本，每条记录一行。
+    默认的格式类似combined日志，最后三列是排队、处理和发送的耗时（微秒）：
+        127.0.0.1:52344 [17/Oct/2026:10:00:00.123456 +0800] "GET /index.html" 200 1024 12 35 80 keep-alive
+    -c 输出CSV，第一行是列名，时间是UNIX时间（微秒），方便导入其他工具分析。
+    多个文件按参数的顺序输出；段文件名按创建时间排序，用通配符传入即是写入的顺序。
+    服务器异常退出时段文件没有截断，只读取头部中used记录的部分。
+
+    编译运行（在仓库根目录）：
+        g++ -O2 -I. tools/access_decode.cpp -o access_decode && ./access_decode logs/access-*.bin
+*/
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "access_log.h"
+
+static bool csv = false;
+
+// CSV中的URL用双引号括起来，其中的双引号写两遍
+static void print_csv_url( const access_record* r ) {
+    putchar( '"' );
+    for ( int i = 0; i < r->url_len; ++i ) {
+        if ( r->url[i] == '"' ) {
+            putchar( '"' );
+        }
+        putchar( r->url[i] );
+    }
+    putchar( '"' );
+}
+
+static void print_record( const access_record* r ) {
+    char addr[ INET_ADDRSTRLEN ];
+    struct in_addr in;
+    in.s_addr = r->addr;
+    inet_ntop( AF_INET, &in, addr, sizeof( addr ) );
+    int url_len = r->url_len <= access_record::URL_SIZE ? r->url_len : access_record::URL_SIZE;
+    if ( csv ) {
+        printf( "%lu,%s,%u,%s,", r->ts_us, addr, r->port, access_method_name( r->method ) );
+        print_csv_url( r );
+        printf( ",%d,%u,%lu,%u,%u,%u,%d\n", ( r->flags & access_record::URL_TRUNCATED ) ? 1 : 0, r->status, r->bytes,
+                r->queue_us, r->service_us, r->write_us, ( r->flags & access_record::KEEP_ALIVE ) ? 1 : 0 );
+        return;
+    }
+    time_t sec = r->ts_us / 1000000;
+    struct tm tm;
+    localtime_r( &sec, &tm );
+    char date[ 64 ];
+    strftime( date, sizeof( date ), "%d/%b/%Y:%H:%M:%S", &tm );
+    char zone[ 16 ];
+    strftime( zone, sizeof( zone ), "%z", &tm );
+    printf( "%s:%u [%s.%06lu %s] \"%s %.*s%s\" %u %lu %u %u %u %s\n", addr, r->port, date, r->ts_us % 1000000, zone,
+            access_method_name( r->method ), url_len, r->url, ( r->flags & access_record::URL_TRUNCATED ) ? "..." : "",
+            r->status, r->bytes, r->queue_us, r->service_us, r->write_us,
+            ( r->flags & access_record::KEEP_ALIVE ) ? "keep-alive" : "close" );
+}
+
+// 解码一个段文件，返回记录数，文件不是段文件时返回-1
+static long decode( const char* path ) {
+    int fd = open( path, O_RDONLY );
+    if ( fd < 0 ) {
+        fprintf( stderr, "%s: cannot open\n", path );
+        return -1;
+    }
+    struct stat st;
+    fstat( fd, &st );
+    if ( ( size_t )st.st_size < sizeof( access_segment_header ) ) {
+        fprintf( stderr, "%s: too short\n", path );
+        close( fd );
+        return -1;
+    }
+    char* base = ( char* )mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if ( base == MAP_FAILED ) {
+        fprintf( stderr, "%s: cannot map\n", path );
+        return -1;
+    }
+    const access_segment_header* header = ( const access_segment_header* )base;
+    long count = -1;
+    if ( memcmp( header->magic, "WSACCESS", 8 ) != 0 ) {
+        fprintf( stderr, "%s: not an access log segment\n", path );
+    } else if ( header->version != access_segment_header::VERSION || header->record_size != sizeof( access_record ) ) {
+        fprintf( stderr, "%s: unsupported version %u (record size %u)\n", path, header->version, header->record_size );
+    } else {
+        // used可能比文件长（截断时出错），只读文件中完整的记录
+        unsigned long used = header->used;
+        if ( used > st.st_size - sizeof( access_segment_header ) ) {
+            used = st.st_size - sizeof( access_segment_header );
+        }
+        count = used / sizeof( access_record );
+        const access_record* records = ( const access_record* )( base + sizeof( access_segment_header ) );
+        for ( long i = 0; i < count; ++i ) {
+            print_record( &records[i] );
+        }
+    }
+    munmap( base, st.st_size );
+    return count;
+}
+
+int main( int argc, char* argv[] ) {
+    int opt;
+    while ( ( opt = getopt( argc, argv, "c" ) ) != -1 ) {
+        switch ( opt ) {
+            case 'c':
+                csv = true;
+                break;
+            default:
+                fprintf( stderr, "usage: %s [-c] segment_file...\n", argv[0] );
+                return 1;
+        }
+    }
+    if ( optind >= argc ) {
+        fprintf( stderr, "usage: %s [-c] segment_file...\n", argv[0] );
+        return 1;
+    }
+    if ( csv ) {
+        printf( "ts_us,addr,port,method,url,url_truncated,status,bytes,queue_us,service_us,write_us,keep_alive\n" );
+    }
+    int failed = 0;
+    for ( int i = optind; i < argc; ++i ) {
+        if ( decode( argv[i] ) < 0 ) {
+            failed++;
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,443 @@
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include "uring_reactor.h"
+#include "admission.h"
+#include "logger.h"
+#include "access_log.h"
+
+static int sys_io_uring_setup( unsigned entries, io_uring_params* p ) {
+    return ( int )syscall( __NR_io_uring_setup, entries, p );
+}
+
+static int sys_io_uring_enter( int fd, unsigned to_submit, unsigned min_complete, unsigned flags ) {
+    return ( int )syscall( __NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0 );
+}
+
+static int sys_io_uring_register( int fd, unsigned opcode, void* arg, unsigned nr_args ) {
+    return ( int )syscall( __NR_io_uring_register, fd, opcode, arg, nr_args );
+}
+
+uring_reactor::uring_reactor( int listenfd, int timerfd, timer_wheel* wheel, conn_table* table, dispatch_func dispatch )
+    : m_listenfd( listenfd ), m_timerfd( timerfd ), m_eventfd( -1 ), m_wheel( wheel ), m_table( table ),
+      m_dispatch( dispatch ), m_ring_fd( -1 ), m_sq_ptr( MAP_FAILED ), m_sq_size( 0 ),
+      m_cq_ptr( MAP_FAILED ), m_cq_size( 0 ), m_buf_ring( NULL ), m_buffers( NULL ), m_buf_tail( 0 ),
+      m_send_ctx( NULL ), m_timer_buf( 0 ), m_event_buf( 0 ) {
+    m_thread = pthread_self();
+}
+
+uring_reactor::~uring_reactor() {
+    if( m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr ) {
+        munmap( m_cq_ptr, m_cq_size );
+    }
+    if( m_sq_ptr != MAP_FAILED ) {
+        munmap( m_sq_ptr, m_sq_size );
+        munmap( m_sqes, m_sq_entries * sizeof( io_uring_sqe ) );
+    }
+    if( m_ring_fd >= 0 ) {
+        close( m_ring_fd );
+    }
+    if( m_buf_ring ) {
+        munmap( m_buf_ring, RECV_BUFFER_COUNT * sizeof( io_uring_buf ) );
+    }
+    if( m_buffers ) {
+        munmap( m_buffers, ( size_t )RECV_BUFFER_COUNT * RECV_BUFFER_SIZE );
+    }
+    if( m_eventfd >= 0 ) {
+        close( m_eventfd );
+    }
+    delete [] m_send_ctx;
+}
+
+// 建一个小的io_uring，试着注册缓冲区环：内核支持缓冲区环（5.19）时也支持multishot accept
+bool uring_reactor::supported() {
+    io_uring_params params;
+    memset( &params, 0, sizeof( params ) );
+    int fd = sys_io_uring_setup( 4, &params );
+    if( fd < 0 ) {
+        return false;
+    }
+    bool ok = ( params.features & IORING_FEAT_SUBMIT_STABLE ) && ( params.features & IORING_FEAT_NODROP );
+    void* ring = mmap( NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if( ok && ring != MAP_FAILED ) {
+        io_uring_buf_reg reg;
+        memset( &reg, 0, sizeof( reg ) );
+        reg.ring_addr = ( unsigned long )ring;
+        reg.ring_entries = 4;
+        reg.bgid = 0;
+        ok = sys_io_uring_register( fd, IORING_REGISTER_PBUF_RING, &reg, 1 ) == 0;
+    }
+    if( ring != MAP_FAILED ) {
+        munmap( ring, 4096 );
+    }
+    close( fd );
+    return ok;
+}
+
+bool uring_reactor::setup_ring() {
+    io_uring_params params;
+    memset( &params, 0, sizeof( params ) );
+    // 只有反应堆线程提交，完成事件也在它进入内核时才处理，不需要内核打断它
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    m_ring_fd = sys_io_uring_setup( RING_ENTRIES, &params );
+    if( m_ring_fd < 0 && errno == EINVAL ) {
+        memset( &params, 0, sizeof( params ) );
+        m_ring_fd = sys_io_uring_setup( RING_ENTRIES, &params );
+    }
+    if( m_ring_fd < 0 ) {
+        return false;
+    }
+
+    m_sq_entries = params.sq_entries;
+    m_sq_size = params.sq_off.array + params.sq_entries * sizeof( unsigned );
+    m_cq_size = params.cq_off.cqes + params.cq_entries * sizeof( io_uring_cqe );
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if( single_mmap && m_cq_size > m_sq_size ) {
+        m_sq_size = m_cq_size;
+    }
+    m_sq_ptr = mmap( NULL, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING );
+    if( m_sq_ptr == MAP_FAILED ) {
+        return false;
+    }
+    if( single_mmap ) {
+        m_cq_ptr = m_sq_ptr;
+    } else {
+        m_cq_ptr = mmap( NULL, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_CQ_RING );
+        if( m_cq_ptr == MAP_FAILED ) {
+            return false;
+        }
+    }
+    m_sqes = ( io_uring_sqe* )mmap( NULL, m_sq_entries * sizeof( io_uring_sqe ), PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES );
+    if( m_sqes == MAP_FAILED ) {
+        return false;
+    }
+
+    char* sq = ( char* )m_sq_ptr;
+    m_sq_head = ( unsigned* )( sq + params.sq_off.head );
+    m_sq_tail = ( unsigned* )( sq + params.sq_off.tail );
+    m_sq_mask = *( unsigned* )( sq + params.sq_off.ring_mask );
+    // 提交队列的下标数组固定为第i项指向第i个SQE，之后只移动tail
+    unsigned* array = ( unsigned* )( sq + params.sq_off.array );
+    for( unsigned i = 0; i < m_sq_entries; ++i ) {
+        array[i] = i;
+    }
+    m_sqe_tail = *m_sq_tail;
+
+    char* cq = ( char* )m_cq_ptr;
+    m_cq_head = ( unsigned* )( cq + params.cq_off.head );
+    m_cq_tail = ( unsigned* )( cq + params.cq_off.tail );
+    m_cq_mask = *( unsigned* )( cq + params.cq_off.ring_mask );
+    m_cqes = ( io_uring_cqe* )( cq + params.cq_off.cqes );
+
+    m_send_ctx = new send_ctx[ m_sq_entries ];
+    return true;
+}
+
+// 注册接收缓冲区环，把所有缓冲区放进去
+bool uring_reactor::setup_buffers() {
+    size_t ring_size = RECV_BUFFER_COUNT * sizeof( io_uring_buf );
+    void* ring = mmap( NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if( ring == MAP_FAILED ) {
+        return false;
+    }
+    m_buf_ring = ( io_uring_buf_ring* )ring;
+    void* buffers = mmap( NULL, ( size_t )RECV_BUFFER_COUNT * RECV_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if( buffers == MAP_FAILED ) {
+        return false;
+    }
+    m_buffers = ( char* )buffers;
+
+    io_uring_buf_reg reg;
+    memset( &reg, 0, sizeof( reg ) );
+    reg.ring_addr = ( unsigned long )m_buf_ring;
+    reg.ring_entries = RECV_BUFFER_COUNT;
+    reg.bgid = 0;
+    if( sys_io_uring_register( m_ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1 ) != 0 ) {
+        return false;
+    }
+    m_buf_tail = 0;
+    for( unsigned i = 0; i < RECV_BUFFER_COUNT; ++i ) {
+        recycle_buffer( ( unsigned short )i );
+    }
+    return true;
+}
+
+// 把缓冲区bid放回环中，内核在下一次接收时可以再用它。
+// 环的第0项和tail共用前16个字节；内核头文件中的bufs在C++中被编译成偏移8（空结构体占1字节），不能直接用，自己按偏移0计算
+void uring_reactor::recycle_buffer( unsigned short bid ) {
+    io_uring_buf* buf = ( io_uring_buf* )m_buf_ring + ( m_buf_tail & ( RECV_BUFFER_COUNT - 1 ) );
+    buf->addr = ( unsigned long )( m_buffers + ( size_t )bid * RECV_BUFFER_SIZE );
+    buf->len = RECV_BUFFER_SIZE;
+    buf->bid = bid;
+    m_buf_tail++;
+    __atomic_store_n( &m_buf_ring->tail, m_buf_tail, __ATOMIC_RELEASE );
+}
+
+// 取一个空闲的SQE，提交队列满了时先提交已经填好的
+io_uring_sqe* uring_reactor::get_sqe() {
+    while( m_sqe_tail - __atomic_load_n( m_sq_head, __ATOMIC_ACQUIRE ) >= m_sq_entries ) {
+        if( submit( 0 ) < 0 && errno != EINTR && errno != EBUSY ) {
+            return NULL;
+        }
+    }
+    io_uring_sqe* sqe = &m_sqes[ m_sqe_tail & m_sq_mask ];
+    m_sqe_tail++;
+    memset( sqe, 0, sizeof( *sqe ) );
+    return sqe;
+}
+
+// 提交所有填好的SQE，wait_nr大于0时等待至少这么多个完成事件
+int uring_reactor::submit( unsigned wait_nr ) {
+    __atomic_store_n( m_sq_tail, m_sqe_tail, __ATOMIC_RELEASE );
+    unsigned to_submit = m_sqe_tail - __atomic_load_n( m_sq_head, __ATOMIC_ACQUIRE );
+    return sys_io_uring_enter( m_ring_fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0 );
+}
+
+// 一个SQE持续接受新连接，直到出错（完成事件不带IORING_CQE_F_MORE）时重新提交。
+// multishot accept不能可靠地为每个连接返回对方地址，连接的地址留空
+void uring_reactor::prep_accept() {
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = m_listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = make_data( 0, OP_ACCEPT, m_listenfd );
+}
+
+// 读timerfd或eventfd的8字节计数
+void uring_reactor::prep_read( int fd, unsigned long long* buf, URING_OP op ) {
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = ( unsigned long )buf;
+    sqe->len = sizeof( *buf );
+    sqe->user_data = make_data( 0, op, fd );
+}
+
+// 接收时由内核从缓冲区环中选一块
+void uring_reactor::prep_recv( http_conn* conn ) {
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->get_sockfd();
+    sqe->len = RECV_BUFFER_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = make_data( conn, OP_RECV );
+    m_pending[ ( unsigned int )conn->handle() ] = OP_RECV;
+}
+
+// 发送连接这一批响应中从当前位置起的数据，部分发送时在完成事件中继续
+void uring_reactor::prep_send( http_conn* conn ) {
+    io_uring_sqe* sqe = get_sqe();
+    send_ctx* ctx = &m_send_ctx[ ( m_sqe_tail - 1 ) & m_sq_mask ];
+    bool more = false;
+    memset( &ctx->msg, 0, sizeof( ctx->msg ) );
+    ctx->msg.msg_iov = ctx->iv;
+    ctx->msg.msg_iovlen = conn->gather_segments( ctx->iv, &more );
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->get_sockfd();
+    sqe->addr = ( unsigned long )&ctx->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = make_data( conn, OP_SEND );
+    m_pending[ ( unsigned int )conn->handle() ] = OP_SEND;
+}
+
+void uring_reactor::rearm( http_conn* conn, unsigned long handle, int ev ) {
+    if( pthread_equal( pthread_self(), m_thread ) ) {
+        apply( conn, handle, ev );
+        return;
+    }
+    // 工作线程不能操作提交队列，交给反应堆；队列由空变为非空时才需要唤醒它
+    m_ready_lock.lock();
+    bool wake = m_ready.empty();
+    ready_conn ready = { conn, handle, ev };
+    m_ready.push_back( ready );
+    m_ready_lock.unlock();
+    if( wake ) {
+        unsigned long long one = 1;
+        ssize_t ret = ::write( m_eventfd, &one, sizeof( one ) );
+        ( void )ret;
+    }
+}
+
+/*
+    在反应堆线程中为连接提交接收或发送。连接已经关闭（槽位上已经是另一代连接或者没有连接，
+    包括槽位被新连接复用后旧连接迟到的rearm），或者已经有请求在进行，都直接忽略，保证一个连接同时只有一个请求。
+*/
+void uring_reactor::apply( http_conn* conn, unsigned long handle, int ev ) {
+    if( m_table->lookup( handle ) != conn || m_pending[ ( unsigned int )handle ] ) {
+        return;
+    }
+    if( ( ev & EPOLLOUT ) && conn->pending_bytes() > 0 ) {
+        prep_send( conn );
+    } else {
+        prep_recv( conn );
+    }
+}
+
+void uring_reactor::drain_ready() {
+    m_ready_lock.lock();
+    m_draining.swap( m_ready );
+    m_ready_lock.unlock();
+    for( size_t i = 0; i < m_draining.size(); ++i ) {
+        apply( m_draining[i].conn, m_draining[i].handle, m_draining[i].ev );
+    }
+    m_draining.clear();
+}
+
+// 取消正在进行的接收或发送（io_uring持有socket的引用，只close不会结束它们），然后异步关闭
+void uring_reactor::close_fd( http_conn* conn ) {
+    int fd = conn->get_sockfd();
+    unsigned char& pending = m_pending[ ( unsigned int )conn->handle() ];
+    if( pending ) {
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = make_data( conn, ( URING_OP )pending );
+        sqe->user_data = make_data( 0, OP_CANCEL, fd );
+        pending = 0;
+    }
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = make_data( 0, OP_CLOSE, fd );
+}
+
+void uring_reactor::handle( const io_uring_cqe* cqe ) {
+    URING_OP op = ( URING_OP )( ( cqe->user_data >> 24 ) & 0xff );
+    // 连接上的请求：低24位是槽位，和高32位的代数一起组成连接的句柄
+    unsigned int slot = ( unsigned int )( cqe->user_data & 0xffffff );
+    unsigned long handle = ( cqe->user_data & ~0xffffffffUL ) | slot;
+    int res = cqe->res;
+
+    switch( op ) {
+        case OP_ACCEPT: {
+            if( !( cqe->flags & IORING_CQE_F_MORE ) ) {
+                prep_accept();
+            }
+            if( res < 0 ) {
+                break;
+            }
+            if( !admission::get_instance()->admit() ) {
+                admission::refuse( res );
+                break;
+            }
+            http_conn* conn = m_table->acquire();
+            if( !conn ) {
+                close( res );
+                break;
+            }
+            sockaddr_in address;
+            memset( &address, 0, sizeof( address ) );
+            conn->init( res, address, -1, m_wheel, NULL, this );
+            unsigned int slot = ( unsigned int )conn->handle();
+            if( slot >= m_pending.size() ) {
+                m_pending.resize( slot + 1, 0 );
+            }
+            prep_recv( conn );
+            break;
+        }
+        case OP_RECV: {
+            bool has_buf = cqe->flags & IORING_CQE_F_BUFFER;
+            unsigned short bid = ( unsigned short )( cqe->flags >> IORING_CQE_BUFFER_SHIFT );
+            http_conn* conn = m_table->lookup( handle );
+            if( !conn ) {
+                // 已经关闭的连接
+                if( has_buf ) {
+                    recycle_buffer( bid );
+                }
+                break;
+            }
+            m_pending[ slot ] = 0;
+            if( res == -ENOBUFS ) {
+                // 缓冲区暂时用完了，这一轮处理完的缓冲区已经还回环中，重新接收
+                prep_recv( conn );
+                break;
+            }
+            bool ok = res > 0 && has_buf && conn->append_input( m_buffers + ( size_t )bid * RECV_BUFFER_SIZE, res );
+            if( has_buf ) {
+                recycle_buffer( bid );
+            }
+            if( ok ) {
+                conn->update_timer();
+                m_dispatch( conn, conn->get_sockfd() );
+            } else {
+                conn->close_conn();
+            }
+            break;
+        }
+        case OP_SEND: {
+            http_conn* conn = m_table->lookup( handle );
+            if( !conn ) {
+                break;
+            }
+            m_pending[ slot ] = 0;
+            if( res <= 0 ) {
+                conn->close_conn();
+                break;
+            }
+            conn->advance( res );
+            if( conn->pending_bytes() > 0 ) {
+                conn->update_timer();
+                prep_send( conn );
+            } else if( !conn->finish_batch() ) {
+                conn->close_conn();
+            } else {
+                conn->update_timer();
+                if( conn->has_pipelined_request() ) {
+                    m_dispatch( conn, conn->get_sockfd() );
+                }
+            }
+            break;
+        }
+        case OP_TIMER:
+            if( res == sizeof( m_timer_buf ) ) {
+                m_wheel->tick( m_timer_buf );
+            }
+            admission::get_instance()->update();
+            access_log::get_instance()->tick();
+            prep_read( m_timerfd, &m_timer_buf, OP_TIMER );
+            break;
+        case OP_EVENT:
+            drain_ready();
+            prep_read( m_eventfd, &m_event_buf, OP_EVENT );
+            break;
+        default:
+            // OP_CANCEL、OP_CLOSE的结果不需要处理
+            break;
+    }
+}
+
+bool uring_reactor::run() {
+    m_thread = pthread_self();
+    m_eventfd = eventfd( 0, EFD_CLOEXEC );
+    if( m_eventfd < 0 || !setup_ring() || !setup_buffers() ) {
+        return false;
+    }
+
+    prep_accept();
+    prep_read( m_timerfd, &m_timer_buf, OP_TIMER );
+    prep_read( m_eventfd, &m_event_buf, OP_EVENT );
+
+    while( true ) {
+        drain_ready();
+        if( submit( 1 ) < 0 && errno != EINTR && errno != EBUSY ) {
+            LOG_ERROR( "io_uring_enter failure, errno is: %d", errno );
+            break;
+        }
+        unsigned head = *m_cq_head;
+        unsigned tail = __atomic_load_n( m_cq_tail, __ATOMIC_ACQUIRE );
+        for( ; head != tail; ++head ) {
+            // 先复制出来再释放这一项，处理过程中可能提交新的请求
+            io_uring_cqe cqe = m_cqes[ head & m_cq_mask ];
+            __atomic_store_n( m_cq_head, head + 1, __ATOMIC_RELEASE );
+            handle( &cqe );
+        }
+    }
+    return true;
+}
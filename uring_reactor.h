@@ -0,0 +1,125 @@
+#ifndef URING_REACTOR_H
+#define URING_REACTOR_H
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <vector>
+#include "locker.h"
+#include "timer_wheel.h"
+#include "http_conn.h"
+#include "conn_table.h"
+
+/*
+    io_uring后端的反应堆，可以在启动时代替epoll反应堆（-e uring）。
+    接受连接、接收、发送、关闭都作为SQE提交，一次io_uring_enter提交这一轮产生的所有请求并等待完成：
+    监听socket上是一个multishot accept，一个SQE持续产生新连接；接收使用注册的缓冲区环（provided buffer ring），
+    空闲的连接不占用自己的读缓冲区，数据到达时内核才从环中取一块，反应堆把它复制到连接的读缓冲区后立即还回环中。
+    和epoll的EPOLLONESHOT一样，每个连接同时最多只有一个接收或发送在进行，工作线程处理完后通过rearm重新提交。
+    timerfd和工作线程的通知（eventfd）也用读请求接入，整个事件循环只有io_uring_enter一个系统调用。
+    直接使用系统调用，不依赖liburing；需要5.19以上的内核（缓冲区环和multishot accept）。
+*/
+class uring_reactor {
+public:
+    typedef void ( *dispatch_func )( http_conn* conn, int sockfd );
+
+    static const unsigned RING_ENTRIES = 1024;      // 提交队列的大小，完成队列是它的两倍
+    static const unsigned RECV_BUFFER_COUNT = 512;  // 接收缓冲区环中的块数，必须是2的幂
+    static const unsigned RECV_BUFFER_SIZE = 4096;  // 每块的大小
+
+    uring_reactor( int listenfd, int timerfd, timer_wheel* wheel, conn_table* table, dispatch_func dispatch );
+    ~uring_reactor();
+
+    // 当前内核是否支持这个后端需要的功能，启动时检查一次，不支持时使用epoll
+    static bool supported();
+
+    // 在反应堆线程中调用：创建io_uring并开始事件循环，失败时返回false
+    bool run();
+
+    // 连接需要继续接收（EPOLLIN）或发送（EPOLLOUT），工作线程和反应堆线程都可以调用。
+    // handle是调用者确认连接还属于自己时取得的句柄，反应堆提交之前发现连接已经换了代数时丢弃
+    void rearm( http_conn* conn, unsigned long handle, int ev );
+    // 关闭连接的socket，取消它正在进行的请求，在连接换代数之前由反应堆线程调用
+    void close_fd( http_conn* conn );
+
+private:
+    // user_data的高32位是连接的代数，中间8位是请求类型，低24位是连接在连接表中的槽位（其他请求是fd）。
+    // 连接关闭时代数加一，旧连接迟到的完成事件按句柄找不到连接，被忽略
+    enum URING_OP { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_EVENT, OP_TIMER, OP_CANCEL, OP_CLOSE };
+
+    // 一个发送请求的msghdr和iovec。内核支持IORING_FEAT_SUBMIT_STABLE，提交之后就不再需要，和SQE一一对应地复用
+    struct send_ctx {
+        struct msghdr msg;
+        struct iovec iv[ http_conn::MAX_SEGMENTS ];
+    };
+
+    struct ready_conn {
+        http_conn* conn;
+        unsigned long handle;
+        int ev;
+    };
+
+private:
+    bool setup_ring();
+    bool setup_buffers();
+    io_uring_sqe* get_sqe();
+    int submit( unsigned wait_nr );
+    void handle( const io_uring_cqe* cqe );
+    void apply( http_conn* conn, unsigned long handle, int ev );
+    void drain_ready();
+
+    void prep_accept();
+    void prep_read( int fd, unsigned long long* buf, URING_OP op );
+    void prep_recv( http_conn* conn );
+    void prep_send( http_conn* conn );
+    void recycle_buffer( unsigned short bid );
+
+    static unsigned long long make_data( unsigned int gen, URING_OP op, int fd ) {
+        return ( ( unsigned long long )gen << 32 ) | ( ( unsigned long long )op << 24 ) | ( unsigned int )fd;
+    }
+    // 连接上的请求：代数和槽位取自连接的句柄
+    static unsigned long long make_data( http_conn* conn, URING_OP op ) {
+        unsigned long handle = conn->handle();
+        return make_data( ( unsigned int )( handle >> 32 ), op, ( int )( unsigned int )handle );
+    }
+
+private:
+    int m_listenfd;
+    int m_timerfd;
+    int m_eventfd;          // 工作线程调用rearm后通知反应堆
+    timer_wheel* m_wheel;
+    conn_table* m_table;
+    dispatch_func m_dispatch;
+    pthread_t m_thread;     // 反应堆线程，在它上面调用rearm时直接提交
+
+    int m_ring_fd;
+    unsigned m_sq_entries;
+    unsigned* m_sq_head;
+    unsigned* m_sq_tail;
+    unsigned m_sq_mask;
+    unsigned m_sqe_tail;    // 已经填好但还没有发布给内核的SQE的结尾
+    io_uring_sqe* m_sqes;
+    unsigned* m_cq_head;
+    unsigned* m_cq_tail;
+    unsigned m_cq_mask;
+    io_uring_cqe* m_cqes;
+    void* m_sq_ptr;
+    size_t m_sq_size;
+    void* m_cq_ptr;
+    size_t m_cq_size;
+
+    io_uring_buf_ring* m_buf_ring;  // 接收缓冲区环，和缓冲区一起在run中分配
+    char* m_buffers;
+    unsigned short m_buf_tail;
+
+    std::vector< unsigned char > m_pending;    // 按槽位记录连接正在进行的OP_RECV或OP_SEND，没有时为0；随本反应堆用到的最大槽位增长
+    send_ctx* m_send_ctx;
+    unsigned long long m_timer_buf;
+    unsigned long long m_event_buf;
+
+    locker m_ready_lock;                // 保护工作线程交来的m_ready
+    std::vector< ready_conn > m_ready;
+    std::vector< ready_conn > m_draining;
+};
+
+#endif
@@ -0,0 +1,435 @@
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <list>
+#include <atomic>
+#include <exception>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include "locker.h"
+
+/*
+    线程池的请求队列策略，作为threadpool的模板参数，几种实现的接口相同：
+    Queue( int max_requests, int workers )
+    bool push( const E& item, unsigned int affinity )   入队，队列已满时返回false；affinity相同的元素尽量交给同一个工作线程
+    bool pop( E& item, int worker )                     第worker个工作线程出队，队列为空时阻塞，stop()之后返回false
+    void stop( int waiters )                            让pop返回false，并唤醒waiters个阻塞在pop上的线程
+    int size()                                          当前队列中的元素个数（近似值）
+    void get_stats( int worker, worker_stats* stats )   填写第worker个工作线程的steals和depth
+*/
+
+// 每个工作线程的统计信息
+struct worker_stats
+{
+    unsigned long tasks;        // 处理过的任务数
+    unsigned long steals;       // 从其他工作线程那里窃取的任务数
+    unsigned long idle_us;      // 因没有任务而挂起的总时间（微秒）
+    int depth;                  // 当前等待该线程处理的任务数，共享队列时为整个队列的长度
+};
+
+// 互斥锁 + 信号量保护的链表队列，每次入队都要分配一个链表节点
+template< typename E >
+class locked_queue {
+public:
+    locked_queue( int max_requests, int ) : m_max_requests( max_requests ), m_stop( false ) {}
+
+    bool push( const E& item, unsigned int = 0 ) {
+        // 操作工作队列时一定要加锁，因为它被所有线程共享。
+        m_queuelocker.lock();
+        if ( ( int )m_workqueue.size() > m_max_requests ) {
+            m_queuelocker.unlock();
+            return false;
+        }
+        m_workqueue.push_back( item );
+        m_queuelocker.unlock();
+        m_queuestat.post(); //增加信号量，资源数增加一个
+        return true;
+    }
+
+    bool pop( E& item, int = 0 ) {
+        while ( !m_stop ) {
+            m_queuestat.wait();  //有没有剩余任务
+            m_queuelocker.lock();//利用互斥锁，将共享资源，任务队列锁住
+            if ( m_workqueue.empty() ) {
+                m_queuelocker.unlock();
+                continue;
+            }
+            item = m_workqueue.front(); //取出一个任务来
+            m_workqueue.pop_front();
+            m_queuelocker.unlock();
+            return true;
+        }
+        return false;
+    }
+
+    void stop( int waiters ) {
+        m_stop = true;
+        for ( int i = 0; i < waiters; ++i ) {
+            m_queuestat.post();
+        }
+    }
+
+    int size() {
+        m_queuelocker.lock();
+        int n = m_workqueue.size();
+        m_queuelocker.unlock();
+        return n;
+    }
+
+    void get_stats( int, worker_stats* stats ) {
+        stats->steals = 0;
+        stats->depth = size();
+    }
+
+private:
+    int m_max_requests;         // 请求队列中最多允许的、等待处理的请求的数量
+    std::list< E > m_workqueue; //用一个列表表来表示请求队列
+    locker m_queuelocker;       // 保护请求队列的互斥锁
+    sem m_queuestat;            // 是否有任务需要处理
+    volatile bool m_stop;
+};
+
+/*
+    无锁的有界多生产者多消费者环形队列（Dmitry Vyukov的算法）。
+    每个槽位带一个序号，生产者和消费者各自用CAS推进tail和head，入队出队都不加锁、不分配内存。
+    head和tail分别独占一个缓存行，避免生产者和消费者之间的伪共享。
+    只有在有工作线程因队列为空而挂起时，生产者才写eventfd唤醒一个线程，队列繁忙时没有任何系统调用。
+*/
+template< typename E >
+class lockfree_queue {
+public:
+    static const int CACHE_LINE = 64;
+    static const int SPIN_COUNT = 64;   // 挂起之前自旋重试的次数
+
+    lockfree_queue( int max_requests, int ) : m_stop( false ), m_parked( 0 ) {
+        // 容量向上取整为2的幂，下标用位与代替取模
+        int capacity = 1;
+        while ( capacity < max_requests ) {
+            capacity <<= 1;
+        }
+        m_mask = capacity - 1;
+        m_cells = new cell[ capacity ];
+        for ( int i = 0; i < capacity; ++i ) {
+            m_cells[i].sequence.store( i, std::memory_order_relaxed );
+        }
+        m_head.value.store( 0, std::memory_order_relaxed );
+        m_tail.value.store( 0, std::memory_order_relaxed );
+        // 信号量语义的eventfd：每次write(1)恰好唤醒一个read
+        m_wakefd = eventfd( 0, EFD_SEMAPHORE );
+        if ( m_wakefd < 0 ) {
+            delete [] m_cells;
+            throw std::exception();
+        }
+    }
+
+    ~lockfree_queue() {
+        close( m_wakefd );
+        delete [] m_cells;
+    }
+
+    bool push( const E& item, unsigned int = 0 ) {
+        if ( !try_push( item ) ) {
+            return false;
+        }
+        // 与pop中的m_parked递增配对：要么生产者看到有线程挂起，要么挂起前的重试能取到这个元素
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        if ( m_parked.load( std::memory_order_relaxed ) > 0 ) {
+            uint64_t one = 1;
+            ssize_t ret = ::write( m_wakefd, &one, sizeof( one ) );
+            ( void )ret;
+        }
+        return true;
+    }
+
+    bool pop( E& item, int = 0 ) {
+        while ( !m_stop.load( std::memory_order_relaxed ) ) {
+            for ( int i = 0; i < SPIN_COUNT; ++i ) {
+                if ( try_pop( item ) ) {
+                    return true;
+                }
+            }
+            // 准备挂起：先登记，再重试一次，防止和生产者之间丢失唤醒
+            m_parked.fetch_add( 1, std::memory_order_seq_cst );
+            if ( try_pop( item ) ) {
+                m_parked.fetch_sub( 1, std::memory_order_relaxed );
+                return true;
+            }
+            uint64_t value;
+            ssize_t ret = ::read( m_wakefd, &value, sizeof( value ) );
+            ( void )ret;
+            m_parked.fetch_sub( 1, std::memory_order_relaxed );
+        }
+        return false;
+    }
+
+    void stop( int waiters ) {
+        m_stop.store( true );
+        uint64_t n = waiters;
+        ssize_t ret = ::write( m_wakefd, &n, sizeof( n ) );
+        ( void )ret;
+    }
+
+    int size() {
+        size_t tail = m_tail.value.load( std::memory_order_relaxed );
+        size_t head = m_head.value.load( std::memory_order_relaxed );
+        return tail > head ? ( int )( tail - head ) : 0;
+    }
+
+    void get_stats( int, worker_stats* stats ) {
+        stats->steals = 0;
+        stats->depth = size();
+    }
+
+private:
+    bool try_push( const E& item ) {
+        size_t pos = m_tail.value.load( std::memory_order_relaxed );
+        for ( ;; ) {
+            cell* c = &m_cells[ pos & m_mask ];
+            size_t seq = c->sequence.load( std::memory_order_acquire );
+            intptr_t diff = ( intptr_t )seq - ( intptr_t )pos;
+            if ( diff == 0 ) {
+                // 槽位空闲，抢占tail
+                if ( m_tail.value.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) ) {
+                    c->data = item;
+                    c->sequence.store( pos + 1, std::memory_order_release );
+                    return true;
+                }
+            } else if ( diff < 0 ) {
+                return false;   // 队列已满
+            } else {
+                pos = m_tail.value.load( std::memory_order_relaxed );
+            }
+        }
+    }
+
+    bool try_pop( E& item ) {
+        size_t pos = m_head.value.load( std::memory_order_relaxed );
+        for ( ;; ) {
+            cell* c = &m_cells[ pos & m_mask ];
+            size_t seq = c->sequence.load( std::memory_order_acquire );
+            intptr_t diff = ( intptr_t )seq - ( intptr_t )( pos + 1 );
+            if ( diff == 0 ) {
+                // 槽位已写入，抢占head
+                if ( m_head.value.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) ) {
+                    item = c->data;
+                    c->sequence.store( pos + m_mask + 1, std::memory_order_release );
+                    return true;
+                }
+            } else if ( diff < 0 ) {
+                return false;   // 队列为空
+            } else {
+                pos = m_head.value.load( std::memory_order_relaxed );
+            }
+        }
+    }
+
+private:
+    struct cell {
+        std::atomic< size_t > sequence;
+        E data;
+    };
+    // 独占一个缓存行的计数器
+    struct alignas( CACHE_LINE ) padded_index {
+        std::atomic< size_t > value;
+        char pad[ CACHE_LINE - sizeof( std::atomic< size_t > ) ];
+    };
+
+    padded_index m_head;            // 消费者出队的位置
+    padded_index m_tail;            // 生产者入队的位置
+    cell* m_cells;
+    size_t m_mask;
+    int m_wakefd;                   // 唤醒挂起的工作线程
+    std::atomic< bool > m_stop;
+    alignas( CACHE_LINE ) std::atomic< int > m_parked;  // 正在挂起等待的工作线程数
+};
+
+/*
+    工作窃取队列：每个工作线程有一个自己的先进先出环形队列（不是Chase-Lev那样所有者从底部后进先出的双端队列）。
+    任务是不同连接上互不相关的请求，由反应堆而不是工作线程自己放入，按到达的顺序处理排队时间最短，所以所有者和窃取者都从头部取。
+    生产者按affinity（比如连接的fd）把任务放进固定的工作线程的队列，同一个keep-alive连接的请求总是落在同一个线程上；
+    工作线程从自己队列的头部取任务，自己的队列空了就从其他线程队列的头部窃取等得最久的任务，都没有任务时在自己的信号量上挂起。
+    目标线程的队列满了时放进最空的队列，所有队列都满了才拒绝，和共享队列一样按总容量限流。
+    每个队列有自己的锁且独占缓存行，生产者和各个工作线程之间不再争抢同一把锁。
+*/
+template< typename E >
+class stealing_queue {
+public:
+    static const int CACHE_LINE = 64;
+
+    stealing_queue( int max_requests, int workers ) : m_workers( workers ), m_stop( false ) {
+        if ( workers <= 0 ) {
+            throw std::exception();
+        }
+        // 每个队列的容量是总容量的平均值，向上取整为2的幂
+        int per_worker = ( max_requests + workers - 1 ) / workers;
+        int capacity = 1;
+        while ( capacity < per_worker ) {
+            capacity <<= 1;
+        }
+        m_rings = new ring[ workers ];
+        for ( int i = 0; i < workers; ++i ) {
+            m_rings[i].items = new E[ capacity ];
+            m_rings[i].mask = capacity - 1;
+            m_rings[i].head = 0;
+            m_rings[i].tail = 0;
+            m_rings[i].parked.store( false, std::memory_order_relaxed );
+            m_rings[i].steals.store( 0, std::memory_order_relaxed );
+        }
+    }
+
+    ~stealing_queue() {
+        for ( int i = 0; i < m_workers; ++i ) {
+            delete [] m_rings[i].items;
+        }
+        delete [] m_rings;
+    }
+
+    bool push( const E& item, unsigned int affinity = 0 ) {
+        int target = affinity % m_workers;
+        if ( !try_push( target, item ) ) {
+            // 这个线程的队列已满，放进最空的队列，由那个线程或者窃取者处理
+            target = least_loaded();
+            if ( !try_push( target, item ) ) {
+                return false;
+            }
+        }
+
+        // 与pop中挂起前的登记配对，保证不会丢失唤醒
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        // 优先唤醒目标线程；它正忙的话唤醒任意一个挂起的线程来窃取
+        if ( !wake( target ) ) {
+            for ( int i = 1; i < m_workers; ++i ) {
+                if ( wake( ( target + i ) % m_workers ) ) {
+                    break;
+                }
+            }
+        }
+        return true;
+    }
+
+    bool pop( E& item, int worker = 0 ) {
+        ring& d = m_rings[ worker ];
+        while ( !m_stop.load( std::memory_order_relaxed ) ) {
+            if ( take( worker, item ) ) {
+                return true;
+            }
+            // 准备挂起：先登记，再检查一遍所有队列
+            d.parked.store( true, std::memory_order_seq_cst );
+            if ( take( worker, item ) ) {
+                d.parked.store( false, std::memory_order_relaxed );
+                return true;
+            }
+            d.wakeup.wait();
+        }
+        return false;
+    }
+
+    void stop( int ) {
+        m_stop.store( true );
+        for ( int i = 0; i < m_workers; ++i ) {
+            m_rings[i].wakeup.post();
+        }
+    }
+
+    int size() {
+        int n = 0;
+        for ( int i = 0; i < m_workers; ++i ) {
+            n += depth( i );
+        }
+        return n;
+    }
+
+    void get_stats( int worker, worker_stats* stats ) {
+        stats->steals = m_rings[ worker ].steals.load( std::memory_order_relaxed );
+        stats->depth = depth( worker );
+    }
+
+private:
+    bool try_push( int worker, const E& item ) {
+        ring& d = m_rings[ worker ];
+        d.lock.lock();
+        if ( d.tail - d.head > d.mask ) {
+            d.lock.unlock();
+            return false;
+        }
+        d.items[ d.tail++ & d.mask ] = item;
+        d.lock.unlock();
+        return true;
+    }
+
+    // 当前任务最少的队列（近似值，检查完之后可能又被放满）
+    int least_loaded() {
+        int best = 0;
+        int best_depth = depth( 0 );
+        for ( int i = 1; i < m_workers && best_depth > 0; ++i ) {
+            int n = depth( i );
+            if ( n < best_depth ) {
+                best = i;
+                best_depth = n;
+            }
+        }
+        return best;
+    }
+
+    // 先取自己队列头部最早的任务，再依次从其他线程队列的头部窃取，被窃取的也是那个队列中等得最久的任务
+    bool take( int worker, E& item ) {
+        ring& d = m_rings[ worker ];
+        d.lock.lock();
+        if ( d.head != d.tail ) {
+            item = d.items[ d.head++ & d.mask ];
+            d.lock.unlock();
+            return true;
+        }
+        d.lock.unlock();
+        for ( int i = 1; i < m_workers; ++i ) {
+            ring& victim = m_rings[ ( worker + i ) % m_workers ];
+            victim.lock.lock();
+            if ( victim.head != victim.tail ) {
+                item = victim.items[ victim.head++ & victim.mask ];
+                victim.lock.unlock();
+                d.steals.fetch_add( 1, std::memory_order_relaxed );
+                return true;
+            }
+            victim.lock.unlock();
+        }
+        return false;
+    }
+
+    // 如果第worker个线程处于挂起状态，唤醒它并返回true
+    bool wake( int worker ) {
+        ring& d = m_rings[ worker ];
+        if ( d.parked.load( std::memory_order_relaxed ) && d.parked.exchange( false ) ) {
+            d.wakeup.post();
+            return true;
+        }
+        return false;
+    }
+
+    int depth( int worker ) {
+        ring& d = m_rings[ worker ];
+        d.lock.lock();
+        int n = d.tail - d.head;
+        d.lock.unlock();
+        return n;
+    }
+
+private:
+    // 每个工作线程的先进先出队列，用环形数组实现，独占缓存行
+    struct alignas( CACHE_LINE ) ring {
+        locker lock;                        // 保护items、head和tail
+        E* items;
+        size_t mask;
+        size_t head;                        // 工作线程和窃取者都从头部取任务
+        size_t tail;                        // 生产者从尾部放入
+        std::atomic< bool > parked;         // 工作线程是否挂起在wakeup上
+        std::atomic< unsigned long > steals;
+        sem wakeup;
+    };
+
+    int m_workers;
+    ring* m_rings;
+    std::atomic< bool > m_stop;
+};
+
+#endif